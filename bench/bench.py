@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+"""Benchmark scenarios for the lln runtime, compared against stored baselines.
+
+    bench.py run [--runs N] [--only a,b] [--out results.json]
+        Run every scenario N times and save the samples as JSON.
+    bench.py compare [--threshold PCT] [--alpha A] baseline.json results.json
+        Compare two result files scenario by scenario, exit 1 on a regression.
+
+Every run measures the throughput (commands per second, over the whole
+`lln -ro` process), the peak RSS and the heap allocations per command, the
+last two with the LD_PRELOAD shim in alloc-count.c. A metric regresses when
+its median is worse than the baseline's by more than the threshold and a
+Mann-Whitney U test says the difference is significant. See
+`make bench-compare`.
+"""
+
+import argparse
+import json
+import math
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+BENCH_DIR = Path(__file__).resolve().parent
+BUILD_DIR = BENCH_DIR / "build"
+ROOT_DIR = BENCH_DIR.parent
+
+# ===== Scenarios =====
+
+def gen_scalars(rng: random.Random, n: int):
+    for i in range(n):
+        if i % 4 == 0:
+            yield "Some reasoning between the commands, as a model would write it."
+        yield f'!scalars({rng.randrange(-1000, 1000)}, {rng.uniform(-1e3, 1e3):.6f}, "key_{i % 97}", {"true" if i % 2 else "false"})'
+
+def gen_text(rng: random.Random, n: int):
+    words = ["lorem", "ipsum", "dolor", "sit", "amet", "\\t", "\\\"quoted\\\"", "caf\\u00e9", "\\n"]
+    for _ in range(n):
+        yield '!text("' + " ".join(rng.choice(words) for _ in range(16)) + '")'
+
+def gen_arrays(rng: random.Random, n: int):
+    for _ in range(n):
+        xs = ", ".join(f"{rng.uniform(-10, 10):.4f}" for _ in range(16))
+        ws = ", ".join(str(rng.randrange(-100, 100)) for _ in range(16))
+        yield f"!dot([{xs}], [{ws}])"
+
+def gen_batch(rng: random.Random, n: int):
+    for i in range(n):
+        yield f'!insert({i}, "name_{rng.randrange(10000)}")'
+
+def gen_memo(rng: random.Random, n: int):
+    for _ in range(n):
+        yield f'!lookup("key_{rng.randrange(500)}", {rng.randrange(4)})'
+
+# name: (generator, commands, extra run options)
+SCENARIOS = {
+    "scalars":          (gen_scalars, 100_000, []),
+    "scalars-pipeline": (gen_scalars, 100_000, ["--pipeline"]),
+    "text":             (gen_text,     50_000, []),
+    "arrays":           (gen_arrays,   20_000, []),
+    "batch":            (gen_batch,   100_000, []),
+    "memo":             (gen_memo,    100_000, []),
+}
+
+# metric: True if higher is better
+METRICS = {
+    "cmds_per_s":     True,
+    "peak_rss_kb":    False,
+    "allocs_per_cmd": False,
+}
+
+def scenario_script(name: str) -> Path:
+    gen, count, _ = SCENARIOS[name]
+    path = BUILD_DIR / f"{name}.lln"
+    if not path.exists():
+        # same seed, same script: runs of a scenario are always comparable
+        rng = random.Random(name)
+        tmp = path.with_suffix(".tmp")
+        with open(tmp, "w") as f:
+            for line in gen(rng, count):
+                f.write(line + "\n")
+        tmp.rename(path)
+    return path
+
+# ===== Running =====
+
+def run_once(lln: Path, script: Path, plugin: Path, shim: Path, flags: list, commands: int) -> dict:
+    with tempfile.NamedTemporaryFile("r", prefix="lln-bench-", suffix=".allocs") as allocs:
+        env = dict(os.environ, LD_PRELOAD=str(shim), LLN_BENCH_ALLOCS=allocs.name)
+        start = time.perf_counter()
+        proc = subprocess.Popen([str(lln), "-ro", str(script), str(plugin), *flags],
+                                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, env=env)
+        proc.wait()
+        elapsed = time.perf_counter() - start
+        if proc.returncode != 0:
+            raise RuntimeError(f"'{script.name}' exited with {proc.returncode}")
+        # written by the shim at exit: allocation calls and peak RSS in KiB
+        count, peak_rss = (int(x) for x in allocs.read().split())
+    return {
+        "cmds_per_s": commands / elapsed,
+        "peak_rss_kb": peak_rss,
+        "allocs_per_cmd": count / commands,
+    }
+
+def git_describe() -> str:
+    try:
+        out = subprocess.run(["git", "-C", str(ROOT_DIR), "describe", "--always", "--dirty"],
+                             capture_output=True, text=True, check=True)
+        return out.stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+def cmd_run(args) -> int:
+    names = args.only.split(",") if args.only else list(SCENARIOS)
+    for name in names:
+        if name not in SCENARIOS:
+            print(f"ERROR: unknown scenario '{name}', expected one of {', '.join(SCENARIOS)}.", file=sys.stderr)
+            return 1
+    BUILD_DIR.mkdir(exist_ok=True)
+    results = {
+        "meta": {
+            "revision": git_describe(),
+            "date": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+            "runs": args.runs,
+            "host": os.uname().nodename,
+            "cpus": os.cpu_count(),
+        },
+        "scenarios": {},
+    }
+    for name in names:
+        _, commands, flags = SCENARIOS[name]
+        script = scenario_script(name)
+        # the first run only warms up the page cache
+        run_once(args.lln, script, args.plugin, args.shim, flags, commands)
+        samples = {metric: [] for metric in METRICS}
+        for _ in range(args.runs):
+            for metric, value in run_once(args.lln, script, args.plugin, args.shim, flags, commands).items():
+                samples[metric].append(value)
+        results["scenarios"][name] = {"commands": commands, "flags": flags, "samples": samples}
+        print(f"{name:<18} {median(samples['cmds_per_s']):>12,.0f} cmd/s "
+              f"{median(samples['peak_rss_kb']):>8,.0f} KiB "
+              f"{median(samples['allocs_per_cmd']):>6.2f} alloc/cmd")
+    args.out.parent.mkdir(parents=True, exist_ok=True)
+    with open(args.out, "w") as f:
+        json.dump(results, f, indent=2)
+        f.write("\n")
+    print(f"Saved {args.out}")
+    return 0
+
+# ===== Statistics =====
+
+def median(xs: list) -> float:
+    s = sorted(xs)
+    mid = len(s) // 2
+    return s[mid] if len(s) % 2 else (s[mid - 1] + s[mid]) / 2
+
+def mann_whitney_p(a: list, b: list) -> float:
+    """Two-sided p-value of the Mann-Whitney U test, normal approximation
+    with tie and continuity corrections (fine from ~8 samples a side)."""
+    n1, n2 = len(a), len(b)
+    n = n1 + n2
+    values = sorted([(x, 0) for x in a] + [(x, 1) for x in b])
+    rank_a = 0.0
+    ties = 0.0
+    i = 0
+    while i < n:
+        j = i
+        while j < n and values[j][0] == values[i][0]:
+            j += 1
+        rank = (i + j + 1) / 2  # average of the ranks i+1..j
+        rank_a += rank * sum(1 for k in range(i, j) if values[k][1] == 0)
+        ties += (j - i) ** 3 - (j - i)
+        i = j
+    u = rank_a - n1 * (n1 + 1) / 2
+    mu = n1 * n2 / 2
+    var = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)))
+    if var <= 0:
+        # every sample is equal (e.g. allocation counts)
+        return 1.0 if u == mu else 0.0
+    z = max(abs(u - mu) - 0.5, 0) / math.sqrt(var)
+    return math.erfc(z / math.sqrt(2))
+
+def bootstrap_ci(a: list, b: list, resamples: int = 2000, level: float = 0.95) -> tuple:
+    """Confidence interval of the relative change of the median, b over a."""
+    rng = random.Random(0)
+    changes = []
+    for _ in range(resamples):
+        ma = median(rng.choices(a, k=len(a)))
+        mb = median(rng.choices(b, k=len(b)))
+        changes.append(mb / ma - 1 if ma else 0.0)
+    changes.sort()
+    lo = changes[int((1 - level) / 2 * resamples)]
+    hi = changes[min(int((1 + level) / 2 * resamples), resamples - 1)]
+    return lo, hi
+
+def fmt(value: float) -> str:
+    for div, suffix in ((1e9, "G"), (1e6, "M"), (1e3, "k")):
+        if abs(value) >= div:
+            return f"{value / div:.2f}{suffix}"
+    return f"{value:.2f}"
+
+def cmd_compare(args) -> int:
+    with open(args.baseline) as f:
+        base = json.load(f)
+    with open(args.results) as f:
+        cur = json.load(f)
+    print(f"baseline {base['meta']['revision']} ({base['meta']['date']}), "
+          f"current {cur['meta']['revision']} ({cur['meta']['date']})")
+    print(f"{'scenario':<18} {'metric':<15} {'baseline':>9} {'current':>9} {'change':>8} "
+          f"{'95% CI':>18} {'p':>7}")
+    regressions = 0
+    for name, scenario in cur["scenarios"].items():
+        if name not in base["scenarios"]:
+            print(f"{name:<18} (not in the baseline)")
+            continue
+        for metric, higher_is_better in METRICS.items():
+            a = base["scenarios"][name]["samples"][metric]
+            b = scenario["samples"][metric]
+            ma, mb = median(a), median(b)
+            change = mb / ma - 1 if ma else 0.0
+            lo, hi = bootstrap_ci(a, b)
+            p = mann_whitney_p(a, b)
+            worse = -change if higher_is_better else change
+            verdict = ""
+            if p < args.alpha and worse * 100 > args.threshold:
+                verdict = "REGRESSION"
+                regressions += 1
+            elif p < args.alpha and -worse * 100 > args.threshold:
+                verdict = "improved"
+            print(f"{name:<18} {metric:<15} {fmt(ma):>9} {fmt(mb):>9} {change * 100:>+7.1f}% "
+                  f"[{lo * 100:>+6.1f}%, {hi * 100:>+6.1f}%] {p:>7.3f} {verdict}")
+    if regressions:
+        print(f"{regressions} regression(s) past {args.threshold:g}% (p < {args.alpha:g})")
+        return 1
+    print(f"No regression past {args.threshold:g}% (p < {args.alpha:g})")
+    return 0
+
+# ===== CLI =====
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="lln benchmark scenarios and baseline comparison")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    run = sub.add_parser("run", help="run the scenarios and save their samples")
+    run.add_argument("--runs", type=int, default=10, help="measured runs per scenario (default 10)")
+    run.add_argument("--only", help="comma-separated scenarios to run, all by default")
+    run.add_argument("--out", type=Path, default=BUILD_DIR / "latest.json")
+    run.add_argument("--lln", type=Path, default=ROOT_DIR / "lln")
+    run.add_argument("--plugin", type=Path, default=BUILD_DIR / "commands.so")
+    run.add_argument("--shim", type=Path, default=BUILD_DIR / "alloc-count.so")
+
+    compare = sub.add_parser("compare", help="compare results against a baseline")
+    compare.add_argument("--threshold", type=float, default=5.0,
+                         help="percent a median may get worse by before it is a regression (default 5)")
+    compare.add_argument("--alpha", type=float, default=0.05,
+                         help="significance level of the Mann-Whitney U test (default 0.05)")
+    compare.add_argument("baseline", type=Path)
+    compare.add_argument("results", type=Path)
+
+    args = parser.parse_args()
+    if args.command == "run":
+        if args.runs < 1:
+            parser.error("--runs must be at least 1")
+        return cmd_run(args)
+    return cmd_compare(args)
+
+if __name__ == "__main__":
+    sys.exit(main())
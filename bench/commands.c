@@ -0,0 +1,45 @@
+#include <lln/lln.h>
+#include <stdio.h>
+#include <string.h>
+
+// Benchmark commands: they only fold their arguments into a sink,
+// so a run measures the runtime rather than the commands
+
+static volatile double sink;
+
+// @post
+void report(void) {
+	fprintf(stderr, "sink %g\n", sink);
+}
+
+// @cmd
+void *scalars(int i, double d, char *s, bool b) {
+	sink += i + d + strlen(s) + b;
+	return NULL;
+}
+
+// @cmd
+void *text(char *s) {
+	sink += strlen(s);
+	return NULL;
+}
+
+// @cmd
+void *dot(double *xs, size_t n, int *ws, size_t m) {
+	double total = 0;
+	for (size_t i = 0; i < n && i < m; i++) total += xs[i] * ws[i];
+	sink += total;
+	return NULL;
+}
+
+// @cmd !insert batch
+void *insert(int *ids, char **names, size_t n) {
+	for (size_t i = 0; i < n; i++) sink += ids[i] + strlen(names[i]);
+	return NULL;
+}
+
+// @cmd pure
+void *lookup(char *key, int version) {
+	sink += strlen(key) + version;
+	return NULL;
+}
@@ -1,13 +1,27 @@
+#define _GNU_SOURCE // dladdr
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dlfcn.h>
-#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 
 #define LLN_STRIP_PREFIX
 #include "lln.h"
 #include "lln-internal.h"
+#include "lln-probes.h"
+
+LLN_PROBE_DEFINE(preproc_entry);
+LLN_PROBE_DEFINE(preproc_cmd);
+LLN_PROBE_DEFINE(preproc_return);
+LLN_PROBE_DEFINE(cc_entry);
+LLN_PROBE_DEFINE(cc_return);
 
 // ===== LLNpreproc =====
 
@@ -49,6 +63,7 @@ typedef enum {
 	CLEXKW_CONST,
 	CLEXKW_STATIC,
 	CLEXKW_INLINE,
+	CLEXKW_DBL,
 	CLEXKW_KIND
 } ClexKeyword;
 
@@ -62,16 +77,57 @@ const char *CLEX_KEYWORDS[] = {
 	"const",
 	"static",
 	"inline",
+	"double",
 	NULL
 };
 
+// Keywords bucketed by length, so a lookup only
+// compares against the candidates that can match
+#define CLEX_KW_MAX_LEN 6
+static const ClexKeyword CLEX_KEYWORDS_BY_LEN[CLEX_KW_MAX_LEN + 1][3] = {
+	[3] = {CLEXKW_INT},
+	[4] = {CLEXKW_CHAR, CLEXKW_VOID, CLEXKW_BOOL},
+	[5] = {CLEXKW_FLT, CLEXKW_CONST},
+	[6] = {CLEXKW_STATIC, CLEXKW_INLINE, CLEXKW_DBL},
+};
+
 ClexKeyword clex_strn_to_keyword(char *start, size_t len) {
-    for (size_t i = 0; CLEX_KEYWORDS[i] != NULL; i++) {
-        size_t key_len = strlen(CLEX_KEYWORDS[i]);
-        if (key_len == len && strncmp(start, CLEX_KEYWORDS[i], len) == 0)
-            return i;
-    }
-    return -1;
+	if (len == 0) return CLEXKW_NO_KW;
+	if (len > CLEX_KW_MAX_LEN) return -1;
+	const ClexKeyword *bucket = CLEX_KEYWORDS_BY_LEN[len];
+	for (size_t i = 0; i < 3 && bucket[i] != CLEXKW_NO_KW; i++) {
+		if (memcmp(start, CLEX_KEYWORDS[bucket[i]], len) == 0)
+			return bucket[i];
+	}
+	return -1;
+}
+
+// Character classes, indexed by byte
+enum {
+	CLEXCC_SPACE = 1 << 0,
+	CLEXCC_SEP   = 1 << 1,
+	CLEXCC_DIGIT = 1 << 2,
+};
+
+static const unsigned char CLEX_CHAR_CLASS[256] = {
+	[' ']  = CLEXCC_SPACE | CLEXCC_SEP,
+	['\t'] = CLEXCC_SPACE | CLEXCC_SEP,
+	['\n'] = CLEXCC_SPACE | CLEXCC_SEP,
+	['\v'] = CLEXCC_SPACE | CLEXCC_SEP,
+	['\f'] = CLEXCC_SPACE | CLEXCC_SEP,
+	['\r'] = CLEXCC_SPACE | CLEXCC_SEP,
+	['.'] = CLEXCC_SEP, [','] = CLEXCC_SEP, [';'] = CLEXCC_SEP,
+	['('] = CLEXCC_SEP, [')'] = CLEXCC_SEP, ['['] = CLEXCC_SEP,
+	[']'] = CLEXCC_SEP, ['{'] = CLEXCC_SEP, ['}'] = CLEXCC_SEP,
+	['*'] = CLEXCC_SEP, ['='] = CLEXCC_SEP,
+	['0'] = CLEXCC_DIGIT, ['1'] = CLEXCC_DIGIT, ['2'] = CLEXCC_DIGIT,
+	['3'] = CLEXCC_DIGIT, ['4'] = CLEXCC_DIGIT, ['5'] = CLEXCC_DIGIT,
+	['6'] = CLEXCC_DIGIT, ['7'] = CLEXCC_DIGIT, ['8'] = CLEXCC_DIGIT,
+	['9'] = CLEXCC_DIGIT,
+};
+
+static inline bool clex_char_is(char c, unsigned char cls) {
+	return CLEX_CHAR_CLASS[(unsigned char) c] & cls;
 }
 
 typedef struct {
@@ -121,7 +177,7 @@ char *clex_chop_while_predicate(Clex *l, bool (*p)(Clex *)) {
 }
 
 static inline bool clex_is_space(Clex *l) {
-	return isspace(l->cur[0]);
+	return clex_char_is(l->cur[0], CLEXCC_SPACE);
 }
 
 static inline bool clex_whole_line(Clex *l) {
@@ -161,11 +217,7 @@ static inline bool clex_in_str(Clex *l) {
 }
 
 static inline bool clex_is_sep(Clex *l) {
-	char separators[] = ".,;()[]{}*=";
-	for (size_t i = 0; separators[i] != '\0'; i++) {
-		if (l->cur[0] == separators[i]) return true;
-	}
-	return isspace(l->cur[0]);
+	return clex_char_is(l->cur[0], CLEXCC_SEP);
 }
 
 static inline bool clex_is_not_sep(Clex *l) {
@@ -173,7 +225,7 @@ static inline bool clex_is_not_sep(Clex *l) {
 }
 
 static inline bool clex_is_digit(Clex *l) {
-	return isdigit(l->cur[0]);
+	return clex_char_is(l->cur[0], CLEXCC_DIGIT);
 }
 
 // (!!) Assumes valid C, pass the file through
@@ -220,7 +272,7 @@ ClexToken *clex_next_token(Clex *l) {
 		if (l->cur[0] == '\\') clex_chop_char(l);
 		clex_chop_char(l);
 		clex_chop_char(l);
-	} else if (isdigit(l->cur[0]) || l->cur[0] == '.') {
+	} else if (clex_is_digit(l) || l->cur[0] == '.') {
 		t.kind = CLEXTOK_NUMLIT;
 		clex_chop_while_predicate(l, clex_is_digit);
 		if (l->cur[0] == '.') {
@@ -376,8 +428,12 @@ typedef struct {
 	char *name;
 	bool is_tag;
 	CommentKeyword kind;
+	bool batch;
+	bool pure;
+	char *timeout; // seconds, as written after 'timeout='
 } CmtMeta;
 
+// '@cmd' may be followed by the command name and modifiers, in any order
 CmtMeta get_comment_metadata(char *text) {
 	CmtMeta cmt = {0};
 	Comlex l = {0};
@@ -387,17 +443,37 @@ CmtMeta get_comment_metadata(char *text) {
 			cmt.is_tag = true;
 			cmt.kind = l.tok.kw;
 			if (l.tok.kw == CMTKW_CMD) {
-				if (comlex_next_token(&l)) cmt.name = l.tok.text_view;
-				return cmt;
+				size_t mods = 0;
+				for (size_t i = 0; comlex_next_token(&l); i++) {
+					if (strcmp(l.tok.text_view, "batch") == 0) cmt.batch = true, mods++;
+					else if (strcmp(l.tok.text_view, "pure") == 0) cmt.pure = true, mods++;
+					else if (strncmp(l.tok.text_view, "timeout=", 8) == 0) {
+						const char *secs = l.tok.text_view + 8;
+						char *end;
+						double t = strtod(secs, &end);
+						if (end == secs || *end || !isfinite(t) || t <= 0) {
+							fprintf(stderr, "ERROR: '@cmd' expects 'timeout=' to be followed by a positive number of seconds, got '%s'.\n", l.tok.text_view);
+							exit(1);
+						}
+						free(cmt.timeout);
+						cmt.timeout = strdup(secs);
+						mods++;
+					}
+					else if (i == mods && !cmt.name) cmt.name = strdup(l.tok.text_view);
+					else break;
+				}
+				break;
 			}
 		}
 	}
+	free(l.sb_tok_text.content);
 	return cmt;
 }
 
 typedef struct {
 	ArgType type;
 	char *name;
+	char *len_name; // arrays only
 } FnArg;
 
 typedef struct {
@@ -406,6 +482,38 @@ typedef struct {
 	size_t capacity;
 } FnArgs;
 
+void fnargs_type_error(Clex *l) {
+	fprint_context(stderr, l->tok.loc, "ERROR: command functions only accept argument types 'char *', 'int', 'int64_t', 'bool', 'float', 'double', arrays ('int *', 'float *' or 'double *') and blobs ('uint8_t *'), the last two followed by a 'size_t' length.\n");
+	exit(1);
+}
+
+// Array and blob arguments are a '<type> *name, size_t len' pair
+// of parameters, starts on the '*'
+void parse_fnarg_array(Clex *l, FnArg *a) {
+	switch (a->type) {
+		case ARG_INT: a->type = ARG_INT_ARR; break;
+		case ARG_FLT: a->type = ARG_FLT_ARR; break;
+		case ARG_DBL: a->type = ARG_DBL_ARR; break;
+		case ARG_BLOB:
+			break;
+		default: fnargs_type_error(l);
+	}
+	clex_next_token(l);
+	if (l->tok.kind != CLEXTOK_SYMBOL) fnargs_type_error(l);
+	a->name = sb_new_cstr(&l->sb_tok_text);
+	clex_next_token(l);
+	if (l->tok.text_view[0] == ',') clex_next_token(l);
+	if (l->tok.kw == CLEXKW_CONST) clex_next_token(l);
+	if (l->tok.kind != CLEXTOK_SYMBOL || strcmp(l->tok.text_view, "size_t") != 0) {
+		fprint_context(stderr, l->tok.loc, "ERROR: %s argument '%s' must be followed by a 'size_t' length.\n", a->type == ARG_BLOB ? "blob" : "array", a->name);
+		exit(1);
+	}
+	clex_next_token(l);
+	if (l->tok.kind != CLEXTOK_SYMBOL) fnargs_type_error(l);
+	a->len_name = sb_new_cstr(&l->sb_tok_text);
+	clex_next_token(l);
+}
+
 FnArgs parse_fnargs(Clex *l) {
 	FnArgs args = {0};
 	while (l->tok.text_view[0] != ')') {
@@ -420,39 +528,97 @@ FnArgs parse_fnargs(Clex *l) {
 				continue;
 			case CLEXKW_CHAR:
 				clex_next_token(l);
-				if (l->tok.text_view[0] != '*') {
-					fprint_context(stderr, l->tok.loc, "ERROR: command functions only accept argument types 'char *', 'int', 'bool' and 'float'.\n");
-					exit(1);
-				}
+				if (l->tok.text_view[0] != '*') fnargs_type_error(l);
 				a.type = ARG_STR;
 				break;
 			case CLEXKW_INT: a.type = ARG_INT; break;
 			case CLEXKW_FLT: a.type = ARG_FLT; break;
+			case CLEXKW_DBL: a.type = ARG_DBL; break;
 			case CLEXKW_BOOL: a.type = ARG_BOOL; break;
+			case CLEXKW_NO_KW:
+				if (l->tok.kind != CLEXTOK_SYMBOL) fnargs_type_error(l);
+				if (strcmp(l->tok.text_view, "int64_t") == 0) a.type = ARG_I64;
+				else if (strcmp(l->tok.text_view, "uint8_t") == 0) a.type = ARG_BLOB; // only valid as a pointer
+				else fnargs_type_error(l);
+				break;
 			case CLEXKW_VOID: 
                 clex_next_token(l);
-				if (l->tok.text_view[0] != ')') {
-					fprint_context(stderr, l->tok.loc, "ERROR: command functions only accept argument types 'char *', 'int', 'bool' and 'float'.\n");
-					exit(1);
-				}
+				if (l->tok.text_view[0] != ')') fnargs_type_error(l);
                 assert(args.count == 0);
                 return args;
 			default:
-				fprint_context(stderr, l->tok.loc, "ERROR: command functions only accept argument types 'char *', 'int', 'bool' and 'float'.\n");
-				exit(1);
+				fnargs_type_error(l);
 		}
 		clex_next_token(l);
-		assert(l->tok.kind == CLEXTOK_SYMBOL);
+		if (a.type != ARG_STR && l->tok.text_view[0] == '*') {
+			parse_fnarg_array(l, &a);
+		} else {
+			if (a.type == ARG_BLOB) fnargs_type_error(l);
+			assert(l->tok.kind == CLEXTOK_SYMBOL);
+			a.name = sb_new_cstr(&l->sb_tok_text);
+			clex_next_token(l);
+		}
+		da_append(&args, a);
+	}
+	return args;
+}
+
+void fnargs_batch_type_error(Clex *l) {
+	fprint_context(stderr, l->tok.loc, "ERROR: batch command functions only accept column pointers 'char **', 'int *', 'int64_t *', 'bool *', 'float *' or 'double *', followed by a 'size_t' call count.\n");
+	exit(1);
+}
+
+// Batch commands take one column per argument, then the
+// number of calls: '<type> *col, ..., size_t n'
+FnArgs parse_fnargs_batch(Clex *l, char **count_name) {
+	FnArgs args = {0};
+	while (1) {
+		FnArg a = {0};
+		clex_next_token(l);
+		if (l->tok.kw == CLEXKW_CONST) clex_next_token(l);
+		if (l->tok.kind == CLEXTOK_SYMBOL && strcmp(l->tok.text_view, "size_t") == 0) break;
+		switch (l->tok.kw) {
+			case CLEXKW_CHAR: a.type = ARG_STR; break;
+			case CLEXKW_INT: a.type = ARG_INT; break;
+			case CLEXKW_FLT: a.type = ARG_FLT; break;
+			case CLEXKW_DBL: a.type = ARG_DBL; break;
+			case CLEXKW_BOOL: a.type = ARG_BOOL; break;
+			case CLEXKW_NO_KW:
+				if (l->tok.kind != CLEXTOK_SYMBOL || strcmp(l->tok.text_view, "int64_t") != 0) fnargs_batch_type_error(l);
+				a.type = ARG_I64;
+				break;
+			default:
+				fnargs_batch_type_error(l);
+		}
+		clex_next_token(l);
+		if (a.type == ARG_STR) {
+			if (l->tok.text_view[0] != '*') fnargs_batch_type_error(l);
+			clex_next_token(l);
+			if (l->tok.kw == CLEXKW_CONST) clex_next_token(l);
+		}
+		if (l->tok.text_view[0] != '*') fnargs_batch_type_error(l);
+		clex_next_token(l);
+		if (l->tok.kind != CLEXTOK_SYMBOL) fnargs_batch_type_error(l);
 		a.name = sb_new_cstr(&l->sb_tok_text);
 		clex_next_token(l);
+		if (l->tok.text_view[0] != ',') fnargs_batch_type_error(l);
 		da_append(&args, a);
 	}
+	clex_next_token(l);
+	if (l->tok.kind != CLEXTOK_SYMBOL) fnargs_batch_type_error(l);
+	*count_name = sb_new_cstr(&l->sb_tok_text);
+	clex_next_token(l);
+	if (l->tok.text_view[0] != ')') fnargs_batch_type_error(l);
 	return args;
 }
 
 typedef struct {
 	char *name;
+	char *cmdname; // with its '!'
 	size_t line;
+	bool batch;
+	bool pure;
+	char *timeout; // NULL for no limit
 } PreprocFn;
 
 typedef struct {
@@ -464,7 +630,11 @@ typedef struct {
 } FnData;
 
 void fndata_free(FnData *fns) {
-	for (size_t i = 0; i < fns->count; i++) free(fns->items[i].name);
+	for (size_t i = 0; i < fns->count; i++) {
+		free(fns->items[i].name);
+		free(fns->items[i].cmdname);
+		free(fns->items[i].timeout);
+	}
 	free(fns->items);
 }
 
@@ -505,17 +675,68 @@ void preproc_add_prelude(StringBuilder *sb, FnArgs args) {
 			case ARG_BOOL:
 				sb_appendf(sb, "\tbool %s = LLN_arg_bool(%zu);\n", args.items[i].name, i);
 				break;
+			case ARG_I64:
+				sb_appendf(sb, "\tint64_t %s = LLN_arg_i64(%zu);\n", args.items[i].name, i);
+				break;
+			case ARG_DBL:
+				sb_appendf(sb, "\tdouble %s = LLN_arg_dbl(%zu);\n", args.items[i].name, i);
+				break;
+			case ARG_INT_ARR: 
+				sb_appendf(sb, "\tint *%s = LLN_arg_int_arr(%zu);\n", args.items[i].name, i);
+				break;
+			case ARG_FLT_ARR: 
+				sb_appendf(sb, "\tfloat *%s = LLN_arg_flt_arr(%zu);\n", args.items[i].name, i);
+				break;
+			case ARG_DBL_ARR: 
+				sb_appendf(sb, "\tdouble *%s = LLN_arg_dbl_arr(%zu);\n", args.items[i].name, i);
+				break;
+			case ARG_BLOB: 
+				sb_appendf(sb, "\tuint8_t *%s = LLN_arg_blob(%zu);\n", args.items[i].name, i);
+				break;
 			default: assert(false && "unreachable");
 		}
+		if (args.items[i].len_name)
+			sb_appendf(sb, "\tsize_t %s = LLN_arg_len(%zu);\n", args.items[i].len_name, i);
+	}
+}
+
+const char *ARGTYPE_C_NAME[] = {
+	[ARG_INT] = "int",
+	[ARG_FLT] = "float",
+	[ARG_STR] = "char *",
+	[ARG_BOOL] = "bool",
+	[ARG_I64] = "int64_t",
+	[ARG_DBL] = "double",
+};
+
+void preproc_add_batch_prelude(StringBuilder *sb, FnArgs args, const char *count_name) {
+	for (size_t i = 0; i < args.count; i++) {
+		const char *type = ARGTYPE_C_NAME[args.items[i].type];
+		sb_appendf(sb, "\t%s%s*%s = LLN_batch_col(%s, %zu);\n",
+			type, type[strlen(type) - 1] == '*' ? "" : " ", args.items[i].name, type, i);
 	}
+	sb_appendf(sb, "\tsize_t %s = LLN_batch_len();\n", count_name);
 }
 
 void preproc_parse_cmd(StringBuilder *sb, Clex *l, ClexToken tok, CmtMeta cm, FnData *fns) {
 	preproc_parse_cmd_fnsign(l, cm);
+	if (cm.batch && cm.pure) {
+		fprint_context(stderr, l->tok.loc, "ERROR: batch commands can't be pure.\n");
+		exit(1);
+	}
 	PreprocFn fn = {0};
 	fn.name = sb_new_cstr(&l->sb_tok_text);
+	StringBuilder cmdname = {0};
+	if (cm.name) sb_append_cstr(&cmdname, cm.name);
+	else sb_appendf(&cmdname, "!%s", fn.name);
+	sb_term(&cmdname);
+	fn.cmdname = cmdname.content;
 	fn.line = tok.loc.row;
+	fn.batch = cm.batch;
+	fn.pure = cm.pure;
+	fn.timeout = cm.timeout;
 	da_append(fns, fn);
+	LLN_PROBE(preproc_cmd, tok.loc.filename, fn.name, fn.line);
 
 	clex_next_token(l);
 	if (l->tok.kind != CLEXTOK_SEPARATOR || l->tok.text_view[0] != '(') {
@@ -523,17 +744,19 @@ void preproc_parse_cmd(StringBuilder *sb, Clex *l, ClexToken tok, CmtMeta cm, Fn
 		exit(1);
 	}
 
-	FnArgs args = parse_fnargs(l);
+	char *count_name = NULL;
+	FnArgs args = cm.batch ? parse_fnargs_batch(l, &count_name) : parse_fnargs(l);
 	clex_next_token(l);
 	if (l->tok.text_view[0] != '{') {
 		fprint_context(stderr, l->tok.loc, "ERROR: tagged functions must have a body.\n");
 		exit(1);
 	}
 
+	const char *declare = cm.batch ? "LLN_declare_batch_command" : "LLN_declare_command";
 	if (cm.name) {
-		sb_appendf(sb, "LLN_declare_command_custom_name(\"%s\", ", cm.name);
+		sb_appendf(sb, "%s_custom_name(\"%s\", ", declare, cm.name);
 	} else {
-		sb_appendf(sb, "LLN_declare_command(");
+		sb_appendf(sb, "%s(", declare);
 	}
 	sb_appendf(sb, "%s, ", fn.name);
 	for (size_t i = 0; i < args.count; i++) {
@@ -541,7 +764,9 @@ void preproc_parse_cmd(StringBuilder *sb, Clex *l, ClexToken tok, CmtMeta cm, Fn
 		if (i < args.count - 1) sb_append_cstr(sb, ", ");
 	}
 	sb_append_cstr(sb, ") {\n");
-	preproc_add_prelude(sb, args);
+	if (cm.batch) preproc_add_batch_prelude(sb, args, count_name);
+	else preproc_add_prelude(sb, args);
+	free(count_name);
 }
 
 void preproc_parse_pre_post(StringBuilder *sb, Clex *l, CmtMeta cm) {
@@ -586,27 +811,103 @@ void preproc_parse_pre_post(StringBuilder *sb, Clex *l, CmtMeta cm) {
 	sb_append_cstr(sb, " {\n");
 }
 
-void preproc_add_register(StringBuilder *sb, FnData *fns, const char *og_file) {
-	sb_append_cstr(sb, "void __lln_preproc_register_commands(void) {\n");
+// The constant table of the commands of a unit
+void preproc_add_table(StringBuilder *sb, FnData *fns, const char *og_file, const char *table) {
+	sb_appendf(sb, "%sconst lln_Callable %s[] = {\n", strstr(table, "_unit_") ? "" : "static ", table);
+	for (size_t i = 0; i < fns->count; i++) {
+		PreprocFn *fn = &fns->items[i];
+		sb_appendf(sb, "#line %zu \"%s\"\n", fn->line, og_file);
+		sb_appendf(sb, "\t{ %s(\"%s\", %s)", fn->batch ? "LLN_batch_command_fields" : "LLN_command_fields", fn->cmdname, fn->name);
+		if (fn->pure) sb_append_cstr(sb, ", .pure = true");
+		if (fn->timeout) sb_appendf(sb, ", .timeout = %s", fn->timeout);
+		sb_append_cstr(sb, " },\n");
+	}
+	if (fns->count == 0) sb_append_cstr(sb, "\t{0},\n");
+	sb_append_cstr(sb, "};\n");
+}
+
+// The hash index of lln_Callables over the commands of a single-file
+// build, as callables_index builds it. Returns its mask.
+size_t preproc_add_index(StringBuilder *sb, FnData *fns) {
+	Callables cs = {0};
+	for (size_t i = 0; i < fns->count; i++) {
+		Callable c = { .name = fns->items[i].cmdname };
+		da_append(&cs, c);
+	}
+	callables_index(&cs);
+	sb_appendf(sb, "static const uint32_t __lln_preproc_index[%zu] = {", cs.index_mask + 1);
+	for (size_t i = 0; i <= cs.index_mask; i++) sb_appendf(sb, "%s%" PRIu32 ",", i % 16 ? " " : "\n\t", cs.index[i]);
+	sb_append_cstr(sb, "\n};\n");
+	size_t mask = cs.index_mask;
+	free((void *) cs.index);
+	free(cs.items);
+	return mask;
+}
+
+// A single-file build defines its callables as constants: loading it is
+// only dlopen and dlsym, __lln_preproc_register_commands does nothing.
+// In a multi-file build every other unit N exports its table as
+// __lln_preproc_unit_N_commands, which unit 0 gathers when registering,
+// and __lln_preproc_register_unit_N, which sets pre/post.
+void preproc_add_register(StringBuilder *sb, FnData *fns, const char *og_file, size_t unit, size_t units) {
+	if (units == 1) {
+		preproc_add_table(sb, fns, og_file, "__lln_preproc_commands");
+		size_t mask = fns->count ? preproc_add_index(sb, fns) : 0;
+		sb_append_cstr(sb, "const lln_Callables __lln_preproc_callables = {\n");
+		sb_append_cstr(sb, "\t.items = (lln_Callable *) __lln_preproc_commands,\n");
+		sb_appendf(sb, "\t.count = %zu,\n\t.capacity = %zu,\n", fns->count, fns->count);
+		if (fns->pre_line) {
+			sb_appendf(sb, "#line %zu \"%s\"\n", fns->pre_line, og_file);
+			sb_append_cstr(sb, "\t.pre = __LLN_pre,\n");
+		}
+		if (fns->post_line) {
+			sb_appendf(sb, "#line %zu \"%s\"\n", fns->post_line, og_file);
+			sb_append_cstr(sb, "\t.post = __LLN_post,\n");
+		}
+		if (fns->count) sb_appendf(sb, "\t.index = __lln_preproc_index,\n\t.index_mask = %zu,\n", mask);
+		sb_append_cstr(sb, "};\n");
+		sb_append_cstr(sb, "void __lln_preproc_register_commands(void) {}\n");
+		return;
+	}
+	if (unit == 0) {
+		preproc_add_table(sb, fns, og_file, "__lln_preproc_commands");
+		for (size_t i = 1; i < units; i++) {
+			sb_appendf(sb, "extern const lln_Callable __lln_preproc_unit_%zu_commands[];\n", i);
+			sb_appendf(sb, "extern const size_t __lln_preproc_unit_%zu_count;\n", i);
+			sb_appendf(sb, "void __lln_preproc_register_unit_%zu(void);\n", i);
+		}
+		sb_append_cstr(sb, "void __lln_preproc_register_commands(void) {\n");
+		sb_appendf(sb, "\tlln_callables_extend(&__lln_preproc_callables, __lln_preproc_commands, %zu);\n", fns->count);
+		for (size_t i = 1; i < units; i++)
+			sb_appendf(sb, "\tlln_callables_extend(&__lln_preproc_callables, __lln_preproc_unit_%zu_commands, __lln_preproc_unit_%zu_count);\n", i, i);
+	} else {
+		StringBuilder table = {0};
+		sb_appendf(&table, "__lln_preproc_unit_%zu_commands", unit);
+		sb_term(&table);
+		preproc_add_table(sb, fns, og_file, table.content);
+		free(table.content);
+		sb_appendf(sb, "const size_t __lln_preproc_unit_%zu_count = %zu;\n", unit, fns->count);
+		sb_appendf(sb, "void __lln_preproc_register_unit_%zu(void) {\n", unit);
+	}
 	if (fns->pre_line) {
 		sb_appendf(sb, "#line %zu \"%s\"\n", fns->pre_line, og_file);
 		sb_append_cstr(sb, "\t__lln_preproc_callables.pre = __LLN_pre;\n");
 	}
 	if (fns->post_line) {
-		sb_appendf(sb, "#line %zu \"%s\"\n", fns->pre_line, og_file);
+		sb_appendf(sb, "#line %zu \"%s\"\n", fns->post_line, og_file);
 		sb_append_cstr(sb, "\t__lln_preproc_callables.post = __LLN_post;\n");
 	}
-	for (size_t i = 0; i < fns->count; i++) {
-		sb_appendf(sb, "#line %zu \"%s\"\n", fns->items[i].line, og_file);
-		sb_appendf(sb,
-			"\tLLN_register_command(&__lln_preproc_callables, %s);\n",
-			fns->items[i].name);
+	if (unit == 0) {
+		for (size_t i = 1; i < units; i++)
+			sb_appendf(sb, "\t__lln_preproc_register_unit_%zu();\n", i);
 	}
 	sb_append_cstr(sb, "}\n");
 }
 
-StringBuilder *build_new_file(Clex *l, StringBuilder *sb, const char *og_file) {
+StringBuilder *build_new_file(Clex *l, StringBuilder *sb, const char *og_file, size_t unit, size_t units) {
 	sb_append_cstr(sb, "#define __LLN_PREPROCESSED_FILE\n");
+	if (unit > 0) sb_append_cstr(sb, "#define __LLN_PREPROCESSED_EXTRA_UNIT\n");
+	else if (units > 1) sb_append_cstr(sb, "#define __LLN_PREPROCESSED_UNITS\n");
 	FnData fns = {0};
 	size_t level = 0;
 	while(clex_next_token(l)) {
@@ -635,20 +936,44 @@ StringBuilder *build_new_file(Clex *l, StringBuilder *sb, const char *og_file) {
 			}
 			free(cm.name);
 		} else {
-			sb_append_cstr(sb, tok.text_view);
-			while (clex_is_space(l)) {
-				sb_append(sb, l->cur[0]);
-				clex_chop_char(l);
-			}
+			sb_append_strn(sb, tok.start, tok.len);
+			// copy the whole run of whitespace at once
+			char *space = l->cur;
+			clex_chop_while_predicate(l, clex_is_space);
+			sb_append_strn(sb, space, (size_t) (l->cur - space));
 		}
 	}
-	preproc_add_register(sb, &fns, og_file);
+	preproc_add_register(sb, &fns, og_file, unit, units);
 	sb_term(sb);
 	fndata_free(&fns);
 
 	return sb;
 }
 
+// Optimization flags of plugin builds, set by the Makefile's PROFILE
+#ifndef LLN_PLUGIN_CFLAGS
+#define LLN_PLUGIN_CFLAGS ""
+#endif // LLN_PLUGIN_CFLAGS
+
+static char *cc_flags_str;
+
+static void cc_flags_init(void) {
+	const char *flags = getenv("LLN_CFLAGS");
+	if (!flags) flags = LLN_PLUGIN_CFLAGS;
+	StringBuilder sb = {0};
+	if (*flags) sb_appendf(&sb, "%s ", flags);
+	sb_term(&sb);
+	cc_flags_str = sb.content;
+}
+
+// Flags of every syntax check, compile and link of user code, with a
+// trailing space unless empty: $LLN_CFLAGS if set, LLN_PLUGIN_CFLAGS otherwise
+const char *cc_flags(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, cc_flags_init);
+	return cc_flags_str;
+}
+
 int commandf(const char *fmt, ...) {
 	StringBuilder cmd = {0};
 	va_list args;
@@ -657,54 +982,231 @@ int commandf(const char *fmt, ...) {
 	va_end(args);
 	sb_term(&cmd);
 	printf("%s\n", cmd.content);
+	uint64_t start = LLN_PROBE_START(cc_return);
+	LLN_PROBE(cc_entry, cmd.content);
 	int out = system(cmd.content);
+	LLN_PROBE(cc_return, cmd.content, out, LLN_PROBE_NS(start));
 	free(cmd.content);
 	return out;
 }
 
-void lln_preproc_file(const char *file_in, const char *file_out) {
+// Doesn't exit on errors, as it runs on the threads of run_jobs: prints
+// them and returns false
+bool lln_preproc_unit(const char *file_in, const char *file_out, size_t unit, size_t units) {
 	StringBuilder file = {0};
 	StringBuilder out = {0};
 	Clex l = {0};
 
-	int result = commandf("cc -fsyntax-only %s", file_in);
+	LLN_PROBE(preproc_entry, file_in, unit);
+	int result = commandf("cc %s-fsyntax-only %s", cc_flags(), file_in);
 	if (result != 0) {
 		fprintf(stderr, "ERROR: Cannot preprocess files with syntax errors.\n");
-		exit(1);
+		return false;
 	}
 
-	read_whole_file(&file, file_in);
+	if (!read_whole_file(&file, file_in)) {
+		free(file.content);
+		return false;
+	}
 	clex_init(&l, file.content, file_in);
-	build_new_file(&l, &out, file_in);
+	build_new_file(&l, &out, file_in, unit, units);
 
 	FILE *f = fopen(file_out, "w");
-	if (!f) {
+	bool ok = f != NULL;
+	if (ok) {
+		fwrite(out.content, 1, out.len - 1, f);
+		fclose(f);
+		LLN_PROBE(preproc_return, file_in, unit, out.len - 1);
+	} else {
 		fprintf(stderr, "Could not create new file %s\n", file_out);
-		exit(1);
 	}
-	fputs(out.content, f);
-	fclose(f);
+	free(file.content);
+	free(out.content);
+	free(l.sb_tok_text.content);
+	return ok;
 }
 
-void lln_preproc_and_compile_file(const char *file_in, const char *file_out) {
-	char tmp_name[64];
-	srand(time(NULL));
-	sprintf(tmp_name, "lln_preproc_tmp_%X.c", rand());
-	lln_preproc_file(file_in, tmp_name);
+void lln_preproc_file(const char *file_in, const char *file_out) {
+	if (!lln_preproc_unit(file_in, file_out, 0, 1)) exit(1);
+}
+
+// ----- Multi-file builds -----
+
+typedef struct {
+	void (*job)(void *ctx, size_t i);
+	void *ctx;
+	size_t count;
+	atomic_size_t next;
+} Jobs;
+
+static void *jobs_worker(void *arg) {
+	Jobs *jobs = arg;
+	size_t i;
+	while ((i = atomic_fetch_add(&jobs->next, 1)) < jobs->count)
+		jobs->job(jobs->ctx, i);
+	return NULL;
+}
+
+// Runs job(ctx, i) for every i < count, on at most one thread per core
+void run_jobs(size_t count, void (*job)(void *ctx, size_t i), void *ctx) {
+	Jobs jobs = { .job = job, .ctx = ctx, .count = count };
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n_threads = cores > 1 ? (size_t) cores : 1;
+	if (n_threads > count) n_threads = count;
+	if (n_threads <= 1) {
+		jobs_worker(&jobs);
+		return;
+	}
+
+	fflush(stdout);
+	pthread_t *threads = malloc((n_threads - 1) * sizeof(pthread_t));
+	size_t started = 0;
+	for (; started < n_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL, jobs_worker, &jobs) != 0) break;
+	}
+	jobs_worker(&jobs);
+	for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+typedef struct {
+	const char **inputs;
+	size_t count;
+	char **sources; // preprocessed file, one per input
+	char **objects; // compiled file, one per input
+	const char *cflags;
+	atomic_bool failed;
+} Units;
+
+char *tmp_name(size_t i, const char *ext) {
+	StringBuilder sb = {0};
+	sb_appendf(&sb, "lln_preproc_tmp_%X_%zu%s", (unsigned) getpid(), i, ext);
+	sb_term(&sb);
+	return sb.content;
+}
 
-	commandf("cc -o %s %s", file_out, tmp_name);
-	remove(tmp_name);
+void units_init(Units *u, const char **inputs, size_t count) {
+	u->inputs = inputs;
+	u->count = count;
+	u->sources = calloc(count, sizeof(char *));
+	u->objects = calloc(count, sizeof(char *));
+	for (size_t i = 0; i < count; i++) {
+		u->sources[i] = tmp_name(i, ".c");
+		u->objects[i] = tmp_name(i, ".o");
+	}
 }
 
-void lln_preproc_and_compile_to_so(const char *file_in, const char *file_out) {
-	char tmp_name[64];
-	srand(time(NULL));
-	sprintf(tmp_name, "lln_preproc_tmp_%X.c", rand());
-	lln_preproc_file(file_in, tmp_name);
+void units_free(Units *u) {
+	for (size_t i = 0; i < u->count; i++) {
+		remove(u->sources[i]);
+		remove(u->objects[i]);
+		free(u->sources[i]);
+		free(u->objects[i]);
+	}
+	free(u->sources);
+	free(u->objects);
+}
 
-	commandf("cc -fPIC -shared -o %s %s", file_out, tmp_name);
-	remove(tmp_name);
+static void preproc_unit_job(void *ctx, size_t i) {
+	Units *u = ctx;
+	if (!lln_preproc_unit(u->inputs[i], u->sources[i], i, u->count))
+		atomic_store(&u->failed, true);
+}
 
+// "-iquote <dir> " for the directory of an input: its preprocessed copy is
+// in the working directory, but quoted includes have to resolve next to
+// the original, "/" for the ones at the root
+static char *iquote_flag(const char *input) {
+	const char *slash = strrchr(input, '/');
+	int dir_len = slash && slash > input ? (int) (slash - input) : 1;
+	const char *dir = slash ? input : ".";
+	StringBuilder sb = {0};
+	sb_appendf(&sb, "-iquote %.*s ", dir_len, dir);
+	sb_term(&sb);
+	return sb.content;
+}
+
+static void compile_unit_job(void *ctx, size_t i) {
+	Units *u = ctx;
+	char *iquote = iquote_flag(u->inputs[i]);
+	if (commandf("cc %s%s%s-c -o %s %s", cc_flags(), u->cflags, iquote, u->objects[i], u->sources[i]) != 0)
+		atomic_store(&u->failed, true);
+	free(iquote);
+}
+
+void lln_preproc_files(const char **files_in, size_t count, const char *dir_out) {
+	if (count == 1) {
+		lln_preproc_file(files_in[0], dir_out);
+		return;
+	}
+	if (mkdir(dir_out, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Could not create output directory %s\n", dir_out);
+		exit(1);
+	}
+
+	Units u = { .inputs = files_in, .count = count };
+	u.sources = calloc(count, sizeof(char *));
+	for (size_t i = 0; i < count; i++) {
+		const char *base = strrchr(files_in[i], '/');
+		base = base ? base + 1 : files_in[i];
+		StringBuilder sb = {0};
+		sb_appendf(&sb, "%s/%s", dir_out, base);
+		sb_term(&sb);
+		u.sources[i] = sb.content;
+		for (size_t j = 0; j < i; j++) {
+			if (strcmp(u.sources[j], u.sources[i]) == 0) {
+				fprintf(stderr, "ERROR: '%s' and '%s' would both be written to '%s'.\n", files_in[j], files_in[i], u.sources[i]);
+				exit(1);
+			}
+		}
+	}
+	run_jobs(count, preproc_unit_job, &u);
+	for (size_t i = 0; i < count; i++) free(u.sources[i]);
+	free(u.sources);
+	if (atomic_load(&u.failed)) exit(1);
+}
+
+// Preprocesses every input in parallel. Multi-file builds then compile every
+// unit in parallel and link the objects, single files are built in one go.
+void lln_preproc_and_build(const char **files_in, size_t count, const char *file_out, bool shared) {
+	Units u = {0};
+	units_init(&u, files_in, count);
+	u.cflags = shared ? "-fPIC " : "";
+	const char *link_flags = shared ? "-fPIC -shared " : "";
+	run_jobs(count, preproc_unit_job, &u);
+
+	int result = 0;
+	if (atomic_load(&u.failed)) {
+		result = -1;
+	} else if (count == 1) {
+		char *iquote = iquote_flag(files_in[0]);
+		result = commandf("cc %s%s%s-o %s %s", cc_flags(), link_flags, iquote, file_out, u.sources[0]);
+		free(iquote);
+	} else {
+		run_jobs(count, compile_unit_job, &u);
+		if (atomic_load(&u.failed)) {
+			result = -1;
+		} else {
+			StringBuilder objects = {0};
+			for (size_t i = 0; i < count; i++) sb_appendf(&objects, " %s", u.objects[i]);
+			sb_term(&objects);
+			result = commandf("cc %s%s-o %s%s", cc_flags(), link_flags, file_out, objects.content);
+			free(objects.content);
+		}
+	}
+	units_free(&u);
+	if (result != 0) {
+		fprintf(stderr, "ERROR: Could not build '%s'.\n", file_out);
+		exit(1);
+	}
+}
+
+void lln_preproc_and_compile_file(const char **files_in, size_t count, const char *file_out) {
+	lln_preproc_and_build(files_in, count, file_out, false);
+}
+
+// Makes sure the freshly built shared object loads, and has no main()
+void check_built_so(const char **files_in, size_t count, const char *file_out) {
 	StringBuilder sb_so_path = {0};
 	if (file_out[0] != '/' && strncmp(file_out, "./", 2) != 0 && strncmp(file_out, "../", 3) != 0) {
 		sb_append_cstr(&sb_so_path, "./");
@@ -722,7 +1224,11 @@ void lln_preproc_and_compile_to_so(const char *file_in, const char *file_out) {
 	void *main_func = dlsym(handle, "main");
 	char *error = dlerror();
     if (error == NULL && main_func != NULL) {
-        fprintf(stderr, "ERROR: `%s` contains a `main()` function.\n", file_in);
+		if (count == 1) {
+			fprintf(stderr, "ERROR: `%s` contains a `main()` function.\n", files_in[0]);
+		} else {
+			fprintf(stderr, "ERROR: the inputs of `%s` contain a `main()` function.\n", file_out);
+		}
         fprintf(stderr, "INFO: main functions are disallowed in LLN shared onject files.\n");
 		remove(file_out);
         dlclose(handle);
@@ -732,7 +1238,185 @@ void lln_preproc_and_compile_to_so(const char *file_in, const char *file_out) {
 	dlclose(handle);
 }
 
-void lln_run_from_so(char *lln_path, char *so_path) {
+void lln_preproc_and_compile_to_so(const char **files_in, size_t count, const char *file_out) {
+	lln_preproc_and_build(files_in, count, file_out, true);
+	check_built_so(files_in, count, file_out);
+}
+
+// ----- Incremental builds -----
+
+// Every unit keeps its preprocessed source, object, compiler dependency
+// file (-MD) and a stamp of its input in <output>.lln-build/. A unit is
+// only redone when its stamp changed or one of its dependencies is newer
+// than its object.
+typedef struct {
+	Units u;
+	char **deps;
+	char **stamps;
+	atomic_bool relink;
+} Incremental;
+
+char *cache_path(const char *dir, size_t i, const char *ext) {
+	StringBuilder sb = {0};
+	sb_appendf(&sb, "%s/unit_%zu%s", dir, i, ext);
+	sb_term(&sb);
+	return sb.content;
+}
+
+static inline bool timespec_after(struct timespec a, struct timespec b) {
+	return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+// Returns true if any file listed in the make rule of dep_file
+// is missing or was modified after t
+bool deps_changed_since(const char *dep_file, struct timespec t) {
+	StringBuilder sb = {0};
+	struct stat st;
+	if (stat(dep_file, &st) != 0 || !read_whole_file(&sb, dep_file)) {
+		free(sb.content);
+		return true;
+	}
+
+	bool changed = false;
+	char *p = strchr(sb.content, ':'); // skip the target
+	p = p ? p + 1 : sb.content + sb.len;
+	StringBuilder dep = {0};
+	while (*p && !changed) {
+		dep.len = 0;
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || (*p == '\\' && (p[1] == '\n' || p[1] == '\r'))) p++;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+			if (*p == '\\' && p[1] == ' ') p++; // escaped space in a path
+			else if (*p == '\\' && (p[1] == '\n' || p[1] == '\r')) break;
+			sb_append(&dep, *p++);
+		}
+		if (dep.len == 0) continue;
+		if (dep.content[dep.len - 1] == ':') continue; // phony targets
+		sb_term(&dep);
+		if (stat(dep.content, &st) != 0 || timespec_after(st.st_mtim, t)) changed = true;
+	}
+	free(dep.content);
+	free(sb.content);
+	return changed;
+}
+
+// NULL if the input can't be read
+char *unit_stamp(const char *file_in, size_t i, size_t count) {
+	StringBuilder file = {0};
+	StringBuilder sb = {0};
+	if (!read_whole_file(&file, file_in)) {
+		free(file.content);
+		return NULL;
+	}
+	// objects built with other flags are stale too
+	sb_appendf(&sb, "%016llx %zu/%zu %s %s\n",
+		(unsigned long long) hash_bytes(file.content, file.len), i, count, file_in, cc_flags());
+	sb_term(&sb);
+	free(file.content);
+	return sb.content;
+}
+
+static void incremental_unit_job(void *ctx, size_t i) {
+	Incremental *inc = ctx;
+	Units *u = &inc->u;
+	char *stamp = unit_stamp(u->inputs[i], i, u->count);
+	if (!stamp) {
+		atomic_store(&u->failed, true);
+		return;
+	}
+
+	StringBuilder old = {0};
+	struct stat st;
+	bool up_to_date = stat(inc->stamps[i], &st) == 0
+		&& read_whole_file(&old, inc->stamps[i])
+		&& strcmp(old.content, stamp) == 0
+		&& stat(u->objects[i], &st) == 0
+		&& !deps_changed_since(inc->deps[i], st.st_mtim);
+	free(old.content);
+	if (up_to_date) {
+		free(stamp);
+		return;
+	}
+
+	remove(inc->stamps[i]);
+	if (!lln_preproc_unit(u->inputs[i], u->sources[i], i, u->count)) {
+		atomic_store(&u->failed, true);
+		free(stamp);
+		return;
+	}
+
+	char *iquote = iquote_flag(u->inputs[i]);
+	int result = commandf("cc %s-fPIC -MD -MF %s %s-c -o %s %s",
+		cc_flags(), inc->deps[i], iquote, u->objects[i], u->sources[i]);
+	free(iquote);
+	if (result != 0) {
+		atomic_store(&u->failed, true);
+		free(stamp);
+		return;
+	}
+
+	FILE *f = fopen(inc->stamps[i], "w");
+	if (f) {
+		fputs(stamp, f);
+		fclose(f);
+	}
+	free(stamp);
+	atomic_store(&inc->relink, true);
+}
+
+void lln_preproc_and_compile_to_so_incremental(const char **files_in, size_t count, const char *file_out) {
+	StringBuilder dir = {0};
+	sb_appendf(&dir, "%s.lln-build", file_out);
+	sb_term(&dir);
+	if (mkdir(dir.content, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Could not create build directory %s\n", dir.content);
+		exit(1);
+	}
+
+	Incremental inc = { .u = { .inputs = files_in, .count = count } };
+	inc.u.sources = calloc(count, sizeof(char *));
+	inc.u.objects = calloc(count, sizeof(char *));
+	inc.deps = calloc(count, sizeof(char *));
+	inc.stamps = calloc(count, sizeof(char *));
+	for (size_t i = 0; i < count; i++) {
+		inc.u.sources[i] = cache_path(dir.content, i, ".c");
+		inc.u.objects[i] = cache_path(dir.content, i, ".o");
+		inc.deps[i] = cache_path(dir.content, i, ".d");
+		inc.stamps[i] = cache_path(dir.content, i, ".stamp");
+	}
+	run_jobs(count, incremental_unit_job, &inc);
+
+	struct stat st;
+	bool failed = atomic_load(&inc.u.failed);
+	bool relink = atomic_load(&inc.relink) || stat(file_out, &st) != 0;
+	if (!failed && relink) {
+		StringBuilder objects = {0};
+		for (size_t i = 0; i < count; i++) sb_appendf(&objects, " %s", inc.u.objects[i]);
+		sb_term(&objects);
+		failed = commandf("cc %s-fPIC -shared -o %s%s", cc_flags(), file_out, objects.content) != 0;
+		free(objects.content);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(inc.u.sources[i]);
+		free(inc.u.objects[i]);
+		free(inc.deps[i]);
+		free(inc.stamps[i]);
+	}
+	free(inc.u.sources);
+	free(inc.u.objects);
+	free(inc.deps);
+	free(inc.stamps);
+	free(dir.content);
+
+	if (failed) {
+		fprintf(stderr, "ERROR: Could not build '%s'.\n", file_out);
+		exit(1);
+	}
+	if (relink) check_built_so(files_in, count, file_out);
+}
+
+// Loads a preprocessed shared object and registers its commands
+Callables *load_callables(const char *so_path) {
 	StringBuilder sb_so_path = {0};
 	if (so_path[0] != '/' && strncmp(so_path, "./", 2) != 0 && strncmp(so_path, "../", 3) != 0) {
 		sb_append_cstr(&sb_so_path, "./");
@@ -759,16 +1443,386 @@ void lln_run_from_so(char *lln_path, char *so_path) {
 		exit(1);
 	}
 	(*reg_comms)();
-	lln_run_lln_file(lln_path, calls);
+	callables_index(calls);
+	return calls;
+}
+
+void lln_run_from_so(char *lln_path, char *so_path, const RunOptions *opts) {
+	Callables *calls = load_callables(so_path);
+	int ret = lln_run_lln_file_opts(lln_path, calls, opts);
+	if (ret != 0) exit(ret < 0 ? 1 : ret);
+}
+
+void lln_replay(char *trace_path, char *so_path, const RunOptions *opts) {
+	Callables *calls = load_callables(so_path);
+	int ret = lln_replay_trace(trace_path, calls, opts);
+	if (ret != 0) exit(ret < 0 ? 1 : ret);
+}
+
+// Runs the scripts a client submits to the shared memory at fd, until it closes it
+void lln_serve(const char *fd_arg, char *so_path, const RunOptions *opts) {
+	char *end;
+	long fd = strtol(fd_arg, &end, 10);
+	lln_Shm *shm = *end || fd < 0 || fd > INT_MAX ? NULL : lln_shm_attach((int) fd);
+	if (!shm) {
+		fprintf(stderr, "ERROR: '%s' is not the file descriptor of an lln shared memory.\n", fd_arg);
+		exit(1);
+	}
+	Callables *calls = load_callables(so_path);
+	int ret = lln_shm_serve(shm, calls, opts);
+	lln_shm_free(shm);
+	if (ret != 0) exit(1);
 }
 
-void lln_run_from_c(char *lln_path, char *c_path) {
-	char tmp_name[64];
-	srand(time(NULL));
-	sprintf(tmp_name, "lln_preproc_tmp_%X.so", rand());
-	lln_preproc_and_compile_to_so(c_path, tmp_name);
-	lln_run_from_so(lln_path, tmp_name);
-	remove(tmp_name);
+void lln_run_from_c(char *lln_path, const char **c_paths, size_t count, const RunOptions *opts) {
+	char *so_name = tmp_name(count, ".so");
+	lln_preproc_and_compile_to_so(c_paths, count, so_name);
+	lln_run_from_so(lln_path, so_name, opts);
+	remove(so_name);
+	free(so_name);
+}
+
+// ----- Checking -----
+
+typedef struct {
+	const char **files;
+	const Callables *c;
+	size_t max_errors; // a file, 0 for no limit
+	StringBuilder *out; // diagnostics of each file, printed in order
+	atomic_size_t invalid; // files
+} Check;
+
+static void check_job(void *ctx, size_t i) {
+	Check *ch = ctx;
+	StringBuilder *out = &ch->out[i];
+	StringBuilder file = {0};
+	size_t errors;
+	if (!read_whole_file(&file, ch->files[i]) || file.len > UINT32_MAX) {
+		sb_append_cstr(out, "{\"file\":");
+		sb_append_json_str(out, ch->files[i]);
+		sb_append_cstr(out, ",\"kind\":\"unreadable\"}\n");
+		errors = 1;
+	} else {
+		DiagBuffer diags = { .buf = *out, .json = true, .max = ch->max_errors };
+		errors = check_script(file.content, ch->files[i], ch->c, diag_buffer_push, &diags);
+		diag_buffer_end(&diags, ch->files[i]);
+		*out = diags.buf;
+	}
+	free(file.content);
+	if (errors) atomic_fetch_add(&ch->invalid, 1);
+}
+
+// Validates scripts in parallel without running them, printing each
+// diagnostic as a JSON line, at most max_errors a script (0 for all).
+// Exits with 1 if any script is invalid.
+void lln_check(const char *so_path, const char **files, size_t count, size_t max_errors) {
+	Check ch = { .files = files, .c = load_callables(so_path), .max_errors = max_errors };
+	ch.out = calloc(count, sizeof(StringBuilder));
+	run_jobs(count, check_job, &ch);
+	for (size_t i = 0; i < count; i++) {
+		fwrite(ch.out[i].content, 1, ch.out[i].len, stdout);
+		free(ch.out[i].content);
+	}
+	free(ch.out);
+	fflush(stdout);
+	if (atomic_load(&ch.invalid)) exit(1);
+}
+
+// ----- Ahead-of-time compilation -----
+
+// C source of a validated script: every command becomes a direct call to its
+// function, with its arguments as static data
+typedef struct {
+	StringBuilder decls; // command function prototypes
+	StringBuilder data;  // static arguments
+	StringBuilder body;  // the calls, in script order
+	const Callable **declared;
+	size_t declared_count;
+	size_t ids;
+
+	// consecutive calls to a batch command, one initializer list per column
+	const Callable *batch;
+	StringBuilder *columns;
+	size_t batch_count;
+} Aot;
+
+static const char *ARGTYPE_ENUM_NAME[] = {
+	[ARG_INT] = "ARG_INT",
+	[ARG_FLT] = "ARG_FLT",
+	[ARG_STR] = "ARG_STR",
+	[ARG_BOOL] = "ARG_BOOL",
+	[ARG_INT_ARR] = "ARG_INT_ARR",
+	[ARG_FLT_ARR] = "ARG_FLT_ARR",
+	[ARG_DBL_ARR] = "ARG_DBL_ARR",
+	[ARG_BLOB] = "ARG_BLOB",
+	[ARG_I64] = "ARG_I64",
+	[ARG_DBL] = "ARG_DBL",
+};
+
+static inline bool aot_has_items(ArgType t) {
+	return t == ARG_INT_ARR || t == ARG_FLT_ARR || t == ARG_DBL_ARR || t == ARG_BLOB;
+}
+
+// Name of the function behind a command, from the symbol of its address
+const char *aot_fn_name(const Callable *c) {
+	Dl_info info;
+	void *fn = c->batch_fnptr ? (void *) c->batch_fnptr : (void *) c->fnptr;
+	if (!dladdr(fn, &info) || !info.dli_sname) {
+		fprintf(stderr, "ERROR: couldn't find the function of command '%s'.\n", c->name);
+		exit(1);
+	}
+	return info.dli_sname;
+}
+
+void aot_declare(Aot *a, const Callable *c) {
+	for (size_t i = 0; i < a->declared_count; i++) if (a->declared[i] == c) return;
+	a->declared = realloc(a->declared, (a->declared_count + 1) * sizeof(*a->declared));
+	a->declared[a->declared_count++] = c;
+	sb_appendf(&a->decls, "void *%s(%s);\n", aot_fn_name(c), c->batch_fnptr ? "lln_Batch" : "lln_Args");
+}
+
+// String literal of any bytes: printable ones as is, the others in octal
+void aot_append_c_str(StringBuilder *sb, const char *s) {
+	sb_append(sb, '"');
+	for (; *s; s++) {
+		unsigned char c = (unsigned char) *s;
+		if (c == '"' || c == '\\' || c == '?') sb_appendf(sb, "\\%c", c);
+		else if (c >= 0x20 && c < 0x7f) sb_append(sb, c);
+		else sb_appendf(sb, "\\%03o", c);
+	}
+	sb_append(sb, '"');
+}
+
+// Static storage for the items of an array or blob, returns its id
+size_t aot_add_items(Aot *a, const Arg *arg) {
+	size_t id = a->ids++;
+	size_t count = arg->value.arr.count;
+	const char *type = arg->type == ARG_INT_ARR ? "int"
+		: arg->type == ARG_FLT_ARR ? "float"
+		: arg->type == ARG_DBL_ARR ? "double" : "uint8_t";
+	// at least one item, empty initializers aren't C99
+	sb_appendf(&a->data, "static _Alignas(LLN_ARR_ALIGN) %s __lln_aot_items_%zu[%zu] = {", type, id, count ? count : 1);
+	for (size_t i = 0; i < count; i++) {
+		if (i % 8 == 0) sb_append_cstr(&a->data, "\n\t");
+		switch (arg->type) {
+			case ARG_INT_ARR: sb_appendf(&a->data, "%d, ", ((int *) arg->value.arr.items)[i]); break;
+			case ARG_FLT_ARR: sb_appendf(&a->data, "%a, ", (double) ((float *) arg->value.arr.items)[i]); break;
+			case ARG_DBL_ARR: sb_appendf(&a->data, "%a, ", ((double *) arg->value.arr.items)[i]); break;
+			default: sb_appendf(&a->data, "%u, ", ((uint8_t *) arg->value.arr.items)[i]); break;
+		}
+	}
+	if (count == 0) sb_append_cstr(&a->data, "0");
+	sb_append_cstr(&a->data, "\n};\n");
+	return id;
+}
+
+// Initializer of a value, as an ArgValue member (".i = 3") or
+// as a column item ("3") when member is false
+void aot_append_value(Aot *a, StringBuilder *sb, const Arg *arg, bool member) {
+	switch (arg->type) {
+		case ARG_INT:
+			sb_appendf(sb, "%s%d", member ? ".i = " : "", arg->value.i);
+			break;
+		case ARG_I64:
+			if (member) sb_append_cstr(sb, ".l = ");
+			if (arg->value.l == INT64_MIN) sb_append_cstr(sb, "INT64_MIN");
+			else sb_appendf(sb, "%" PRId64, arg->value.l);
+			break;
+		case ARG_FLT:
+			sb_appendf(sb, "%s%a", member ? ".f = " : "", (double) arg->value.f);
+			break;
+		case ARG_DBL:
+			sb_appendf(sb, "%s%a", member ? ".d = " : "", arg->value.d);
+			break;
+		case ARG_BOOL:
+			sb_appendf(sb, "%s%s", member ? ".b = " : "", arg->value.b ? "true" : "false");
+			break;
+		case ARG_STR:
+			// a compound literal, so commands may write to it like to a runtime string
+			sb_append_cstr(sb, member ? ".s = (char []) {" : "(char []) {");
+			aot_append_c_str(sb, arg->value.s);
+			sb_append(sb, '}');
+			break;
+		default: {
+			size_t id = aot_add_items(a, arg);
+			sb_appendf(sb, "%s{ .items = __lln_aot_items_%zu, .count = %zu }",
+				member ? ".arr = " : "", id, arg->value.arr.count);
+			break;
+		}
+	}
+}
+
+void aot_flush_batch(Aot *a) {
+	if (a->batch_count == 0) return;
+	const Callable *c = a->batch;
+	size_t id = a->ids++;
+	for (size_t i = 0; i < c->signature.count; i++) {
+		ArgType t = c->signature.items[i];
+		const char *type = aot_has_items(t) ? "lln_ArgValue" : ARGTYPE_C_NAME[t];
+		sb_term(&a->columns[i]);
+		sb_appendf(&a->data, "static %s%s__lln_aot_col_%zu_%zu[] = {%s\n};\n",
+			type, type[strlen(type) - 1] == '*' ? "" : " ", id, i, a->columns[i].content);
+		a->columns[i].len = 0;
+	}
+	sb_appendf(&a->data, "static void *__lln_aot_cols_%zu[] = {", id);
+	for (size_t i = 0; i < c->signature.count; i++) sb_appendf(&a->data, " __lln_aot_col_%zu_%zu,", id, i);
+	sb_append_cstr(&a->data, " NULL };\n");
+	sb_appendf(&a->body, "\t%s((lln_Batch) { .columns = __lln_aot_cols_%zu, .count = %zu });\n",
+		aot_fn_name(c), id, a->batch_count);
+	a->batch_count = 0;
+}
+
+// Calls to batch commands are grouped as the runtime would batch them
+bool aot_add_comm(void *ctx, const Callable *c, Args args, Loc loc) {
+	(void) loc;
+	Aot *a = ctx;
+	aot_declare(a, c);
+	if (a->batch != c || a->batch_count == LLN_BATCH_MAX) aot_flush_batch(a);
+	if (c->batch_fnptr) {
+		if (a->batch != c) {
+			if (a->batch) for (size_t i = 0; i < a->batch->signature.count; i++) free(a->columns[i].content);
+			free(a->columns);
+			a->batch = c;
+			a->columns = calloc(c->signature.count, sizeof(StringBuilder));
+		}
+		for (size_t i = 0; i < args.count; i++) {
+			StringBuilder *col = &a->columns[i];
+			if (a->batch_count % 8 == 0) sb_append_cstr(col, "\n\t");
+			if (aot_has_items(args.items[i].type)) {
+				sb_append_cstr(col, "{ ");
+				aot_append_value(a, col, &args.items[i], true);
+				sb_append_cstr(col, " }, ");
+			} else {
+				aot_append_value(a, col, &args.items[i], false);
+				sb_append_cstr(col, ", ");
+			}
+		}
+		a->batch_count++;
+		return true;
+	}
+	const char *fn = aot_fn_name(c);
+	if (args.count == 0) {
+		sb_appendf(&a->body, "\t%s((lln_Args) {0});\n", fn);
+		return true;
+	}
+	size_t id = a->ids++;
+	StringBuilder items = {0};
+	for (size_t i = 0; i < args.count; i++) {
+		sb_appendf(&items, "\n\t{ .type = %s, .value = { ", ARGTYPE_ENUM_NAME[args.items[i].type]);
+		aot_append_value(a, &items, &args.items[i], true);
+		sb_append_cstr(&items, " } },");
+	}
+	sb_term(&items);
+	sb_appendf(&a->data, "static lln_Arg __lln_aot_args_%zu[] = {%s\n};\n", id, items.content);
+	free(items.content);
+	sb_appendf(&a->body, "\t%s((lln_Args) { .items = __lln_aot_args_%zu, .count = %zu, .capacity = %zu });\n",
+		fn, id, args.count, args.count);
+	return true;
+}
+
+void aot_free(Aot *a) {
+	if (a->batch) for (size_t i = 0; i < a->batch->signature.count; i++) free(a->columns[i].content);
+	free(a->columns);
+	free(a->declared);
+	free(a->decls.content);
+	free(a->data.content);
+	free(a->body.content);
+}
+
+// Validates the script against the commands of the plugin and compiles it,
+// with the plugin, into an executable, or into a shared object exporting
+// `int lln_aot_run(void)` when file_out ends with ".so"
+void lln_aot(const char *lln_path, const char **c_paths, size_t count, const char *file_out) {
+	size_t out_len = strlen(file_out);
+	bool shared = out_len > 3 && strcmp(file_out + out_len - 3, ".so") == 0;
+
+	Units u = {0};
+	units_init(&u, c_paths, count);
+	u.cflags = "-fPIC ";
+	run_jobs(count, preproc_unit_job, &u);
+	if (!atomic_load(&u.failed)) run_jobs(count, compile_unit_job, &u);
+	if (atomic_load(&u.failed)) {
+		fprintf(stderr, "ERROR: Could not build '%s'.\n", file_out);
+		units_free(&u);
+		exit(1);
+	}
+	// the units are compiled once, for the plugin and the program alike
+	StringBuilder objects = {0};
+	for (size_t i = 0; i < count; i++) sb_appendf(&objects, " %s", u.objects[i]);
+	sb_term(&objects);
+
+	// validation needs the signatures, so the plugin is built on its own first
+	char *so_name = tmp_name(count, ".so");
+	if (commandf("cc %s-fPIC -shared -o %s%s", cc_flags(), so_name, objects.content) != 0) {
+		fprintf(stderr, "ERROR: Could not build '%s'.\n", so_name);
+		units_free(&u);
+		exit(1);
+	}
+	check_built_so(c_paths, count, so_name);
+	Callables *calls = load_callables(so_name);
+
+	StringBuilder script = {0};
+	if (!read_whole_file(&script, lln_path)) {
+		remove(so_name);
+		units_free(&u);
+		exit(1);
+	}
+	Aot a = {0};
+	size_t invalid = visit_valid_comms(script.content, lln_path, calls, aot_add_comm, &a);
+	aot_flush_batch(&a);
+	remove(so_name);
+	free(so_name);
+	if (invalid > 0) {
+		fprintf(stderr, "ERROR: '%s' has %zu invalid command%s, not compiling it.\n", lln_path, invalid, invalid == 1 ? "" : "s");
+		units_free(&u);
+		exit(1);
+	}
+
+	StringBuilder gen = {0};
+	sb_appendf(&gen, "// Generated by `lln -aot` from %s, do not edit\n", lln_path);
+	sb_append_cstr(&gen, "#include <lln/lln.h>\n\n");
+	sb_append_cstr(&gen, "extern const lln_Callables __lln_preproc_callables;\n");
+	sb_term(&a.decls);
+	sb_append_cstr(&gen, a.decls.content);
+	sb_append_cstr(&gen, "\n// nothing cancels a compiled script\n");
+	sb_append_cstr(&gen, "__attribute__((weak)) bool lln_cancelled(void) {\n\treturn false;\n}\n\n");
+	if (a.data.len) {
+		sb_term(&a.data);
+		sb_append_cstr(&gen, a.data.content);
+	}
+	sb_append_cstr(&gen, "\nint lln_aot_run(void) {\n");
+	sb_append_cstr(&gen, "\t__lln_preproc_register_commands();\n");
+	sb_append_cstr(&gen, "\tif (__lln_preproc_callables.pre) __lln_preproc_callables.pre();\n");
+	if (a.body.len) {
+		sb_term(&a.body);
+		sb_append_cstr(&gen, a.body.content);
+	}
+	sb_append_cstr(&gen, "\tif (__lln_preproc_callables.post) __lln_preproc_callables.post();\n");
+	sb_append_cstr(&gen, "\treturn 0;\n}\n");
+	if (!shared) sb_append_cstr(&gen, "\nint main(void) {\n\treturn lln_aot_run();\n}\n");
+	aot_free(&a);
+	free(script.content);
+
+	char *gen_name = tmp_name(count, "_aot.c");
+	FILE *f = fopen(gen_name, "w");
+	if (!f) {
+		fprintf(stderr, "Could not create new file %s\n", gen_name);
+		units_free(&u);
+		exit(1);
+	}
+	fwrite(gen.content, 1, gen.len, f);
+	fclose(f);
+	free(gen.content);
+
+	int result = commandf("cc %s%s-o %s%s %s", cc_flags(), shared ? "-fPIC -shared " : "", file_out, objects.content, gen_name);
+	remove(gen_name);
+	free(gen_name);
+	free(objects.content);
+	units_free(&u);
+	if (result != 0) {
+		fprintf(stderr, "ERROR: Could not build '%s'.\n", file_out);
+		exit(1);
+	}
 }
 
 // ===== CLI TOOL =====
@@ -778,23 +1832,178 @@ void fprint_usage(FILE *f, const char *prog) {
 
 	fprintf(f, "Preprocessing:\n");
 	fprintf(f, "  %s -p  [input_file.c] [output_file.c]\n", prog);
-	fprintf(f, "      Preprocess C source file, output another C source file.\n\n");
+	fprintf(f, "      Preprocess C source file, output another C source file.\n");
+	fprintf(f, "  %s -p  [input_file.c...] [output_dir]\n", prog);
+	fprintf(f, "      Preprocess several C source files in parallel into output_dir.\n\n");
 
 	fprintf(f, "Compilation:\n");
-	fprintf(f, "  %s -c  [input_file.c] [output_executable]\n", prog);
-	fprintf(f, "      Preprocess and compile C file (with main) to self-contained executable.\n");
-	fprintf(f, "  %s -co [input_file.c] [output_file.so]\n", prog);
-	fprintf(f, "      Preprocess and compile main-less C file to shared object (.so).\n\n");
+	fprintf(f, "  %s -c  [input_file.c...] [output_executable]\n", prog);
+	fprintf(f, "      Preprocess and compile C files (one with main) to self-contained executable.\n");
+	fprintf(f, "  %s -co [input_file.c...] [output_file.so]\n", prog);
+	fprintf(f, "      Preprocess and compile main-less C files to shared object (.so).\n");
+	fprintf(f, "  %s -coi [input_file.c...] [output_file.so]\n", prog);
+	fprintf(f, "      Same as -co, but only rebuild the files (or included headers) that changed.\n\n");
 
 	fprintf(f, "Running:\n");
 	fprintf(f, "  %s -ro [input_file.lln] [input_file.so]\n", prog);
 	fprintf(f, "      Run .lln script using command implementations from shared object.\n");
-	fprintf(f, "  %s -rc [input_file.lln] [input_file.c]\n", prog);
-	fprintf(f, "      Run .lln script using command implementations from unprocessed main-less C source.\n");
+	fprintf(f, "  %s -rc [input_file.lln] [input_file.c...]\n", prog);
+	fprintf(f, "      Run .lln script using command implementations from unprocessed main-less C sources.\n");
+	fprintf(f, "  %s -serve [fd] [input_file.so]\n", prog);
+	fprintf(f, "      Run the scripts a client submits through the shared memory at fd (see lln_shm_create), until it closes it.\n");
+	fprintf(f, "  %s -replay [trace_file] [input_file.so]\n", prog);
+	fprintf(f, "      Run the commands recorded with --record again, without lexing or validating a script.\n\n");
+
+	fprintf(f, "Checking:\n");
+	fprintf(f, "  %s --check [input_file.so] [input_file.lln...]\n", prog);
+	fprintf(f, "      Validate .lln scripts in parallel without running them, print a JSON line per error (exit code 1 if any).\n\n");
+
+	fprintf(f, "Ahead-of-time compilation:\n");
+	fprintf(f, "  %s -aot [input_file.lln] [input_file.c...] [output_executable]\n", prog);
+	fprintf(f, "      Validate .lln script against main-less C sources, and compile both to an executable calling the commands directly.\n");
+	fprintf(f, "  %s -aot [input_file.lln] [input_file.c...] [output_file.so]\n", prog);
+	fprintf(f, "      Same, to a shared object whose `int lln_aot_run(void)` runs the script.\n\n");
+
+	fprintf(f, "Run options (anywhere on the command line):\n");
+	fprintf(f, "  --pipeline\n");
+	fprintf(f, "      Lex and validate commands on a separate thread, ahead of execution.\n");
+	fprintf(f, "  --lookahead [n]\n");
+	fprintf(f, "      Most commands validated ahead in pipelined mode (default %d).\n", LLN_PIPELINE_LOOKAHEAD);
+	fprintf(f, "  --lex-threads [n]\n");
+	fprintf(f, "      Lex and validate a large script on n threads (0: one per core) before running it.\n");
+	fprintf(f, "  --lex-chunk [bytes]\n");
+	fprintf(f, "      Least script each lexing thread gets (default %d).\n", LLN_LEX_CHUNK_MIN);
+	fprintf(f, "  --memo-size [n]\n");
+	fprintf(f, "      Most calls to pure commands cached (default %d), 0 turns caching off.\n", LLN_MEMO_SIZE);
+	fprintf(f, "  --memo-file [path]\n");
+	fprintf(f, "      Load the cache from path, and save it back after the run.\n");
+	fprintf(f, "  --deadline [seconds]\n");
+	fprintf(f, "      Time the commands may run in total, then the rest are skipped (exit code %d).\n", LLN_EXIT_TIMEOUT);
+	fprintf(f, "  --cmd-timeout [seconds]\n");
+	fprintf(f, "      Time any call may run, unless its command sets its own timeout.\n");
+	fprintf(f, "  --max-errors [n]\n");
+	fprintf(f, "      Most invalid command errors reported (a script, with --check), then only counted; 0 for no limit (default).\n");
+	fprintf(f, "  --diag-format [text|json]\n");
+	fprintf(f, "      Report invalid commands with their context (default), or as JSON lines like --check.\n");
+	fprintf(f, "  --mem-stats\n");
+	fprintf(f, "      Report the peak heap, allocations (by site, per command) and largest allocation of the run on stderr.\n");
+	fprintf(f, "  --record [path]\n");
+	fprintf(f, "      Write the commands run, with their arguments and timing, to a binary trace for -replay.\n");
+	fprintf(f, "  --replay-scale [x]\n");
+	fprintf(f, "      Replay with the recorded time between commands times x (1: as recorded), as fast as possible by default.\n");
+}
+
+// Parses the seconds following a time option, exits if there aren't any
+double parse_seconds(int argc, char **argv, int i) {
+	char *end;
+	double t = i + 1 < argc ? strtod(argv[i + 1], &end) : 0;
+	if (i + 1 >= argc || end == argv[i + 1] || *end || !isfinite(t) || t <= 0) {
+		fprintf(stderr, "ERROR: '%s' expects a positive number of seconds.\n", argv[i]);
+		exit(1);
+	}
+	return t;
+}
+
+// Removes the run options from argv, wherever they are
+void parse_run_options(int *argc, char **argv, RunOptions *opts, const char *prog) {
+	int kept = 1;
+	for (int i = 1; i < *argc; i++) {
+		const char *arg = argv[i];
+		if (strncmp(arg, "--", 2) != 0 || strcmp(arg, "--check") == 0) {
+			// --check is a mode, like -ro
+			argv[kept++] = argv[i];
+		} else if (strcmp(arg, "--pipeline") == 0) {
+			opts->pipelined = true;
+		} else if (strcmp(arg, "--memo-size") == 0) {
+			char *end;
+			if (i + 1 >= *argc || argv[i + 1][0] == '-') {
+				fprintf(stderr, "ERROR: '--memo-size' expects a number.\n");
+				exit(1);
+			}
+			opts->memo_size = strtoul(argv[++i], &end, 10);
+			if (*end) {
+				fprintf(stderr, "ERROR: '--memo-size' expects a number.\n");
+				exit(1);
+			}
+			opts->no_memo = opts->memo_size == 0;
+		} else if (strcmp(arg, "--memo-file") == 0) {
+			if (i + 1 >= *argc) {
+				fprintf(stderr, "ERROR: '--memo-file' expects a path.\n");
+				exit(1);
+			}
+			opts->memo_path = argv[++i];
+		} else if (strcmp(arg, "--deadline") == 0) {
+			opts->deadline = parse_seconds(*argc, argv, i++);
+		} else if (strcmp(arg, "--cmd-timeout") == 0) {
+			opts->cmd_timeout = parse_seconds(*argc, argv, i++);
+		} else if (strcmp(arg, "--lex-threads") == 0) {
+			char *end;
+			if (i + 1 >= *argc || argv[i + 1][0] == '-' || (opts->lex_threads = strtoul(argv[i + 1], &end, 10), *end)) {
+				fprintf(stderr, "ERROR: '--lex-threads' expects a number.\n");
+				exit(1);
+			}
+			if (opts->lex_threads == 0) {
+				long cores = sysconf(_SC_NPROCESSORS_ONLN);
+				opts->lex_threads = cores > 1 ? (size_t) cores : 1;
+			}
+			i++;
+		} else if (strcmp(arg, "--max-errors") == 0) {
+			char *end;
+			if (i + 1 >= *argc || argv[i + 1][0] == '-' || (opts->max_errors = strtoul(argv[i + 1], &end, 10), *end)) {
+				fprintf(stderr, "ERROR: '--max-errors' expects a number.\n");
+				exit(1);
+			}
+			i++;
+		} else if (strcmp(arg, "--diag-format") == 0) {
+			if (i + 1 >= *argc || (strcmp(argv[i + 1], "text") != 0 && strcmp(argv[i + 1], "json") != 0)) {
+				fprintf(stderr, "ERROR: '--diag-format' expects 'text' or 'json'.\n");
+				exit(1);
+			}
+			opts->json_diags = strcmp(argv[++i], "json") == 0;
+		} else if (strcmp(arg, "--mem-stats") == 0) {
+			opts->mem_stats = true;
+		} else if (strcmp(arg, "--record") == 0) {
+			if (i + 1 >= *argc) {
+				fprintf(stderr, "ERROR: '--record' expects a path.\n");
+				exit(1);
+			}
+			opts->record_path = argv[++i];
+		} else if (strcmp(arg, "--replay-scale") == 0) {
+			char *end;
+			if (i + 1 >= *argc || (opts->replay_scale = strtod(argv[i + 1], &end), end == argv[i + 1] || *end)
+					|| !isfinite(opts->replay_scale) || opts->replay_scale < 0) {
+				fprintf(stderr, "ERROR: '--replay-scale' expects a number, 0 or more.\n");
+				exit(1);
+			}
+			i++;
+		} else if (strcmp(arg, "--lex-chunk") == 0) {
+			char *end;
+			if (i + 1 >= *argc || (opts->lex_chunk = strtoul(argv[i + 1], &end, 10)) == 0 || *end) {
+				fprintf(stderr, "ERROR: '--lex-chunk' expects a positive number.\n");
+				exit(1);
+			}
+			i++;
+		} else if (strcmp(arg, "--lookahead") == 0) {
+			char *end;
+			if (i + 1 >= *argc || (opts->lookahead = strtoul(argv[i + 1], &end, 10)) == 0 || *end) {
+				fprintf(stderr, "ERROR: '--lookahead' expects a positive number.\n");
+				exit(1);
+			}
+			i++;
+		} else {
+			fprintf(stderr, "Invalid option '%s'\n", arg);
+			fprint_usage(stderr, prog);
+			exit(1);
+		}
+	}
+	*argc = kept;
+	argv[kept] = NULL;
 }
 
 int main(int argc, char **argv) {
 	const char *program_name = argv[0];
+	RunOptions opts = {0};
+	parse_run_options(&argc, argv, &opts, program_name);
 	if (!argv[1]) {
 		fprintf(stderr, "No argument was provided.\n");
 		fprint_usage(stderr, program_name);
@@ -807,35 +2016,70 @@ int main(int argc, char **argv) {
 			fprint_usage(stderr, program_name);
 			exit(1);
 		}
-		lln_preproc_file(argv[2], argv[3]);
+		lln_preproc_files((const char **) &argv[2], argc - 3, argv[argc - 1]);
 	} else if (strcmp(arg, "-c") == 0) {
 		if (argc < 4) {
 			fprintf(stderr, "ERROR: Too few arguments.\n");
 			fprint_usage(stderr, program_name);
 			exit(1);
 		}
-		lln_preproc_and_compile_file(argv[2], argv[3]);
+		lln_preproc_and_compile_file((const char **) &argv[2], argc - 3, argv[argc - 1]);
 	} else if (strcmp(arg, "-co") == 0) {
 		if (argc < 4) {
 			fprintf(stderr, "ERROR: Too few arguments.\n");
 			fprint_usage(stderr, program_name);
 			exit(1);
 		}
-		lln_preproc_and_compile_to_so(argv[2], argv[3]);
+		lln_preproc_and_compile_to_so((const char **) &argv[2], argc - 3, argv[argc - 1]);
+	} else if (strcmp(arg, "-coi") == 0) {
+		if (argc < 4) {
+			fprintf(stderr, "ERROR: Too few arguments.\n");
+			fprint_usage(stderr, program_name);
+			exit(1);
+		}
+		lln_preproc_and_compile_to_so_incremental((const char **) &argv[2], argc - 3, argv[argc - 1]);
 	} else if (strcmp(arg, "-ro") == 0) {
 		if (argc < 4) {
 			fprintf(stderr, "ERROR: Too few arguments.\n");
 			fprint_usage(stderr, program_name);
 			exit(1);
 		}
-		lln_run_from_so(argv[2], argv[3]);
+		lln_run_from_so(argv[2], argv[3], &opts);
 	} else if (strcmp(arg, "-rc") == 0) {
 		if (argc < 4) {
 			fprintf(stderr, "ERROR: Too few arguments.\n");
 			fprint_usage(stderr, program_name);
 			exit(1);
 		}
-		lln_run_from_c(argv[2], argv[3]);
+		lln_run_from_c(argv[2], (const char **) &argv[3], argc - 3, &opts);
+	} else if (strcmp(arg, "-serve") == 0) {
+		if (argc < 4) {
+			fprintf(stderr, "ERROR: Too few arguments.\n");
+			fprint_usage(stderr, program_name);
+			exit(1);
+		}
+		lln_serve(argv[2], argv[3], &opts);
+	} else if (strcmp(arg, "-replay") == 0) {
+		if (argc < 4) {
+			fprintf(stderr, "ERROR: Too few arguments.\n");
+			fprint_usage(stderr, program_name);
+			exit(1);
+		}
+		lln_replay(argv[2], argv[3], &opts);
+	} else if (strcmp(arg, "--check") == 0) {
+		if (argc < 4) {
+			fprintf(stderr, "ERROR: Too few arguments.\n");
+			fprint_usage(stderr, program_name);
+			exit(1);
+		}
+		lln_check(argv[2], (const char **) &argv[3], argc - 3, opts.max_errors);
+	} else if (strcmp(arg, "-aot") == 0) {
+		if (argc < 5) {
+			fprintf(stderr, "ERROR: Too few arguments.\n");
+			fprint_usage(stderr, program_name);
+			exit(1);
+		}
+		lln_aot(argv[2], (const char **) &argv[3], argc - 4, argv[argc - 1]);
 	} else if (strcmp(arg, "-h") == 0) {
 		fprint_usage(stderr, program_name);
 		exit(0);
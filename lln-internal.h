@@ -9,9 +9,12 @@ typedef enum {
 	TOK_STR,
 	TOK_INT,
 	TOK_FLT,
+	TOK_BLOB,
 	TOK_OPAREN,
 	TOK_CPAREN,
 	TOK_COMMA,
+	TOK_OBRACKET,
+	TOK_CBRACKET,
 	TOK_KW_TRUE,
 	TOK_KW_FALSE,
 	TOK_COMMENT,
@@ -24,15 +27,42 @@ typedef enum {
 // 	"TOK_STR",
 // 	"TOK_INT",
 // 	"TOK_FLT",
+// 	"TOK_BLOB",
 // 	"TOK_OPAREN",
 // 	"TOK_CPAREN",
 // 	"TOK_COMMA",
+// 	"TOK_OBRACKET",
+// 	"TOK_CBRACKET",
 // 	"TOK_KW_TRUE",
 // 	"TOK_KW_FALSE",
 // 	"TOK_COMMENT",
 // 	"TOK_COUNT"
 // };
 
+// ----- Tokens -----
+
+// Set on the kind of strings with a backslash, to unescape
+#define TOK_ESCAPED 0x80
+
+// Tokens of a script as parallel arrays, comments left out: the
+// parser and other passes over a whole script scan these alone
+typedef struct {
+	uint32_t *offset; // from the start of the script
+	// a '[' spans its whole array when it only has numbers, or the rest of
+	// the script if that may still become one
+	uint32_t *len;
+	uint8_t *kind; // TokKind, | TOK_ESCAPED
+	size_t count;
+	size_t capacity;
+} Tokens;
+
+// Appends the tokens of the NUL-terminated content from offset from on,
+// which must be less than 4 GiB. Returns where tokenizing resumes when
+// more is appended: the last token, or a number right before it, may
+// still change (the end if there is no token).
+size_t tokenize(const char *content, size_t from, Tokens *t);
+void tokens_free(Tokens *t);
+
 // ----- Loc -----
 
 typedef struct {
@@ -46,8 +76,96 @@ typedef struct {
 } Loc;
 
 void fprint_context(FILE *fptr, Loc loc, const char *format, ...);
+void sb_append_context(StringBuilder *sb, Loc loc, const char *format, va_list args);
+
+// 64-bit non-cryptographic hash, reads 8 bytes at a time
+uint64_t hash_bytes(const void *data, size_t len);
 
 int sb_appendf(StringBuilder *sb, const char *fmt, ...);
+// append n raw bytes, NULs included
+int sb_append_bytes(StringBuilder *sb, const void *data, size_t n);
 int sb_vappendf(StringBuilder *sb, const char *fmt, va_list args);
 
+// ----- Diagnostics -----
+
+typedef enum {
+	DIAG_UNKNOWN_COMMAND,
+	DIAG_MALFORMED,
+	DIAG_OVERFLOW,
+	DIAG_TOO_FEW_ARGS,
+	DIAG_TOO_MANY_ARGS,
+	DIAG_ARG_RANGE,
+	DIAG_ARG_TYPE,
+	DIAG_COUNT
+} DiagKind;
+
+// snake_case names, as in machine-readable output
+extern const char *DIAGKIND_STR[];
+
+// Why a command failed validation
+typedef struct {
+	DiagKind kind;
+	const char *name;
+	Loc loc;
+	size_t arg; // 1-based argument it is about, 0 if none
+	size_t item; // 1-based item of that argument for DIAG_OVERFLOW in an array, 0 if none
+	size_t expected_argc; // argument counts, once the command is known
+	size_t argc;
+	ArgType expected; // for DIAG_ARG_RANGE and DIAG_ARG_TYPE
+	ArgType actual;
+} Diag;
+
+typedef void (*DiagSink)(void *ctx, const Diag *d);
+
+// d with its context, as printed by lln -ro
+void sb_append_diag(StringBuilder *sb, const Diag *d);
+// d as an NDJSON line, as printed by lln --check
+void sb_append_diag_json(StringBuilder *sb, const Diag *d);
+void sb_append_json_str(StringBuilder *sb, const char *s);
+
+// Prints d with its context to the FILE * ctx, stderr if NULL
+void diag_print(void *ctx, const Diag *d);
+
+// Diagnostics formatted into memory and written to out in bulk, once
+// LLN_DIAG_BUFFER bytes are pending or on diag_buffer_flush. Past max
+// (0 for no limit), they are only counted.
+typedef struct {
+	StringBuilder buf;
+	FILE *out; // NULL to keep everything in buf
+	bool json;
+	size_t max;
+	size_t reported;
+	size_t suppressed;
+} DiagBuffer;
+
+// A DiagSink, ctx is the DiagBuffer
+void diag_buffer_push(void *ctx, const Diag *d);
+// A diagnostic already formatted like the buffer's
+void diag_buffer_push_formatted(DiagBuffer *b, const char *s, size_t n);
+void diag_buffer_flush(DiagBuffer *b);
+// Adds a summary of the suppressed diagnostics of filename and flushes;
+// buf is still the caller's to free
+void diag_buffer_end(DiagBuffer *b, const char *filename);
+
+// ----- Scripts -----
+
+// Returns false to stop the visit
+typedef bool (*CommVisitor)(void *ctx, const Callable *c, Args args, Loc loc);
+
+// Lexes and validates a whole script, calling visit with every valid
+// command, its arguments cast to the signature. Invalid commands are
+// reported on stderr; returns how many there were (up to the stop).
+LLN_API size_t visit_valid_comms(const char *content, const char *filename, const Callables *c, CommVisitor visit, void *ctx);
+
+// Lexes and validates a whole script without calling anything, reporting
+// every invalid command; returns how many there were
+size_t check_script(const char *content, const char *filename, const Callables *c, DiagSink report, void *ctx);
+
+// ----- FFI -----
+
+// Loads a compiled plugin and registers its commands, exits on error
+LLN_API Callables *load_plugin(char *so_path);
+// Builds the index of callables that don't have one yet
+LLN_API void callables_index(Callables *cs);
+
 #endif // _LLS_INTERNAL_H
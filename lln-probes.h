@@ -0,0 +1,78 @@
+#ifndef __LLN_PROBES_H
+#define __LLN_PROBES_H
+
+// Static user-space probes (USDT) of the "lln" provider, for bpftrace,
+// perf or systemtap, e.g. `bpftrace -e 'usdt:./lln:lln:cmd_entry { ... }'`.
+// A probe is a single nop and an ELF note until a tracer attaches to it.
+// Each probe has a semaphore, only set while a tracer is attached: guard
+// arguments that cost something to compute with LLN_PROBE_ENABLED.
+//
+// Built in when <sys/sdt.h> (systemtap-sdt-dev) is available, unless
+// LLN_NO_PROBES is defined. Otherwise probes compile to nothing.
+//
+// Runtime probes (lln.c):
+//   script_load(char *filename, size_t bytes)
+//   cmd_parsed(char *name, size_t argc, size_t line)
+//   cmd_valid(char *name, size_t argc, size_t line)
+//   cmd_invalid(char *name, size_t argc, size_t line)
+//   cmd_entry(char *name, size_t argc)
+//   cmd_return(char *name, size_t argc, uint64_t ns)
+//   batch_entry(char *name, size_t calls)
+//   batch_return(char *name, size_t calls, uint64_t ns)
+//   pre_entry(), pre_return(uint64_t ns)
+//   post_entry(), post_return(uint64_t ns)
+//
+// Preprocessor probes (lln-cli.c):
+//   preproc_entry(char *file_in, size_t unit)
+//   preproc_cmd(char *file_in, char *fnname, size_t line)
+//   preproc_return(char *file_in, size_t unit, size_t bytes_out)
+//   cc_entry(char *command)
+//   cc_return(char *command, int status, uint64_t ns)
+
+#if !defined(LLN_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define LLN_HAS_PROBES
+#endif // __has_include(<sys/sdt.h>)
+#endif // !LLN_NO_PROBES && __has_include
+
+#ifdef LLN_HAS_PROBES
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// Once per probe, at file scope of the file that fires it
+#define LLN_PROBE_DEFINE(name) \
+	unsigned short lln_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+#define LLN_PROBE_ENABLED(name) \
+	__builtin_expect(lln_##name##_semaphore != 0, 0)
+#define LLN_PROBE(name, ...) \
+	STAP_PROBEV(lln, name, ##__VA_ARGS__)
+
+#else // LLN_HAS_PROBES
+
+#define LLN_PROBE_DEFINE(name) \
+	extern int __lln_no_probe_##name
+#define LLN_PROBE_ENABLED(name) 0
+// the arguments are never evaluated, only kept referenced
+#define LLN_PROBE(name, ...) \
+	do { if (0) lln_probe_args(0, ##__VA_ARGS__); } while (0)
+static inline void lln_probe_args(int unused, ...) { (void) unused; }
+
+#endif // LLN_HAS_PROBES
+
+#include <time.h>
+#include <stdint.h>
+
+// Timestamp for the durations passed to probes, 0 if nothing traces `enabled`
+#define LLN_PROBE_START(enabled) \
+	(LLN_PROBE_ENABLED(enabled) ? lln_probe_now_ns() : 0)
+#define LLN_PROBE_NS(start) \
+	((start) ? lln_probe_now_ns() - (start) : 0)
+
+static inline uint64_t lln_probe_now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000u + (uint64_t) t.tv_nsec;
+}
+
+#endif // __LLN_PROBES_H
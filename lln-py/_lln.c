@@ -0,0 +1,323 @@
+// Native binding of the lln runtime for lln.py, see setup.py.
+//
+// Runs a script against Python callables: every command is added at run
+// time from its signature, with its callable as user pointer, so nothing is
+// compiled. Each valid command builds its arguments straight from the
+// lexer's and calls it through vectorcall. Streams hand the calls back
+// instead, for lln.py to await them.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define LLN_STRIP_PREFIX
+#include "../lln.h"
+#include "../lln-internal.h"
+
+// arguments kept on the stack up to this many
+#define SMALL_ARGC 8
+
+static PyObject *array_to_list(const Arg *arg) {
+	size_t n = arg->value.arr.count;
+	PyObject *list = PyList_New((Py_ssize_t) n);
+	if (!list) return NULL;
+	for (size_t i = 0; i < n; i++) {
+		PyObject *item;
+		switch (arg->type) {
+		case ARG_INT_ARR: item = PyLong_FromLong(((int *) arg->value.arr.items)[i]); break;
+		case ARG_FLT_ARR: item = PyFloat_FromDouble(((float *) arg->value.arr.items)[i]); break;
+		default:          item = PyFloat_FromDouble(((double *) arg->value.arr.items)[i]); break;
+		}
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, (Py_ssize_t) i, item);
+	}
+	return list;
+}
+
+static PyObject *arg_to_object(const Arg *arg) {
+	switch (arg->type) {
+	case ARG_INT:  return PyLong_FromLong(arg->value.i);
+	case ARG_I64:  return PyLong_FromLongLong(arg->value.l);
+	case ARG_FLT:  return PyFloat_FromDouble(arg->value.f);
+	case ARG_DBL:  return PyFloat_FromDouble(arg->value.d);
+	case ARG_BOOL: return PyBool_FromLong(arg->value.b);
+	case ARG_STR:
+		if (!arg->value.s) Py_RETURN_NONE;
+		return PyUnicode_DecodeUTF8(arg->value.s, (Py_ssize_t) strlen(arg->value.s), NULL);
+	case ARG_BLOB:
+		return PyBytes_FromStringAndSize(arg->value.arr.items, (Py_ssize_t) arg->value.arr.count);
+	case ARG_INT_ARR:
+	case ARG_FLT_ARR:
+	case ARG_DBL_ARR:
+		return array_to_list(arg);
+	default:
+		PyErr_Format(PyExc_ValueError, "Unknown arg type %d", (int) arg->type);
+		return NULL;
+	}
+}
+
+static void free_calls(Callables *calls) {
+	if (!calls) return;
+	for (size_t i = 0; i < calls->count; i++) Py_DECREF((PyObject *) calls->items[i].user);
+	callables_free(calls);
+}
+
+static void *call_fn(void *user, Args args);
+
+// Commands of {name: (signature, callable)}, each owning a reference to its
+// callable; NULL on error
+static Callables *build_calls(PyObject *commands) {
+	Callables *calls = callables_new();
+	if (!calls) return (Callables *) PyErr_NoMemory();
+	PyObject *name;
+	PyObject *value;
+	Py_ssize_t pos = 0;
+	while (PyDict_Next(commands, &pos, &name, &value)) {
+		const char *cname;
+		const char *signature;
+		PyObject *fn;
+		if (!PyUnicode_Check(name) || !(cname = PyUnicode_AsUTF8(name))) {
+			if (!PyErr_Occurred()) PyErr_SetString(PyExc_TypeError, "command names must be str");
+			goto fail;
+		}
+		if (!PyArg_ParseTuple(value, "sO:commands", &signature, &fn)) goto fail;
+		if (callables_add(calls, cname, signature, call_fn, fn) != 0) {
+			PyErr_Format(PyExc_ValueError, "invalid command '%s' with signature '%s'", cname, signature);
+			goto fail;
+		}
+		Py_INCREF(fn);
+	}
+	return calls;
+fail:
+	free_calls(calls);
+	return NULL;
+}
+
+static PyObject *args_to_tuple(Args args) {
+	PyObject *tuple = PyTuple_New((Py_ssize_t) args.count);
+	if (!tuple) return NULL;
+	for (size_t i = 0; i < args.count; i++) {
+		PyObject *item = arg_to_object(&args.items[i]);
+		if (!item) {
+			Py_DECREF(tuple);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(tuple, (Py_ssize_t) i, item);
+	}
+	return tuple;
+}
+
+// Calls user, the callable of a command: NULL with the exception set if it raised
+static void *call_fn(void *user, Args args) {
+	PyObject *fn = user;
+	// one free slot in front of the arguments, for PY_VECTORCALL_ARGUMENTS_OFFSET
+	PyObject *small[SMALL_ARGC + 1];
+	PyObject **argv = small;
+	if (args.count > SMALL_ARGC) {
+		argv = PyMem_Malloc((args.count + 1) * sizeof(PyObject *));
+		if (!argv) {
+			PyErr_NoMemory();
+			return NULL;
+		}
+	}
+	size_t n = 0;
+	for (; n < args.count; n++) {
+		argv[n + 1] = arg_to_object(&args.items[n]);
+		if (!argv[n + 1]) break;
+	}
+	PyObject *ret = NULL;
+	if (n == args.count) {
+		ret = PyObject_Vectorcall(fn, argv + 1, n | PY_VECTORCALL_ARGUMENTS_OFFSET, NULL);
+	}
+	for (size_t i = 0; i < n; i++) Py_DECREF(argv[i + 1]);
+	if (argv != small) PyMem_Free(argv);
+	if (!ret) return NULL;
+	Py_DECREF(ret);
+	return fn; // the result isn't kept, only whether there is one
+}
+
+// Stops the script on the first exception, which run() then raises
+static bool call_comm(void *ctx, const Callable *c, Args args, Loc loc) {
+	(void) ctx;
+	(void) loc;
+	return c->generic_fnptr(c->user, args) != NULL;
+}
+
+PyDoc_STRVAR(run_doc,
+"run(script_path, commands)\n"
+"--\n\n"
+"Run the script with the commands of {name: (signature, callable)}, see\n"
+"lln_callables_add() for the signature letters.");
+
+static PyObject *py_run(PyObject *self, PyObject *args) {
+	(void) self;
+	const char *script_path;
+	PyObject *commands;
+	if (!PyArg_ParseTuple(args, "sO!:run", &script_path, &PyDict_Type, &commands)) {
+		return NULL;
+	}
+	Callables *calls = build_calls(commands);
+	if (!calls) return NULL;
+	StringBuilder script = {0};
+	if (!read_whole_file(&script, script_path)) {
+		PyErr_Format(PyExc_OSError, "could not read '%s'", script_path);
+	} else {
+		visit_valid_comms(script.content, script_path, calls, call_comm, NULL);
+		mem_free(script.content);
+	}
+	free_calls(calls);
+	if (PyErr_Occurred()) return NULL;
+	Py_RETURN_NONE;
+}
+
+// ----- Stream -----
+
+typedef struct {
+	PyObject_HEAD
+	Callables *calls;
+	Stream *s;
+	PyObject *name; // bytes, the stream keeps a pointer to it
+	bool busy; // lexing without the GIL
+} StreamObject;
+
+static int stream_init(StreamObject *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {"commands", "name", NULL};
+	PyObject *commands;
+	PyObject *name = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O&:Stream", kwlist,
+			&PyDict_Type, &commands, PyUnicode_FSConverter, &name)) {
+		return -1;
+	}
+	if (self->s) {
+		PyErr_SetString(PyExc_RuntimeError, "Stream already initialized");
+		goto fail;
+	}
+	if (!name && !(name = PyBytes_FromString("<stream>"))) goto fail;
+	self->calls = build_calls(commands);
+	if (!self->calls) goto fail;
+	self->name = name;
+	self->s = stream_new(PyBytes_AS_STRING(name), self->calls);
+	return 0;
+fail:
+	Py_XDECREF(name);
+	return -1;
+}
+
+static void stream_dealloc(StreamObject *self) {
+	stream_free(self->s);
+	free_calls(self->calls);
+	Py_XDECREF(self->name);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// (callable, args) of every command complete so far
+static PyObject *stream_ready(StreamObject *self) {
+	PyObject *ready = PyList_New(0);
+	if (!ready) return NULL;
+	self->busy = true;
+	while (1) {
+		const Callable *c;
+		Args args;
+		Py_BEGIN_ALLOW_THREADS
+		c = stream_next(self->s, &args);
+		Py_END_ALLOW_THREADS
+		if (!c) break;
+		PyObject *tuple = args_to_tuple(args);
+		PyObject *call = tuple ? PyTuple_Pack(2, (PyObject *) c->user, tuple) : NULL;
+		Py_XDECREF(tuple);
+		if (!call || PyList_Append(ready, call) < 0) {
+			Py_XDECREF(call);
+			Py_CLEAR(ready);
+			break;
+		}
+		Py_DECREF(call);
+	}
+	self->busy = false;
+	return ready;
+}
+
+static bool stream_check(StreamObject *self) {
+	if (!self->s) {
+		PyErr_SetString(PyExc_RuntimeError, "Stream not initialized");
+		return false;
+	}
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "Stream used from two threads at once");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *stream_feed_py(StreamObject *self, PyObject *arg) {
+	if (!stream_check(self)) return NULL;
+	const char *data;
+	Py_ssize_t n;
+	if (PyUnicode_Check(arg)) {
+		data = PyUnicode_AsUTF8AndSize(arg, &n);
+		if (!data) return NULL;
+	} else if (PyBytes_Check(arg)) {
+		data = PyBytes_AS_STRING(arg);
+		n = PyBytes_GET_SIZE(arg);
+	} else {
+		PyErr_Format(PyExc_TypeError, "feed() expects str or bytes, not %.200s", Py_TYPE(arg)->tp_name);
+		return NULL;
+	}
+	stream_feed(self->s, data, (size_t) n);
+	return stream_ready(self);
+}
+
+static PyObject *stream_close_py(StreamObject *self, PyObject *unused) {
+	(void) unused;
+	if (!stream_check(self)) return NULL;
+	stream_close(self->s);
+	return stream_ready(self);
+}
+
+static PyMethodDef stream_methods[] = {
+	{"feed", (PyCFunction) stream_feed_py, METH_O,
+		"feed(chunk) -> list[(callable, args)]\n--\n\n"
+		"Append a chunk of the script, return the commands it completed."},
+	{"close", (PyCFunction) stream_close_py, METH_NOARGS,
+		"close() -> list[(callable, args)]\n--\n\n"
+		"End the script, return the commands left."},
+	{NULL, NULL, 0, NULL},
+};
+
+static PyTypeObject StreamType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "_lln.Stream",
+	.tp_doc = "Stream(commands, name='<stream>')\n--\n\n"
+		"Incremental lexing of a script that arrives in chunks.",
+	.tp_basicsize = sizeof(StreamObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc) stream_init,
+	.tp_dealloc = (destructor) stream_dealloc,
+	.tp_methods = stream_methods,
+};
+
+static PyMethodDef py_methods[] = {
+	{"run", py_run, METH_VARARGS, run_doc},
+	{NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef py_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "_lln",
+	.m_doc = "Native binding of the lln runtime, used by lln.py.",
+	.m_size = -1,
+	.m_methods = py_methods,
+};
+
+PyMODINIT_FUNC PyInit__lln(void) {
+	if (PyType_Ready(&StreamType) < 0) return NULL;
+	PyObject *m = PyModule_Create(&py_module);
+	if (!m) return NULL;
+	if (PyModule_AddObjectRef(m, "Stream", (PyObject *) &StreamType) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+	return m;
+}
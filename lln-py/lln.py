@@ -1,64 +1,13 @@
-import subprocess
 import inspect
+import asyncio
 from typing import Optional
 from pathlib import Path
-from tempfile import NamedTemporaryFile
-from shutil import which
-import os
 
-if which("lln") is None:
-    raise RuntimeError("'lln' executable not found in PATH, please install LLinal.")
-
-from typing import Any, IO
+from typing import Any, AsyncIterator
 type Command = dict[str, Any]
 type Commands = dict[str, Command]
 global_commands: Commands = {}
 
-# ===== Plugin generation =====
-
-LLN_BUILD_DIR: Path = Path("./.lln-build/")
-
-def compile_plugin(c_file: Path, output_so: Path):
-    compile_cmd = [
-        "lln", "-co", str(c_file), str(output_so)
-    ]
-
-    subprocess.run(compile_cmd, check=True)
-
-def hash_name(commands: Commands) -> str:
-    return "lln_build.so" # TODO
-
-def get_plugin(commands: Commands) -> Path:
-    if not LLN_BUILD_DIR.exists():
-        LLN_BUILD_DIR.mkdir()
-
-    so_path = LLN_BUILD_DIR / hash_name(commands) # TODO: generate this procedurally correctly
-
-    if not so_path.exists():
-        with NamedTemporaryFile(suffix='.c', mode='w',dir=LLN_BUILD_DIR) as c_file:
-            write_c_file(c_file, commands)
-            compile_plugin(Path(c_file.name), so_path)
-
-    return so_path
-
-# ----- C gen -----
-
-def write_c_file(f: IO, commands: Commands):
-    f.write("#include <lln/lln.h>\n\n")
-
-    for name, cmd in commands.items():
-        f.write(f"// @cmd {name}\n")
-        args = ""
-        for i, t in enumerate(cmd['c_types']):
-            args += f"{t} a{i}, "
-        args = args[:-2]
-        f.write(f"void *__py_gen_{cmd['fn'].__name__}({args})")
-        f.write("{\n")
-        f.write("\t// this is a placeholder function, its pointer is never called.\n")
-        f.write("\treturn NULL;\n")
-        f.write("}\n")
-    f.flush()
-
 # ===== Execution =====
 
 # ----- ctypes def -----
@@ -69,6 +18,12 @@ import ctypes, ctypes.util
 # 	ARG_FLT,
 # 	ARG_STR,
 # 	ARG_BOOL,
+# 	ARG_INT_ARR,
+# 	ARG_FLT_ARR,
+# 	ARG_DBL_ARR,
+# 	ARG_BLOB,
+# 	ARG_I64,
+# 	ARG_DBL,
 # 	ARG_COUNT
 # } lln_ArgType;
 class ArgType(ctypes.c_int):
@@ -78,21 +33,48 @@ ARG_INT = 0
 ARG_FLT = 1
 ARG_STR = 2
 ARG_BOOL = 3
+ARG_INT_ARR = 4
+ARG_FLT_ARR = 5
+ARG_DBL_ARR = 6
+ARG_BLOB = 7
+ARG_I64 = 8
+ARG_DBL = 9
 
 # typedef union {
 # 	int i;
 # 	float f;
+# 	int64_t l;
+# 	double d;
 # 	bool b;
 # 	char *s;
+# 	struct {
+# 		void *items;
+# 		size_t count;
+# 	} arr;
 # } lln_ArgValue;
+class ArgArray(ctypes.Structure):
+    _fields_ = [
+        ("items", ctypes.c_void_p),
+        ("count", ctypes.c_size_t),
+    ]
+
 class ArgValue(ctypes.Union):
     _fields_ = [
         ("i", ctypes.c_int),
         ("f", ctypes.c_float),
+        ("l", ctypes.c_int64),
+        ("d", ctypes.c_double),
         ("b", ctypes.c_bool),
         ("s", ctypes.c_char_p),
+        ("arr", ArgArray),
     ]
 
+ARRAY_ITEM_CTYPES = {
+    ARG_INT_ARR: ctypes.c_int,
+    ARG_FLT_ARR: ctypes.c_float,
+    ARG_DBL_ARR: ctypes.c_double,
+}
+
 # typedef struct {
 # 	lln_ArgType type;
 # 	lln_ArgValue value;
@@ -139,15 +121,21 @@ class Comm(ctypes.Structure):
 	# char *name;
 	# Args args;
 	# bool malformed;
+	# size_t overflow; // 1-based index of the first out of range number, 0 if none
+	# size_t overflow_item; // 1-based item of that argument if it's an array, 0 if not
 	#
 	# Loc loc;
 	# CommandFnPtr f;
+	# const Callable *callable;
     _fields_ = [
         ("name", ctypes.c_char_p),
         ("args", Args),
         ("malformed", ctypes.c_bool),
+        ("overflow", ctypes.c_size_t),
+        ("overflow_item", ctypes.c_size_t),
         ("loc", Loc),
         ("f", CommandFnPtr),
+        ("callable", ctypes.c_void_p),
     ]
 
 # ----- run lln file -----
@@ -162,10 +150,19 @@ def unpack_args(c_args: Args):
             py_args.append(v.i)
         elif t == ARG_FLT:
             py_args.append(v.f)
+        elif t == ARG_I64:
+            py_args.append(v.l)
+        elif t == ARG_DBL:
+            py_args.append(v.d)
         elif t == ARG_STR:
             py_args.append(v.s.decode() if v.s else None)
         elif t == ARG_BOOL:
             py_args.append(bool(v.b))
+        elif t == ARG_BLOB:
+            py_args.append(ctypes.string_at(v.arr.items, v.arr.count))
+        elif t in ARRAY_ITEM_CTYPES:
+            items = ctypes.cast(v.arr.items, ctypes.POINTER(ARRAY_ITEM_CTYPES[t]))
+            py_args.append(items[:v.arr.count])
         else:
             raise ValueError(f"Unknown arg type {t}")
     return py_args
@@ -176,46 +173,141 @@ def load_commands(py_commands_path: Optional[Path]) -> Commands:
     else:
         return global_commands
 
-# load lln globally
+# load lln globally, so the commands can call it (e.g. lln_cancelled)
 lln_path = ctypes.util.find_library('lln')
-lln = ctypes.CDLL(lln_path)
+if lln_path is None:
+    raise RuntimeError("'liblln' not found, please install LLinal.")
+lln = ctypes.CDLL(lln_path, mode=ctypes.RTLD_GLOBAL)
+
+# native binding (setup.py), the ctypes one below is the fallback
+try:
+    import _lln
+except ImportError:
+    _lln = None
+
+def native_commands(commands: Commands) -> dict:
+    """{name: (signature, fn)}, as _lln takes them."""
+    return {name: (cmd['signature'], cmd['fn']) for name, cmd in commands.items()}
+
+def ctypes_callables(commands: Commands) -> ctypes.c_void_p:
+    """lln_Callables of the commands, whose calls the caller makes itself."""
+    lln.lln_callables_new.restype = ctypes.c_void_p
+    calls = ctypes.c_void_p(lln.lln_callables_new())
+    for name, cmd in commands.items():
+        if lln.lln_callables_add(calls, name.encode('utf-8'), cmd['signature'].encode('ascii'), None, None) != 0:
+            lln.lln_callables_free(calls)
+            raise ValueError(f"ERROR: LLN: invalid command '{name}'")
+    return calls
 
 def lln_run(lln_script_path: str, py_commands_path: Optional[Path] = None):
     commands = load_commands(py_commands_path)
-    so_path = str(get_plugin(commands))
-    lln.load_plugin(ctypes.c_char_p(
-        so_path.encode('utf-8')
-    ))
+    if _lln is not None:
+        _lln.run(lln_script_path, native_commands(commands))
+        return
+
+    calls = ctypes_callables(commands)
     lln.load_file(ctypes.c_char_p(
         lln_script_path.encode('utf-8')
     ))
 
     lln.next_comm.restype = ctypes.POINTER(Comm)
-    comm: ctypes.POINTER(Comm) = lln.next_comm()
+    comm: ctypes.POINTER(Comm) = lln.next_comm(calls)
     while comm:
         args = unpack_args(comm.contents.args)
         py_fn = commands[comm.contents.name.decode()]['fn']
         py_fn(*args)
-        comm = lln.next_comm()
+        comm = lln.next_comm(calls)
+    lln.lln_callables_free(calls)
+
+# ----- run a streamed script -----
+
+# chunks are lexed on the event loop while the input buffered since the last
+# command that ran stays under this many characters, on a thread past it
+STREAM_INLINE_CHARS = 64 * 1024
+
+class CtypesStream:
+    """Fallback of _lln.Stream, through lln_stream_* and ctypes."""
+
+    def __init__(self, commands: dict, name: str = "<stream>"):
+        lln.lln_stream_new.restype = ctypes.c_void_p
+        # the Callable's name is its first field
+        lln.lln_stream_next.restype = ctypes.POINTER(ctypes.c_char_p)
+        self.calls = ctypes_callables({cmd_name: {'signature': sig} for cmd_name, (sig, _) in commands.items()})
+        self.name = ctypes.c_char_p(name.encode('utf-8')) # the stream keeps a pointer to it
+        self.s = ctypes.c_void_p(lln.lln_stream_new(self.name, self.calls))
+        self.commands = {cmd_name: fn for cmd_name, (_, fn) in commands.items()}
+
+    def feed(self, chunk):
+        data = chunk.encode('utf-8') if isinstance(chunk, str) else chunk
+        lln.lln_stream_feed(self.s, data, ctypes.c_size_t(len(data)))
+        return self.ready()
+
+    def close(self):
+        lln.lln_stream_close(self.s)
+        return self.ready()
+
+    def ready(self):
+        calls = []
+        args = Args()
+        c = lln.lln_stream_next(self.s, ctypes.byref(args))
+        while c:
+            calls.append((self.commands[c.contents.value.decode()], tuple(unpack_args(args))))
+            c = lln.lln_stream_next(self.s, ctypes.byref(args))
+        return calls
+
+    def __del__(self):
+        lln.lln_stream_free(self.s)
+        lln.lln_callables_free(self.calls)
+
+async def lln_run_stream(chunks: AsyncIterator[str], py_commands_path: Optional[Path] = None, name: str = "<stream>"):
+    """Run a script as it arrives: every command is called as soon as its
+    chunk completes it, and awaited if it is a coroutine function."""
+    commands = native_commands(load_commands(py_commands_path))
+    stream = _lln.Stream(commands, name) if _lln is not None else CtypesStream(commands, name)
+
+    async def dispatch(calls):
+        for fn, args in calls:
+            result = fn(*args)
+            if inspect.isawaitable(result):
+                await result
+
+    # a feed may parse again the command left incomplete, from its start
+    pending = 0
+    async for chunk in chunks:
+        pending += len(chunk)
+        if pending <= STREAM_INLINE_CHARS:
+            calls = stream.feed(chunk)
+        else:
+            calls = await asyncio.to_thread(stream.feed, chunk)
+        if calls:
+            pending = 0
+        await dispatch(calls)
+    await dispatch(stream.close())
 
 # ===== Command registration =====
 
 def lln_cmd(name=None):
     def decorator(fn):
-        source_file = inspect.getfile(fn)
         sig = inspect.signature(fn)
-        c_types = []
+        # letters of lln_callables_add()
+        signature = ""
         for p in sig.parameters.values():
             if p.annotation == str:
-                c_types.append("char *")
+                signature += "s"
             elif p.annotation == int:
-                c_types.append("int")
+                signature += "l"
             elif p.annotation == float:
-                c_types.append("float")
+                signature += "d"
             elif p.annotation == bool:
-                c_types.append("bool")
+                signature += "b"
+            elif p.annotation == list[int]:
+                signature += "I"
+            elif p.annotation == list[float]:
+                signature += "D"
+            elif p.annotation == bytes:
+                signature += "x"
             else:
-                raise TypeError(f"ERROR: LLN: Unsupported arg type {p.annotation}. Supported types: 'str', 'int', 'float', 'bool'")
+                raise TypeError(f"ERROR: LLN: Unsupported arg type {p.annotation}. Supported types: 'str', 'int', 'float', 'bool', 'list[int]', 'list[float]', 'bytes'")
 
         cmd_name: str = name or f"!{fn.__name__}"
         if cmd_name[0] != '!':
@@ -223,7 +315,7 @@ def lln_cmd(name=None):
 
         global_commands[cmd_name] = {
             'fn': fn,
-            'c_types': c_types,
+            'signature': signature,
         }
         return fn
 
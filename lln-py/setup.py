@@ -0,0 +1,18 @@
+# Builds the _lln extension next to lln.py: `make python` from the root, or
+#   python3 setup.py build_ext --inplace
+# It links against liblln, so `make install` first (or set LD_LIBRARY_PATH).
+from setuptools import setup, Extension
+
+setup(
+    name="lln",
+    py_modules=["lln"],
+    ext_modules=[
+        Extension(
+            "_lln",
+            sources=["_lln.c"],
+            libraries=["lln"],
+            library_dirs=[".."],
+            extra_compile_args=["-Wall", "-Wextra"],
+        ),
+    ],
+)
@@ -1,17 +1,197 @@
+#define _GNU_SOURCE // memfd_create
 #define LLN_STRIP_PREFIX
+// dynamic arrays grow through the allocator hooks too
+#define LLN_DA_REALLOC(ptr, size) lln_mem_realloc(LLN_MEM_DA, (ptr), (size))
 #include "lln.h"
 #include "lln-internal.h"
+#include "lln-probes.h"
 #include <dlfcn.h>
+#include <errno.h>
+#include <float.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <locale.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+LLN_PROBE_DEFINE(script_load);
+LLN_PROBE_DEFINE(cmd_parsed);
+LLN_PROBE_DEFINE(cmd_valid);
+LLN_PROBE_DEFINE(cmd_invalid);
+LLN_PROBE_DEFINE(cmd_entry);
+LLN_PROBE_DEFINE(cmd_return);
+LLN_PROBE_DEFINE(batch_entry);
+LLN_PROBE_DEFINE(batch_return);
+LLN_PROBE_DEFINE(pre_entry);
+LLN_PROBE_DEFINE(pre_return);
+LLN_PROBE_DEFINE(post_entry);
+LLN_PROBE_DEFINE(post_return);
 
 // ===== UTILS =====
 
+// ----- Allocator -----
+
+static void *libc_malloc(void *user, size_t size, size_t align) {
+	(void) user;
+	return align ? aligned_alloc(align, size) : malloc(size);
+}
+
+static void *libc_realloc(void *user, void *ptr, size_t size) {
+	(void) user;
+	return realloc(ptr, size);
+}
+
+static void libc_free(void *user, void *ptr) {
+	(void) user;
+	free(ptr);
+}
+
+static size_t libc_size(void *user, void *ptr) {
+	(void) user;
+	return malloc_usable_size(ptr);
+}
+
+static const Allocator libc_allocator = {
+	.malloc = libc_malloc,
+	.realloc = libc_realloc,
+	.free = libc_free,
+	.size = libc_size,
+};
+
+static Allocator g_allocator = libc_allocator;
+
+// Counters of lln_mem_count. Bytes in use can go below zero when blocks
+// allocated before counting started are freed.
+static struct {
+	atomic_bool on;
+	atomic_size_t allocs;
+	atomic_size_t sites[MEM_SITE_COUNT];
+	atomic_llong bytes;
+	atomic_llong peak;
+	atomic_size_t largest;
+	atomic_size_t commands;
+} g_mem;
+
+void set_allocator(const Allocator *a) {
+	g_allocator = a ? *a : libc_allocator;
+}
+
+static inline bool mem_counting(void) {
+	return atomic_load_explicit(&g_mem.on, memory_order_relaxed);
+}
+
+static inline long long mem_usable(void *ptr) {
+	return ptr && g_allocator.size ? (long long) g_allocator.size(g_allocator.user, ptr) : 0;
+}
+
+static void mem_count_bytes(long long delta) {
+	long long bytes = atomic_fetch_add_explicit(&g_mem.bytes, delta, memory_order_relaxed) + delta;
+	long long peak = atomic_load_explicit(&g_mem.peak, memory_order_relaxed);
+	while (bytes > peak && !atomic_compare_exchange_weak_explicit(&g_mem.peak, &peak, bytes,
+			memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+static void mem_count_alloc(MemSite site, size_t size, long long delta) {
+	atomic_fetch_add_explicit(&g_mem.allocs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&g_mem.sites[site], 1, memory_order_relaxed);
+	size_t largest = atomic_load_explicit(&g_mem.largest, memory_order_relaxed);
+	while (size > largest && !atomic_compare_exchange_weak_explicit(&g_mem.largest, &largest, size,
+			memory_order_relaxed, memory_order_relaxed)) {}
+	mem_count_bytes(delta);
+}
+
+static void *mem_alloc_aligned(MemSite site, size_t size, size_t align) {
+	void *ptr = g_allocator.malloc(g_allocator.user, size, align);
+	if (ptr && mem_counting()) mem_count_alloc(site, size, mem_usable(ptr));
+	return ptr;
+}
+
+void *mem_alloc(MemSite site, size_t size) {
+	return mem_alloc_aligned(site, size, 0);
+}
+
+static void *mem_calloc(size_t n, size_t size) {
+	if (size && n > SIZE_MAX / size) return NULL;
+	void *ptr = mem_alloc(MEM_OTHER, n * size);
+	if (ptr) memset(ptr, 0, n * size);
+	return ptr;
+}
+
+void *mem_realloc(MemSite site, void *ptr, size_t size) {
+	bool counting = mem_counting();
+	long long old = counting ? mem_usable(ptr) : 0;
+	void *new_ptr = g_allocator.realloc(g_allocator.user, ptr, size);
+	if (new_ptr && counting) mem_count_alloc(site, size, mem_usable(new_ptr) - old);
+	return new_ptr;
+}
+
+void mem_free(void *ptr) {
+	if (!ptr) return;
+	if (mem_counting()) mem_count_bytes(-mem_usable(ptr));
+	g_allocator.free(g_allocator.user, ptr);
+}
+
+void mem_count(bool on) {
+	if (on) {
+		atomic_store(&g_mem.allocs, 0);
+		for (size_t i = 0; i < MEM_SITE_COUNT; i++) atomic_store(&g_mem.sites[i], 0);
+		atomic_store(&g_mem.bytes, 0);
+		atomic_store(&g_mem.peak, 0);
+		atomic_store(&g_mem.largest, 0);
+		atomic_store(&g_mem.commands, 0);
+	}
+	atomic_store(&g_mem.on, on);
+}
+
+MemStats mem_stats(void) {
+	MemStats s = {
+		.allocs = atomic_load(&g_mem.allocs),
+		.peak_bytes = (size_t) atomic_load(&g_mem.peak),
+		.largest = atomic_load(&g_mem.largest),
+		.commands = atomic_load(&g_mem.commands),
+	};
+	for (size_t i = 0; i < MEM_SITE_COUNT; i++) s.sites[i] = atomic_load(&g_mem.sites[i]);
+	return s;
+}
+
+static const char *mem_site_names[MEM_SITE_COUNT] = {
+	[MEM_SB] = "string builders",
+	[MEM_DA] = "dynamic arrays",
+	[MEM_ARGS] = "arguments",
+	[MEM_TOKENS] = "tokens",
+	[MEM_FILE] = "script files",
+	[MEM_OTHER] = "other",
+};
+
+static void fprint_mem_stats(FILE *f, const char *filename, const MemStats *s) {
+	StringBuilder sb = {0};
+	sb_appendf(&sb, "%s: peak %zu bytes, %zu allocations", filename, s->peak_bytes, s->allocs);
+	if (s->commands) sb_appendf(&sb, " (%.2f per command, %zu commands)", (double) s->allocs / s->commands, s->commands);
+	sb_appendf(&sb, ", largest %zu bytes.\n  by site:", s->largest);
+	for (size_t i = 0; i < MEM_SITE_COUNT; i++) {
+		sb_appendf(&sb, "%s %s %zu", i ? "," : "", mem_site_names[i], s->sites[i]);
+	}
+	sb_append(&sb, '\n');
+	fwrite(sb.content, 1, sb.len, f);
+	mem_free(sb.content);
+}
+
 // ----- StringBuilder -----
 
 int sb_reserve(StringBuilder *sb, size_t new_cap) {
 	if (sb->cap < new_cap) {
 		if (sb->cap == 0) sb->cap = LLN_DEF_CAP;
 		while (sb->cap < new_cap) sb->cap *= 2;
-		void *temp = realloc(sb->content, sb->cap * sizeof(char));
+		void *temp = mem_realloc(MEM_SB, sb->content, sb->cap * sizeof(char));
 		if (!temp) return -1;
 		sb->content = temp;
 	}
@@ -31,6 +211,13 @@ int sb_append_strn(StringBuilder *sb, const char *s, size_t n) {
 	return 0;
 }
 
+int sb_append_bytes(StringBuilder *sb, const void *data, size_t n) {
+	if (sb_reserve(sb, sb->len + n)) return -1;
+	memcpy(sb->content + sb->len, data, n);
+	sb->len += n;
+	return 0;
+}
+
 int sb_append_cstr(StringBuilder *sb, const char *s) {
 	return sb_append_strn(sb, s, strlen(s));
 }
@@ -42,7 +229,8 @@ int sb_vappendf(StringBuilder *sb, const char *fmt, va_list args) {
 	va_end(args_cp);
 	if (needed < 0) return -1;
 
-	if (sb_reserve(sb, sb->len + (size_t) needed) != 0)
+	// room for vsnprintf's NUL too
+	if (sb_reserve(sb, sb->len + (size_t) needed + 1) != 0)
 		return -1;
 
 	vsnprintf(sb->content + sb->len, (size_t) needed + 1, fmt, args);
@@ -61,14 +249,14 @@ int sb_appendf(StringBuilder *sb, const char *fmt, ...) {
 }
 
 char *sb_new_cstr(StringBuilder *sb) {
-	char *cstr = malloc(sb->len+1);
+	char *cstr = mem_alloc(MEM_SB, sb->len+1);
 	if (cstr == NULL) return NULL;
 	strcpy(cstr, sb->content);
 	return cstr;
 }
 
 char *sb_new_cstrn(StringBuilder *sb, size_t n) {
-	char *cstr = malloc(n+1);
+	char *cstr = mem_alloc(MEM_SB, n+1);
 	if (cstr == NULL) return NULL;
 	strcpy(cstr, sb->content);
 	cstr[n] = '\0';
@@ -82,7 +270,7 @@ char *sb_new_cstrn(StringBuilder *sb, size_t n) {
 const char *read_whole_file(StringBuilder *sb, const char *filename) {
 	FILE *fd = fopen(filename, "r");
 	if (!fd) {
-		fprintf(stderr, "Could not open file '%s'", filename);
+		fprintf(stderr, "Could not open file '%s'\n", filename);
 		return NULL;
 	}
 
@@ -92,16 +280,16 @@ const char *read_whole_file(StringBuilder *sb, const char *filename) {
 
 	if (sb->cap == 0) sb->cap = LLN_DEF_CAP;
 	while (sb->len + len >= sb->cap) sb->cap *= 2;
-	void *temp = realloc(sb->content, sb->cap * sizeof(char));
+	void *temp = mem_realloc(MEM_FILE, sb->content, sb->cap * sizeof(char));
 	if (!temp) {
-		fprintf(stderr, "Could not open file '%s' (insufficient memory)", filename);
+		fprintf(stderr, "Could not open file '%s' (insufficient memory)\n", filename);
 		return NULL;
 	}
 	sb->content = temp;
 
 	size_t read_len = fread(sb->content + sb->len, 1, len, fd);
 	if (read_len != len) {
-		fprintf(stderr, "Could not read whole file '%s' (file too big)", filename);
+		fprintf(stderr, "Could not read whole file '%s' (file too big)\n", filename);
 		return NULL;
 	}
 	
@@ -112,6 +300,245 @@ const char *read_whole_file(StringBuilder *sb, const char *filename) {
 	return sb->content;
 }
 
+// ----- Hash -----
+
+static inline uint64_t hash_mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+uint64_t hash_bytes(const void *data, size_t len) {
+	const unsigned char *p = data;
+	uint64_t h = hash_mix(len ^ 0x9e3779b97f4a7c15ULL);
+	uint64_t k;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&k, p, 8);
+		h = hash_mix(h ^ k);
+	}
+	k = 0;
+	memcpy(&k, p, len);
+	return hash_mix(h ^ k);
+}
+
+// ----- Base64 -----
+
+// 6-bit value of each base64 character, 0xff for anything else
+static const uint8_t B64_DECODE[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline __m128i b64_in_range(__m128i c, char lo, char hi) {
+	return _mm_and_si128(
+		_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+		_mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+}
+
+// Decodes 16 characters into 12 bytes, but stores 13 (the last byte is
+// garbage, overwritten by whatever comes next). Returns false without
+// writing anything if the block has non-base64 characters.
+static inline bool b64_decode_block(uint8_t *out, const char *in) {
+	__m128i c = _mm_loadu_si128((const __m128i *) in);
+	__m128i upper = b64_in_range(c, 'A', 'Z');
+	__m128i lower = b64_in_range(c, 'a', 'z');
+	__m128i digit = b64_in_range(c, '0', '9');
+	__m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+	__m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+	__m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+	if (_mm_movemask_epi8(valid) != 0xffff) return false;
+
+	// character -> 6-bit value, as a per-range offset
+	__m128i shift = _mm_or_si128(
+		_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+		_mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+			_mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')), _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+	__m128i v = _mm_add_epi8(c, shift);
+
+	// pack 4 x 6 bits into the low 24 bits of every 32-bit lane
+	__m128i ab = _mm_or_si128(
+		_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 6),
+		_mm_srli_epi16(v, 8));
+	__m128i abcd = _mm_or_si128(
+		_mm_slli_epi32(_mm_and_si128(ab, _mm_set1_epi32(0xffff)), 12),
+		_mm_srli_epi32(ab, 16));
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i *) lanes, abcd);
+	for (size_t i = 0; i < 4; i++) {
+		uint32_t be = __builtin_bswap32(lanes[i] << 8);
+		memcpy(out + 3 * i, &be, 4);
+	}
+	return true;
+}
+#endif // __SSE2__
+
+// Decodes n characters of base64, '=' padding optional. out needs room
+// for n / 4 * 3 + 2 bytes. Returns the decoded length, -1 if invalid.
+ptrdiff_t b64_decode(uint8_t *out, const char *in, size_t n) {
+	if (n >= 4 && n % 4 == 0 && in[n - 1] == '=') n -= in[n - 2] == '=' ? 2 : 1;
+	if (n % 4 == 1) return -1;
+
+	size_t i = 0;
+	uint8_t *o = out;
+#if defined(__SSE2__)
+	// keep at least 4 characters for the tail, so the
+	// overlapping store of a block stays inside out
+	for (; i + 20 <= n; i += 16, o += 12) {
+		if (!b64_decode_block(o, in + i)) break;
+	}
+#endif // __SSE2__
+	uint8_t bad = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint8_t a = B64_DECODE[(uint8_t) in[i]], b = B64_DECODE[(uint8_t) in[i + 1]];
+		uint8_t c = B64_DECODE[(uint8_t) in[i + 2]], d = B64_DECODE[(uint8_t) in[i + 3]];
+		bad |= a | b | c | d;
+		*o++ = (uint8_t) (a << 2 | b >> 4);
+		*o++ = (uint8_t) (b << 4 | c >> 2);
+		*o++ = (uint8_t) (c << 6 | d);
+	}
+	if (i < n) {
+		uint8_t a = B64_DECODE[(uint8_t) in[i]], b = B64_DECODE[(uint8_t) in[i + 1]];
+		uint8_t c = n - i == 3 ? B64_DECODE[(uint8_t) in[i + 2]] : 0;
+		bad |= a | b | c;
+		*o++ = (uint8_t) (a << 2 | b >> 4);
+		if (n - i == 3) *o++ = (uint8_t) (b << 4 | c >> 2);
+	}
+	if (bad & 0x80) return -1;
+	return o - out;
+}
+
+// ----- Numbers -----
+
+// Length of the number literal at s, 0 if there is none:
+// [+-]? (digits [. digits?] | . digits) ([eE] [+-]? digits)?
+// is_int is set when it has neither a fraction nor an exponent.
+size_t scan_number(const char *s, bool *is_int) {
+	size_t i = 0, digits = 0;
+	*is_int = true;
+	if (s[i] == '+' || s[i] == '-') i++;
+	for (; isdigit(s[i]); i++) digits++;
+	if (s[i] == '.') {
+		*is_int = false;
+		for (i++; isdigit(s[i]); i++) digits++;
+	}
+	if (digits == 0) return 0;
+	if (s[i] == 'e' || s[i] == 'E') {
+		size_t j = i + 1;
+		if (s[j] == '+' || s[j] == '-') j++;
+		if (isdigit(s[j])) {
+			while (isdigit(s[j])) j++;
+			*is_int = false;
+			i = j;
+		}
+	}
+	return i;
+}
+
+// Parses an integer literal of n bytes, false if it doesn't fit in 64 bits
+bool parse_i64(const char *s, size_t n, int64_t *out) {
+	size_t i = 0;
+	bool neg = false;
+	if (n > 0 && (s[0] == '+' || s[0] == '-')) neg = s[i++] == '-';
+	uint64_t v = 0;
+	for (; i < n; i++) {
+		uint64_t d = (uint64_t) (s[i] - '0');
+		if (v > (UINT64_MAX - d) / 10) return false;
+		v = v * 10 + d;
+	}
+	if (v > (uint64_t) INT64_MAX + neg) return false;
+	*out = neg ? (int64_t) (0 - v) : (int64_t) v;
+	return true;
+}
+
+// Exactly representable powers of ten
+static const double POW10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static locale_t c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+
+static void c_locale_init(void) {
+	c_locale = newlocale(LC_ALL_MASK, "C", (locale_t) 0);
+}
+
+// Parses a literal accepted by scan_number to the nearest double, inf if
+// it is out of range. A mantissa of at most 2^53 with a power of ten of at
+// most 22 converts exactly with a single multiplication or division
+// (Clinger's fast path), which covers nearly every literal a script has.
+// Anything else goes through strtod, pinned to the C locale.
+double parse_dbl(const char *s, size_t n) {
+	size_t i = 0;
+	bool neg = false;
+	if (s[0] == '+' || s[0] == '-') neg = s[i++] == '-';
+
+	uint64_t m = 0;
+	int64_t e = 0;
+	size_t sig = 0;
+	bool exact = true;
+	for (; i < n && isdigit(s[i]); i++) {
+		if (m == 0 && s[i] == '0') continue;
+		if (sig < 19) m = m * 10 + (uint64_t) (s[i] - '0'), sig++;
+		else e++, exact &= s[i] == '0';
+	}
+	if (i < n && s[i] == '.') {
+		for (i++; i < n && isdigit(s[i]); i++) {
+			if (sig < 19) {
+				if (m > 0 || s[i] != '0') m = m * 10 + (uint64_t) (s[i] - '0'), sig += m > 0;
+				e--;
+			} else {
+				exact &= s[i] == '0';
+			}
+		}
+	}
+	if (i < n) {
+		// exponent, clamped well past the range of double
+		bool eneg = false;
+		int64_t x = 0;
+		i++;
+		if (s[i] == '+' || s[i] == '-') eneg = s[i++] == '-';
+		for (; i < n; i++) if (x < 100000) x = x * 10 + (s[i] - '0');
+		e += eneg ? -x : x;
+	}
+
+	double r;
+	if (m == 0) {
+		r = 0.0;
+	} else if (exact && m <= (1ULL << 53) && e >= -22 && e <= 22) {
+		r = (double) m;
+		r = e < 0 ? r / POW10[-e] : r * POW10[e];
+	} else {
+		pthread_once(&c_locale_once, c_locale_init);
+		locale_t old = uselocale(c_locale);
+		r = strtod(s, NULL);
+		uselocale(old);
+		return r;
+	}
+	return neg ? -r : r;
+}
+
 // ===== LLN =====
 
 // ----- Keyword -----
@@ -158,45 +585,45 @@ static inline TokKind kw_to_tokkind(Keyword kw) {
 
 // ----- Loc -----
 
-void print_line(FILE *fptr, const char* str) {
-    while (*str && *str != '\n') {
-        fputc(*str++, fptr);
-    }
-	fputc('\n', fptr);
+static void sb_append_line(StringBuilder *sb, const char *str) {
+	sb_append_bytes(sb, str, strchrnul(str, '\n') - str);
+	sb_append(sb, '\n');
 }
 
-void fprint_context(FILE *fptr, Loc loc, const char *format, ...) {
+void sb_append_context(StringBuilder *sb, Loc loc, const char *format, va_list args) {
 	const char* tab = "    ";
-	fprintf(fptr, "%s:%zu:%zu:", loc.filename, loc.row, loc.col);
-    va_list args;
-    va_start(args, format);
-	vfprintf(fptr, format, args);
+	sb_appendf(sb, "%s:%zu:%zu:", loc.filename, loc.row, loc.col);
+	sb_vappendf(sb, format, args);
 	if (loc.prev_line_start) {
-		if (loc.row > 2) fprintf(fptr, "%4zu | ...\n", loc.row - 2 % 10000);
-		fprintf(fptr, "%4zu | ", loc.row - 1 % 10000);
-		print_line(fptr, loc.prev_line_start);
+		if (loc.row > 2) sb_appendf(sb, "%4zu | ...\n", loc.row - 2 % 10000);
+		sb_appendf(sb, "%4zu | ", loc.row - 1 % 10000);
+		sb_append_line(sb, loc.prev_line_start);
+	}
+	sb_appendf(sb, "%4zu | ", loc.row % 10000);
+	sb_append_line(sb, loc.line_start);
+	if (sb_reserve(sb, sb->len + loc.col) == 0 && loc.col > 1) {
+		memset(sb->content + sb->len, ' ', loc.col - 1);
+		sb->len += loc.col - 1;
 	}
-	fprintf(fptr, "%4zu | ", loc.row % 10000);
-	print_line(fptr, loc.line_start);
-	for (size_t i = 1; i < loc.col; i++) fputc(' ', fptr);
-	fprintf(fptr, "   %s^\n", tab);
+	sb_appendf(sb, "   %s^\n", tab);
 }
 
-typedef struct {
-	Loc loc;
-
-	char *start;
-	size_t len;
-	TokKind kind;
-
-	char *text_view;
-} Token;
+static void sb_append_contextf(StringBuilder *sb, Loc loc, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	sb_append_context(sb, loc, format, args);
+	va_end(args);
+}
 
-char *tok_to_cstr(Token *t, StringBuilder *sb) {
-	sb->len = 0;
-	sb_append_strn(sb, t->start, t->len);
-	sb_term(sb);
-	return sb->content;
+// Formatted first, so that it is a single write
+void fprint_context(FILE *fptr, Loc loc, const char *format, ...) {
+	StringBuilder sb = {0};
+	va_list args;
+	va_start(args, format);
+	sb_append_context(&sb, loc, format, args);
+	va_end(args);
+	fwrite(sb.content, 1, sb.len, fptr);
+	mem_free(sb.content);
 }
 
 // ----- Arguments -----
@@ -206,198 +633,483 @@ const char* ARGTYPE_STR[] = {
 	"FLT",
 	"STR",
 	"BOOL",
+	"INT_ARR",
+	"FLT_ARR",
+	"DBL_ARR",
+	"BLOB",
+	"I64",
+	"DBL",
 };
 
-void args_free(Args *args) {
+static inline bool argtype_is_arr(ArgType t) {
+	return t == ARG_INT_ARR || t == ARG_FLT_ARR || t == ARG_DBL_ARR;
+}
+
+static inline size_t arr_item_size(ArgType t) {
+	switch (t) {
+		case ARG_INT_ARR: return sizeof(int);
+		case ARG_FLT_ARR: return sizeof(float);
+		case ARG_DBL_ARR: return sizeof(double);
+		default: return 1; // blobs
+	}
+}
+
+// aligned allocators need a non-zero multiple of the alignment
+static inline void *arr_alloc(size_t count, size_t item_size) {
+	size_t size = count * item_size;
+	size = (size + LLN_ARR_ALIGN - 1) / LLN_ARR_ALIGN * LLN_ARR_ALIGN;
+	return mem_alloc_aligned(MEM_ARGS, size ? size : LLN_ARR_ALIGN, LLN_ARR_ALIGN);
+}
+
+// Frees the values, keeping the items for the next arguments
+void args_clear(Args *args) {
 	for (size_t i = 0; i < args->count; i++) {
 		Arg a = args->items[i];
-		if(a.type == ARG_STR) free(a.value.s);
+		if(a.type == ARG_STR) mem_free(a.value.s);
+		else if (argtype_is_arr(a.type) || a.type == ARG_BLOB) mem_free(a.value.arr.items);
 	}
-	free(args->items);
+	args->count = 0;
+}
+
+void args_free(Args *args) {
+	args_clear(args);
+	mem_free(args->items);
 }
 
 // ----- Commands -----
 
 typedef struct {
-	char *name;
+	char *name; // owned by the parser
 	Args args;
 	bool malformed;
+	size_t overflow; // 1-based index of the first out of range number, 0 if none
+	size_t overflow_item; // 1-based item of that argument if it's an array, 0 if not
 
 	Loc loc;
 	CommandFnPtr f;
+	const Callable *callable;
 } Comm;
 
 void comm_free(Comm *c) {
 	args_free(&c->args);
-	free(c->name);
 }
 
-// ----- Lexer -----
+// Calls a validated command, from a plugin or added at run time
+static inline void *comm_call(const Comm *c) {
+	if (c->callable->generic_fnptr) return c->callable->generic_fnptr(c->callable->user, c->args);
+	return c->f(c->args);
+}
 
-typedef struct {
-	const char *content;
+// ----- Tokens -----
 
-	char *cur;
-	Loc loc;
+static inline bool is_symbol_char(char c) {
+	return isalnum(c) || c == '_';
+}
 
-	Token tok;
-	StringBuilder sb_tok_text;
+#if defined(__SSE2__)
+static inline unsigned str_special_mask(__m128i c) {
+	__m128i m = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('"')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\\'))),
+		_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_setzero_si128())));
+	return (unsigned) _mm_movemask_epi8(m);
+}
+#endif // __SSE2__
+
+// First '"', '\\', '\n' or NUL at or after s
+static inline const char *str_find_special(const char *s) {
+#if defined(__SSE2__)
+	// aligned loads never cross into another page, so reading
+	// past the terminating NUL up to the end of its block is fine
+	size_t off = (uintptr_t) s & 15;
+	const __m128i *p = (const __m128i *) (s - off);
+	unsigned mask = str_special_mask(_mm_load_si128(p)) >> off << off;
+	while (!mask) mask = str_special_mask(_mm_load_si128(++p));
+	return (const char *) p + __builtin_ctz(mask);
+#else
+	while (*s && *s != '"' && *s != '\\' && *s != '\n') s++;
+	return s;
+#endif // __SSE2__
+}
 
-	Comm comm;
-} Lexer;
+// Skips the rest of a string literal up to and including the closing
+// quote, jumping straight between the characters that need attention.
+// Sets closed to false if the script ends before the literal does, and
+// then stop, unless NULL, to where scanning may resume once it goes on.
+static const char *scan_str(const char *p, bool *escaped, bool *closed, const char **stop) {
+	while (1) {
+		p = str_find_special(p);
+		switch (p[0]) {
+			case '\0':
+				*closed = false;
+				if (stop) *stop = p;
+				return p;
+			case '"':
+				*closed = true;
+				return p + 1;
+			case '\\':
+				*escaped = true;
+				if (p[1] == '\0') {
+					*closed = false;
+					if (stop) *stop = p; // what it escapes is still to come
+					return p + 1;
+				}
+				p += 2;
+				break;
+			default: // '\n'
+				p++;
+		}
+	}
+}
+
+// End of the number array whose '[' is at p if parse_num_array takes
+// it in whole, else NULL. Its items need no tokens of their own. If the
+// script ends inside what may still be one, e.g. in "[1, 2e", the end of
+// the script, so that a stream resumes tokenizing at the '['.
+static const char *scan_num_array(const char *p) {
+	p++;
+	while (isspace(*p)) p++;
+	while (*p != ']') {
+		if (*p == '\0') return p;
+		bool is_int;
+		size_t n = scan_number(p, &is_int);
+		const char *q = p + n;
+		// a number the end cut may still grow, e.g. "2e" into "2e5"
+		while (isalnum(*q) || *q == '.' || *q == '+' || *q == '-') q++;
+		if (*q == '\0') return q;
+		if (n == 0) return NULL;
+		p += n;
+		while (isspace(*p)) p++;
+		if (*p == ',') {
+			p++;
+			while (isspace(*p)) p++;
+			if (*p == ']') return NULL;
+		} else if (*p != ']' && *p != '\0') {
+			return NULL;
+		}
+	}
+	return p + 1;
+}
 
-void lexer_free(Lexer *l) {
-	comm_free(&l->comm);
-	free(l->sb_tok_text.content);
+// End of the token at p, which is neither a space nor the end of the script
+static const char *scan_token(const char *p, uint8_t *kind) {
+	const char *end = p + 1;
+	bool escaped = false;
+	bool closed;
+	switch (p[0]) {
+		case '!':
+			*kind = TOK_COMMAND;
+			while (is_symbol_char(*end)) end++;
+			return end;
+		case '"':
+			end = scan_str(end, &escaped, &closed, NULL);
+			// an unterminated literal is just text
+			*kind = !closed ? TOK_COMMENT : escaped ? TOK_STR | TOK_ESCAPED : TOK_STR;
+			return end;
+		case '(': *kind = TOK_OPAREN; return end;
+		case ')': *kind = TOK_CPAREN; return end;
+		case ',': *kind = TOK_COMMA; return end;
+		case '[':
+			*kind = TOK_OBRACKET;
+			return scan_num_array(p) ?: end;
+		case ']': *kind = TOK_CBRACKET; return end;
+	}
+	if (strncmp(p, "b64\"", 4) == 0) {
+		end = scan_str(p + 4, &escaped, &closed, NULL);
+		*kind = closed ? TOK_BLOB : TOK_COMMENT;
+		return end;
+	}
+	bool is_int;
+	size_t num_len = scan_number(p, &is_int);
+	if (num_len > 0) {
+		*kind = is_int ? TOK_INT : TOK_FLT;
+		return p + num_len;
+	}
+	end = p;
+	while (is_symbol_char(*end)) end++;
+	Keyword k = strn_to_keyword((char *) p, (size_t) (end - p));
+	if (k != KW_STRN_TO_KEYWORD_FAILED) {
+		*kind = kw_to_tokkind(k);
+		return end;
+	}
+	*kind = TOK_COMMENT;
+	while (*end && !isspace(*end)) end++;
+	return end;
 }
 
-char *lexer_chop_char(Lexer *l) {
-	if (l->cur[0] == '\0') return NULL;
-	if (l->cur[0] == '\n') {
-		l->loc.prev_line_start = l->loc.line_start;
-		l->loc.line_start = l->cur + 1;
-		l->loc.col = 0;
-		l->loc.row++;
+static void tokens_push(Tokens *t, size_t offset, size_t len, uint8_t kind) {
+	assert(offset + len <= UINT32_MAX);
+	if (t->count == t->capacity) {
+		t->capacity = t->capacity ? t->capacity * 2 : 256;
+		t->offset = mem_realloc(MEM_TOKENS, t->offset, t->capacity * sizeof(uint32_t));
+		t->len = mem_realloc(MEM_TOKENS, t->len, t->capacity * sizeof(uint32_t));
+		t->kind = mem_realloc(MEM_TOKENS, t->kind, t->capacity * sizeof(uint8_t));
+		assert(t->offset && t->len && t->kind);
 	}
-	l->cur++;
-	l->loc.col++;
-	return l->cur;
+	t->offset[t->count] = (uint32_t) offset;
+	t->len[t->count] = (uint32_t) len;
+	t->kind[t->count] = kind;
+	t->count++;
 }
 
-char *lexer_chop_leading_space(Lexer *l) {
-	while (isspace(l->cur[0])) lexer_chop_char(l);
-	return l->cur;
+void tokens_free(Tokens *t) {
+	mem_free(t->offset);
+	mem_free(t->len);
+	mem_free(t->kind);
+	*t = (Tokens) {0};
 }
 
-char *lexer_chop_while_predicate(Lexer *l, bool (*p)(Lexer *)) {
-	while (p(l)) if(!lexer_chop_char(l)) return NULL;
-	return l->cur;
+// See lln-internal.h
+size_t tokenize(const char *content, size_t from, Tokens *t) {
+	const char *p = content + from;
+	const char *resume = NULL;
+	const char *prev = NULL, *prev_end = NULL;
+	uint8_t prev_kind = TOK_END;
+	while (1) {
+		while (isspace(*p)) p++;
+		if (*p == '\0') break;
+		uint8_t kind;
+		const char *end = scan_token(p, &kind);
+		if (kind != TOK_COMMENT) tokens_push(t, p - content, end - p, kind);
+		// a number right before may still take it in, e.g. "1e" into "1e5"
+		bool num_before = prev_end == p && (prev_kind == TOK_INT || prev_kind == TOK_FLT);
+		resume = num_before ? prev : p;
+		prev = p;
+		prev_end = end;
+		prev_kind = kind;
+		p = end;
+	}
+	return (resume ? resume : p) - content;
 }
 
-static inline bool is_symbol_char(Lexer *l) {
-	return isalnum(l->cur[0]) || l->cur[0] == '_';
+// Tokenizes the tokens that start before to; returns where the last
+// one ends, from if there is none
+static size_t tokenize_until(const char *content, size_t from, size_t to, Tokens *t) {
+	const char *p = content + from;
+	size_t end = from;
+	while (1) {
+		while (isspace(*p)) p++;
+		if (*p == '\0' || (size_t) (p - content) >= to) break;
+		uint8_t kind;
+		const char *tok_end = scan_token(p, &kind);
+		if (kind != TOK_COMMENT) tokens_push(t, p - content, tok_end - p, kind);
+		end = tok_end - content;
+		p = tok_end;
+	}
+	return end;
 }
 
-static inline bool is_digit(Lexer *l) {
-	return isdigit(l->cur[0]);
+// ----- Parser -----
+
+// Reads the commands of a script from its tokens, all
+// tokenized on the first read unless fed in (streams)
+typedef struct {
+	const char *content;
+	const char *filename;
+	Tokens toks;
+	bool tokenized;
+	size_t next; // index of the next token
+
+	Comm comm;
+	StringBuilder name; // of comm
+	bool at_end; // the last command ran out of tokens
+
+	// newlines are counted up to line_off, for the locs of the commands
+	size_t line_off;
+	size_t row;
+	size_t line_start;
+	size_t prev_line_start; // SIZE_MAX on the first line
+
+	DiagBuffer *diags; // of invalid commands, NULL to print them right away
+} Parser;
+
+void parser_init(Parser *p, const char *content, const char *filename) {
+	*p = (Parser) {
+		.content = content,
+		.filename = filename,
+		.row = 1,
+		.prev_line_start = SIZE_MAX,
+	};
 }
 
-static inline bool is_not_space(Lexer *l) {
-	return !isspace(l->cur[0]);
+void parser_free(Parser *p) {
+	comm_free(&p->comm);
+	mem_free(p->name.content);
+	tokens_free(&p->toks);
 }
 
-static inline bool is_in_str(Lexer *l) {
-	if (l->cur[0] == '"') return false;
-	if (l->cur[0] == '\\') {
-		char *c;
-		c = lexer_chop_char(l);
-		if (c == NULL) return false;
+// Loc of the byte at off, never before the last one asked for
+Loc parser_loc(Parser *p, size_t off) {
+	const char *nl;
+	while ((nl = memchr(p->content + p->line_off, '\n', off - p->line_off))) {
+		p->prev_line_start = p->line_start;
+		p->line_start = p->line_off = nl + 1 - p->content;
+		p->row++;
 	}
-	return true;
+	p->line_off = off;
+	return (Loc) {
+		.filename = p->filename,
+		.row = p->row,
+		.col = off - p->line_start + 1,
+		.prev_line_start = p->prev_line_start != SIZE_MAX ? p->content + p->prev_line_start : NULL,
+		.line_start = p->content + p->line_start,
+	};
 }
 
-Token *lexer_next_token(Lexer *l) {
-	lexer_chop_leading_space(l);
+// ----- parsing -----
 
-	if (l->cur[0] == '\0') {
-		l->tok.kind = TOK_END;
-		l->tok.len = 0;
-		return NULL;
+// Kind of the next token, consumed; TOK_END past the last one
+static inline TokKind parser_next_kind(Parser *p) {
+	if (p->next == p->toks.count) {
+		p->at_end = true;
+		return TOK_END;
 	}
+	return p->toks.kind[p->next++] & ~TOK_ESCAPED;
+}
 
-	Token t = {0};
-	t.loc = l->loc;
-	t.start = l->cur;
-	t.text_view = l->tok.text_view;
-	if (l->cur[0] == '!') {
-		t.kind = TOK_COMMAND;
-		lexer_chop_char(l); // chop leading '!'
-		lexer_chop_while_predicate(l, is_symbol_char);
-	} else if (l->cur[0] == '"') {
-		t.kind = TOK_STR;
-		lexer_chop_char(l); // chop leading quotes
-		lexer_chop_while_predicate(l, is_in_str);
-		lexer_chop_char(l);
-	} else if (l->cur[0] == '(') {
-		t.kind = TOK_OPAREN;
-		lexer_chop_char(l);
-	} else if (l->cur[0] == ')') {
-		t.kind = TOK_CPAREN;
-		lexer_chop_char(l);
-	} else if (l->cur[0] == ',') {
-		t.kind = TOK_COMMA;
-		lexer_chop_char(l);
-	} else if (isdigit(l->cur[0]) || l->cur[0] == '.') {
-		t.kind = TOK_INT;
-		lexer_chop_while_predicate(l, is_digit);
-		if (l->cur[0] == '.') {
-			t.kind = TOK_FLT;
-		    lexer_chop_char(l); // chop leading dot
-			lexer_chop_while_predicate(l, is_digit);
-		}
-	} else {
-		lexer_chop_while_predicate(l, is_symbol_char);	
-		Keyword k = strn_to_keyword(t.start, (size_t) (l->cur - t.start));
-		if (k != KW_STRN_TO_KEYWORD_FAILED) {
-			t.kind = kw_to_tokkind(k);
-		} else {
-			t.kind = TOK_COMMENT;
-			lexer_chop_while_predicate(l, is_not_space);
-		}
+// Decodes the payload of a b64"..." token straight into the argument
+Arg parse_blob(const char *start, size_t len) {
+	Arg a = { .type = ARG_INVALID };
+	if (len < 5 || start[len - 1] != '"') return a;
+	size_t n = len - 5;
+	uint8_t *bytes = arr_alloc(n / 4 * 3 + 2, 1);
+	if (!bytes) return a;
+	ptrdiff_t decoded = b64_decode(bytes, start + 4, n);
+	if (decoded < 0) {
+		mem_free(bytes);
+		return a;
 	}
+	a.type = ARG_BLOB;
+	a.value.arr.items = bytes;
+	a.value.arr.count = (size_t) decoded;
+	return a;
+}
 
-	t.len = l->cur - t.start;
-	t.text_view = tok_to_cstr(&t, &l->sb_tok_text);
-	l->tok = t;
-	if (t.len == 0) {
-		l->tok.kind = TOK_END;
-		return NULL;
+// Appends the UTF-8 encoding of cp to out, returns its length
+static inline size_t utf8_encode(char *out, uint32_t cp) {
+	if (cp < 0x80) {
+		out[0] = (char) cp;
+		return 1;
 	}
-	return &l->tok;	
+	if (cp < 0x800) {
+		out[0] = (char) (0xc0 | cp >> 6);
+		out[1] = (char) (0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = (char) (0xe0 | cp >> 12);
+		out[1] = (char) (0x80 | (cp >> 6 & 0x3f));
+		out[2] = (char) (0x80 | (cp & 0x3f));
+		return 3;
+	}
+	out[0] = (char) (0xf0 | cp >> 18);
+	out[1] = (char) (0x80 | (cp >> 12 & 0x3f));
+	out[2] = (char) (0x80 | (cp >> 6 & 0x3f));
+	out[3] = (char) (0x80 | (cp & 0x3f));
+	return 4;
 }
 
-// takes in 0-initialized Lexer
-void lexer_init(Lexer *l, const char *c, const char *f) {
-	l->content = c;
-	l->cur = (char *) c;
-	l->loc = (Loc) {
-		.row = 1,
-		.col = 1,
-		.line_start = l->cur,
-		.prev_line_start = NULL,
-		.filename = f
-	};
+// Reads the 4 hex digits of a \\u escape, -1 if they aren't
+static inline int32_t hex4(const char *s, const char *end) {
+	if (end - s < 4) return -1;
+	int32_t v = 0;
+	for (size_t i = 0; i < 4; i++) {
+		char c = s[i];
+		if (c >= '0' && c <= '9') v = v << 4 | (c - '0');
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') v = v << 4 | ((c | 0x20) - 'a' + 10);
+		else return -1;
+	}
+	return v;
 }
 
-// ----- parsing -----
+// Decodes the n bytes of a string literal body into out in a single pass,
+// copying the runs between backslashes in bulk. Decoding never grows the
+// text, so out needs room for n bytes. Handles \\n \\t \\r \\b \\f \\" \\\\ \\/
+// and \\uXXXX (surrogate pairs included), anything else is kept as is to
+// be permissive with the LLM. Returns the decoded length.
+size_t str_unescape(char *out, const char *in, size_t n) {
+	const char *end = in + n;
+	char *o = out;
+	while (in < end) {
+		const char *bs = memchr(in, '\\', end - in);
+		if (!bs) bs = end;
+		memcpy(o, in, bs - in);
+		o += bs - in;
+		in = bs;
+		if (end - in < 2) break;
+
+		const char *esc = in;
+		int32_t cp;
+		in += 2;
+		switch (esc[1]) {
+			case 'n': *o++ = '\n'; continue;
+			case 't': *o++ = '\t'; continue;
+			case 'r': *o++ = '\r'; continue;
+			case 'b': *o++ = '\b'; continue;
+			case 'f': *o++ = '\f'; continue;
+			case '"':
+			case '\\':
+			case '/':
+				*o++ = esc[1];
+				continue;
+			case 'u':
+				cp = hex4(in, end);
+				if (cp <= 0 || (cp >= 0xdc00 && cp <= 0xdfff)) break;
+				in += 4;
+				if (cp >= 0xd800 && cp <= 0xdbff) {
+					// high surrogate, only valid with its low half
+					int32_t lo = end - in >= 6 && in[0] == '\\' && in[1] == 'u' ? hex4(in + 2, end) : -1;
+					if (lo < 0xdc00 || lo > 0xdfff) break;
+					in += 6;
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+				}
+				o += utf8_encode(o, (uint32_t) cp);
+				continue;
+		}
+		// unknown or invalid escape, kept verbatim
+		in = esc + 1;
+		*o++ = '\\';
+	}
+	// a trailing lone backslash
+	if (in < end) *o++ = *in;
+	return o - out;
+}
 
-Token *lexer_next_non_comment(Lexer *l) {
-	while (lexer_next_token(l) && l->tok.kind == TOK_COMMENT);
-	if (l->tok.kind == TOK_END) return NULL;
-	return &l->tok;
+// Copies a string literal without its quotes, decoding
+// escapes only if the tokenizer saw a backslash in it
+Arg parse_str(const char *start, size_t len, bool escaped) {
+	Arg a = { .type = ARG_INVALID };
+	size_t n = len - 2; // cut out the quotes
+	char *s = mem_alloc(MEM_ARGS, n + 1);
+	if (!s) return a;
+	if (escaped) n = str_unescape(s, start + 1, n);
+	else memcpy(s, start + 1, n);
+	s[n] = '\0';
+	a.type = ARG_STR;
+	a.value.s = s;
+	return a;
 }
 
-Arg parse_arg(Token t) {
+// Numbers are parsed straight from the source, overflow is set
+// when one is out of the range of its type
+Arg parse_arg(const Parser *p, size_t k, bool *overflow) {
 	Arg a = {0};
 	bool arg_bool_value = false;
+	const char *start = p->content + p->toks.offset[k];
+	size_t len = p->toks.len[k];
 
-	switch (t.kind) {
+	switch (p->toks.kind[k] & ~TOK_ESCAPED) {
+		case TOK_BLOB:
+			return parse_blob(start, len);
 		case TOK_STR:
-			// TODO: parse strings correctly
-			// probably use separate function
-			a.type = ARG_STR;
-			char *val = malloc(t.len - 1);
-			memcpy(val, t.start + 1, t.len - 2); // To cut out quote characters
-			((char *)val)[t.len - 2] = '\0';
-			a.value.s = val;
-			break;
+			return parse_str(start, len, p->toks.kind[k] & TOK_ESCAPED);
 		case TOK_INT:
-			a.type = ARG_INT;
-			a.value.i = atoi(t.text_view);
+			a.type = ARG_I64;
+			*overflow = !parse_i64(start, len, &a.value.l);
 			break;
 		case TOK_FLT:
-			a.type = ARG_FLT;
-			a.value.f = atof(t.text_view);
+			a.type = ARG_DBL;
+			a.value.d = parse_dbl(start, len);
+			*overflow = isinf(a.value.d);
 			break;
 		case TOK_KW_TRUE:
 			arg_bool_value = true;
@@ -415,39 +1127,126 @@ Arg parse_arg(Token t) {
 	return a;
 }
 
-Comm *parse_command(Lexer *l) {
-	args_free(&l->comm.args);
-	l->comm.args = (Args) {0};
-	assert(l->tok.kind == TOK_COMMAND);
-	free(l->comm.name);
-	l->comm.name = sb_new_cstr(&l->sb_tok_text);
-	l->comm.loc = l->tok.loc;
-	lexer_next_non_comment(l);
-	if (l->tok.kind != TOK_OPAREN) goto return_malformed;
+// Fast path for number arrays, called right after the '[', whose token
+// spans the whole array. Items are parsed straight from the source, not
+// from tokens, into a single aligned buffer sized by counting the commas
+// up to the closing bracket. Parses to INT_ARR if every item is an integer,
+// DBL_ARR otherwise. overflow is set to the 1-based item out of the range
+// of its type, an int for INT_ARR.
+Arg parse_num_array(Parser *p, size_t *overflow) {
+	Arg a = { .type = ARG_INVALID };
+	const char *start = p->content + p->toks.offset[p->next - 1];
+	size_t len = p->toks.len[p->next - 1];
+	if (start[len - 1] != ']') {
+		// a lone '[' before anything but numbers is malformed, an array
+		// cut by the end of the input may still be completed by a stream
+		if (start[len] == '\0') p->at_end = true;
+		return a;
+	}
+	const char *cur = start + 1, *close = start + len - 1;
+	size_t cap = 1;
+	for (const char *c = cur; c < close; c++) cap += *c == ',';
+
+	double *items = arr_alloc(cap, sizeof(double));
+	if (!items) return a;
+	size_t count = 0;
+	bool all_int = true;
+	size_t wide = 0, inf = 0; // first integer out of an int's range, first infinite item
+	while (isspace(*cur)) cur++;
+	while (cur < close) {
+		bool is_int;
+		int64_t i;
+		size_t n = scan_number(cur, &is_int);
+		if (n == 0 || count == cap) goto fail;
+		if (is_int && parse_i64(cur, n, &i) && i >= INT_MIN && i <= INT_MAX) {
+			items[count++] = (double) i;
+		} else {
+			// wide integers are only kept, rounded once, if a float
+			// item makes this a DBL_ARR
+			all_int &= is_int;
+			if (is_int && !wide) wide = count + 1;
+			items[count] = parse_dbl(cur, n);
+			if (isinf(items[count]) && !inf) inf = count + 1;
+			count++;
+		}
+		cur += n;
+
+		while (isspace(*cur)) cur++;
+		if (cur[0] == ',') {
+			cur++;
+			while (isspace(*cur)) cur++;
+			if (cur[0] == ']') goto fail;
+		} else if (cur != close) {
+			goto fail;
+		}
+	}
+
+	*overflow = all_int ? wide : inf;
+	if (all_int) {
+		// narrowing in place is safe, item i only overwrites bytes of items <= i
+		int *ints = (int *) items;
+		for (size_t i = 0; i < count; i++) ints[i] = (int) items[i];
+		a.type = ARG_INT_ARR;
+	} else {
+		a.type = ARG_DBL_ARR;
+	}
+	a.value.arr.items = items;
+	a.value.arr.count = count;
+	return a;
+fail:
+	mem_free(items);
+	return a;
+}
+
+Comm *parse_command(Parser *p) {
+	Comm *comm = &p->comm;
+	args_free(&comm->args);
+	comm->args = (Args) {0};
+	comm->malformed = false;
+	comm->overflow = 0;
+	comm->overflow_item = 0;
+	p->at_end = false;
+	size_t k = p->next - 1;
+	assert((p->toks.kind[k] & ~TOK_ESCAPED) == TOK_COMMAND);
+	p->name.len = 0;
+	sb_append_strn(&p->name, p->content + p->toks.offset[k], p->toks.len[k]);
+	sb_term(&p->name);
+	comm->name = p->name.content;
+	comm->loc = parser_loc(p, p->toks.offset[k]);
+	if (parser_next_kind(p) != TOK_OPAREN) goto return_malformed;
 	while(1) {
-		lexer_next_non_comment(l);
-		if (l->tok.kind == TOK_CPAREN) break;
-		Arg arg = parse_arg(l->tok);
-		da_append(&l->comm.args, arg);
+		TokKind kind = parser_next_kind(p);
+		if (kind == TOK_CPAREN) break;
+		bool overflow = false;
+		size_t item = 0;
+		Arg arg = { .type = ARG_INVALID };
+		if (kind == TOK_OBRACKET) arg = parse_num_array(p, &item);
+		else if (kind != TOK_END) arg = parse_arg(p, p->next - 1, &overflow);
+		if ((overflow || item) && !comm->overflow) {
+			comm->overflow = comm->args.count + 1;
+			comm->overflow_item = item;
+		}
+		da_append(&comm->args, arg);
 		if (arg.type == ARG_INVALID) goto return_malformed;
 
-		lexer_next_non_comment(l);
-		if (l->tok.kind == TOK_COMMA) continue;
-		else if (l->tok.kind == TOK_CPAREN) break;
+		kind = parser_next_kind(p);
+		if (kind == TOK_COMMA) continue;
+		else if (kind == TOK_CPAREN) break;
 		else goto return_malformed;
 	}
-	return &l->comm;
+	return comm;
 return_malformed:
-	l->comm.malformed = true;
-	return &l->comm;
+	comm->malformed = true;
+	return comm;
 }
 
-Comm *lexer_next_command(Lexer *l) {
-	while(lexer_next_non_comment(l)) {
-		if (l->tok.kind == TOK_COMMAND) {
-			parse_command(l);
-			return &l->comm;
-		}
+Comm *parser_next_command(Parser *p) {
+	if (!p->tokenized) {
+		tokenize(p->content, 0, &p->toks);
+		p->tokenized = true;
+	}
+	while (p->next < p->toks.count) {
+		if ((p->toks.kind[p->next++] & ~TOK_ESCAPED) == TOK_COMMAND) return parse_command(p);
 	}
 	return NULL;
 }
@@ -460,6 +1259,13 @@ Callable *name_to_callable(const char *name, const Callables *cs) {
 		return NULL;
 	}
 	size_t len = strlen(name);
+	if (cs->index) {
+		for (size_t i = name_hash(name, len) & cs->index_mask; cs->index[i]; i = (i + 1) & cs->index_mask) {
+			Callable *c = &cs->items[cs->index[i] - 1];
+			if (strcmp(c->name, name) == 0) return c;
+		}
+		return NULL;
+	}
     for (size_t i = 0; i < cs->count; i++) {
         size_t key_len = strlen(cs->items[i].name);
         if (key_len == len && strncmp(name, cs->items[i].name, len) == 0)
@@ -468,13 +1274,145 @@ Callable *name_to_callable(const char *name, const Callables *cs) {
     return NULL;
 }
 
+// Indexes commands registered one by one (multi-file builds, older
+// plugins), so that looking them up is a hash away too
+void callables_index(Callables *cs) {
+	if (cs->index || cs->count == 0 || cs->count > UINT32_MAX / 2) return;
+	size_t slots = 2;
+	while (slots < 2 * cs->count) slots *= 2;
+	uint32_t *index = mem_calloc(slots, sizeof(uint32_t));
+	if (!index) return;
+	for (size_t i = 0; i < cs->count; i++) {
+		const char *name = cs->items[i].name;
+		size_t h = name_hash(name, strlen(name)) & (slots - 1);
+		bool dup = false;
+		for (; index[h] && !(dup = strcmp(cs->items[index[h] - 1].name, name) == 0); h = (h + 1) & (slots - 1)) {}
+		// the first command of a name wins, as with a linear search
+		if (!dup) index[h] = (uint32_t) i + 1;
+	}
+	cs->index = index;
+	cs->index_mask = slots - 1;
+}
+
+// ----- runtime commands -----
+
+Callables *callables_new(void) {
+	Callables *cs = mem_calloc(1, sizeof(Callables));
+	if (cs) cs->runtime = true;
+	return cs;
+}
+
+static ArgType signature_letter_type(char c) {
+	switch (c) {
+	case 'i': return ARG_INT;
+	case 'l': return ARG_I64;
+	case 'f': return ARG_FLT;
+	case 'd': return ARG_DBL;
+	case 'b': return ARG_BOOL;
+	case 's': return ARG_STR;
+	case 'I': return ARG_INT_ARR;
+	case 'F': return ARG_FLT_ARR;
+	case 'D': return ARG_DBL_ARR;
+	case 'x': return ARG_BLOB;
+	default:  return ARG_INVALID;
+	}
+}
+
+// Indexes the last command added, the index staying at most half full
+static void callables_index_last(Callables *cs) {
+	if (cs->index && 2 * cs->count <= cs->index_mask + 1) {
+		// the index is ours, callables_add only takes runtime tables
+		uint32_t *index = (uint32_t *) cs->index;
+		const char *name = cs->items[cs->count - 1].name;
+		size_t h = name_hash(name, strlen(name)) & cs->index_mask;
+		while (index[h]) h = (h + 1) & cs->index_mask;
+		index[h] = (uint32_t) cs->count;
+		return;
+	}
+	mem_free((void *) cs->index);
+	cs->index = NULL;
+	callables_index(cs);
+}
+
+int callables_add(Callables *cs, const char *name, const char *signature, GenericFnPtr fn, void *user) {
+	// the items and index of plugins may be constants
+	if (!cs->runtime) return -1;
+	const char *symbol = name[0] == '!' ? name + 1 : name;
+	if (!*symbol) return -1;
+	for (const char *p = symbol; *p; p++) {
+		if (!is_symbol_char(*p)) return -1;
+	}
+	Callable c = { .generic_fnptr = fn, .user = user };
+	for (const char *p = signature; *p; p++) {
+		ArgType t = signature_letter_type(*p);
+		if (t == ARG_INVALID || da_append(&c.signature, t) != 0) {
+			mem_free(c.signature.items);
+			return -1;
+		}
+	}
+	StringBuilder sb = {0};
+	sb_append_cstr(&sb, "!");
+	sb_append_cstr(&sb, symbol);
+	sb_term(&sb);
+	c.name = sb.content;
+	if (name_to_callable(c.name, cs) || da_append(cs, c) != 0) {
+		mem_free(sb.content);
+		mem_free(c.signature.items);
+		return -1;
+	}
+	callables_index_last(cs);
+	return 0;
+}
+
+void callables_free(Callables *cs) {
+	if (!cs || !cs->runtime) return;
+	for (size_t i = 0; i < cs->count; i++) {
+		mem_free((char *) cs->items[i].name);
+		mem_free(cs->items[i].signature.items);
+	}
+	mem_free(cs->items);
+	mem_free((void *) cs->index);
+	mem_free(cs);
+}
+
+// false if a number doesn't fit in the narrower type t
+static inline bool arg_fits(const Arg *a, ArgType t) {
+	if (a->type == ARG_I64 && t == ARG_INT) return a->value.l >= INT_MIN && a->value.l <= INT_MAX;
+	if (a->type == ARG_DBL && t == ARG_FLT) return a->value.d >= -FLT_MAX && a->value.d <= FLT_MAX;
+	if (a->type == ARG_DBL_ARR && t == ARG_FLT_ARR) {
+		const double *d = a->value.arr.items;
+		for (size_t i = 0; i < a->value.arr.count; i++)
+			if (d[i] < -FLT_MAX || d[i] > FLT_MAX) return false;
+	}
+	return true;
+}
+
+// Type a number is reported as in diagnostics: literals are parsed to
+// I64 and DBL, but the ones that fit in an INT or FLT were written as such
+static inline ArgType arg_literal_type(const Arg *a) {
+	if (a->type == ARG_I64 && arg_fits(a, ARG_INT)) return ARG_INT;
+	if (a->type == ARG_DBL && arg_fits(a, ARG_FLT)) return ARG_FLT;
+	return a->type;
+}
+
+// Narrowing casts assume the value was checked with arg_fits
 static inline Arg *try_cast_to_int(Arg *a) {
 	switch(a->type) {
 		case ARG_BOOL: 
+			a->value.i = a->value.b;
+			break;
 		case ARG_INT:	
 			break;
+		case ARG_I64:
+			a->value.i = (int) a->value.l;
+			break;
 		case ARG_FLT:	
+		case ARG_DBL:
 		case ARG_STR:	
+		case ARG_INT_ARR:
+		case ARG_FLT_ARR:
+		case ARG_DBL_ARR:
+		case ARG_BLOB:
 			return NULL;
 		case ARG_COUNT:
 			assert(false && "UNREACHABLE");
@@ -483,16 +1421,51 @@ static inline Arg *try_cast_to_int(Arg *a) {
 	return a;
 }
 
+static inline Arg *try_cast_to_i64(Arg *a) {
+	switch(a->type) {
+		case ARG_BOOL: 
+			a->value.l = a->value.b;
+			break;
+		case ARG_INT:	
+			a->value.l = a->value.i;
+			break;
+		case ARG_I64:
+			break;
+		case ARG_FLT:	
+		case ARG_DBL:
+		case ARG_STR:	
+		case ARG_INT_ARR:
+		case ARG_FLT_ARR:
+		case ARG_DBL_ARR:
+		case ARG_BLOB:
+			return NULL;
+		case ARG_COUNT:
+			assert(false && "UNREACHABLE");
+	}
+	a->type = ARG_I64;
+	return a;
+}
+
 static inline Arg *try_cast_to_flt(Arg *a) {
 	switch(a->type) {
 		case ARG_INT: {
 			a->value.f = (float) a->value.i;
 			break;
 		}
+		case ARG_I64:
+			a->value.f = (float) a->value.l;
+			break;
 		case ARG_FLT:
 			break;
+		case ARG_DBL:
+			a->value.f = (float) a->value.d;
+			break;
 		case ARG_BOOL: 
 		case ARG_STR:	
+		case ARG_INT_ARR:
+		case ARG_FLT_ARR:
+		case ARG_DBL_ARR:
+		case ARG_BLOB:
 			return NULL;
 		case ARG_COUNT:
 			assert(false && "UNREACHABLE");
@@ -501,13 +1474,46 @@ static inline Arg *try_cast_to_flt(Arg *a) {
 	return a;
 }
 
+static inline Arg *try_cast_to_dbl(Arg *a) {
+	switch(a->type) {
+		case ARG_INT:
+			a->value.d = a->value.i;
+			break;
+		case ARG_I64:
+			a->value.d = (double) a->value.l;
+			break;
+		case ARG_FLT:
+			a->value.d = a->value.f;
+			break;
+		case ARG_DBL:
+			break;
+		case ARG_BOOL: 
+		case ARG_STR:	
+		case ARG_INT_ARR:
+		case ARG_FLT_ARR:
+		case ARG_DBL_ARR:
+		case ARG_BLOB:
+			return NULL;
+		case ARG_COUNT:
+			assert(false && "UNREACHABLE");
+	}
+	a->type = ARG_DBL;
+	return a;
+}
+
 static inline Arg *try_cast_to_str(Arg *a) {
 	switch(a->type) {
 		case ARG_STR:	
 			break;
 		case ARG_INT:
 		case ARG_FLT:
+		case ARG_I64:
+		case ARG_DBL:
 		case ARG_BOOL: 
+		case ARG_INT_ARR:
+		case ARG_FLT_ARR:
+		case ARG_DBL_ARR:
+		case ARG_BLOB:
 			return NULL;
 		case ARG_COUNT:
 			assert(false && "UNREACHABLE");
@@ -524,8 +1530,16 @@ static inline Arg *try_cast_to_bool(Arg *a) {
 			a->value.b = a->value.i != 0;
 			break;
 		}
+		case ARG_I64:
+			a->value.b = a->value.l != 0;
+			break;
 		case ARG_FLT:
+		case ARG_DBL:
 		case ARG_STR:	
+		case ARG_INT_ARR:
+		case ARG_FLT_ARR:
+		case ARG_DBL_ARR:
+		case ARG_BLOB:
 			return NULL;
 		case ARG_COUNT:
 			assert(false && "UNREACHABLE");
@@ -534,6 +1548,32 @@ static inline Arg *try_cast_to_bool(Arg *a) {
 	return a;
 }
 
+// Array conversions happen in place when the item size doesn't grow
+static inline Arg *try_cast_to_arr(Arg *a, ArgType t) {
+	size_t n = a->value.arr.count;
+	if (a->type == t) return a;
+	if (a->type == ARG_INT_ARR && t == ARG_FLT_ARR) {
+		int *src = a->value.arr.items;
+		float *dst = a->value.arr.items;
+		for (size_t i = 0; i < n; i++) dst[i] = (float) src[i];
+	} else if (a->type == ARG_DBL_ARR && t == ARG_FLT_ARR) {
+		double *src = a->value.arr.items;
+		float *dst = a->value.arr.items;
+		for (size_t i = 0; i < n; i++) dst[i] = (float) src[i];
+	} else if (a->type == ARG_INT_ARR && t == ARG_DBL_ARR) {
+		int *src = a->value.arr.items;
+		double *dst = arr_alloc(n, sizeof(double));
+		if (!dst) return NULL;
+		for (size_t i = 0; i < n; i++) dst[i] = (double) src[i];
+		mem_free(src);
+		a->value.arr.items = dst;
+	} else {
+		return NULL;
+	}
+	a->type = t;
+	return a;
+}
+
 Arg *try_cast(Arg *a, ArgType t) {
 	switch (t) {
 		case ARG_INT:	
@@ -544,6 +1584,16 @@ Arg *try_cast(Arg *a, ArgType t) {
 			return try_cast_to_str(a);
 		case ARG_BOOL:	
 			return try_cast_to_bool(a);
+		case ARG_I64:
+			return try_cast_to_i64(a);
+		case ARG_DBL:
+			return try_cast_to_dbl(a);
+		case ARG_INT_ARR:
+		case ARG_FLT_ARR:
+		case ARG_DBL_ARR:
+			return try_cast_to_arr(a, t);
+		case ARG_BLOB:
+			return a->type == ARG_BLOB ? a : NULL;
 		case ARG_COUNT:
 		assert(false && "UNREACHABLE");
 	}
@@ -561,91 +1611,2082 @@ char *nth(size_t i) {
 	}
 }
 
-bool validate_command(Lexer *l, const Callables *cs) {
-	Comm *comm = &l->comm;
+const char *DIAGKIND_STR[] = {
+	[DIAG_UNKNOWN_COMMAND] = "unknown_command",
+	[DIAG_MALFORMED] = "malformed",
+	[DIAG_OVERFLOW] = "overflow",
+	[DIAG_TOO_FEW_ARGS] = "too_few_args",
+	[DIAG_TOO_MANY_ARGS] = "too_many_args",
+	[DIAG_ARG_RANGE] = "arg_out_of_range",
+	[DIAG_ARG_TYPE] = "arg_type",
+};
+
+void sb_append_diag(StringBuilder *sb, const Diag *d) {
+	switch (d->kind) {
+		case DIAG_UNKNOWN_COMMAND:
+			sb_append_contextf(sb, d->loc, "Command '%s' doesn't exist.\n", d->name);
+			break;
+		case DIAG_MALFORMED:
+			sb_append_contextf(sb, d->loc, "Command '%s' is malformed.\n", d->name);
+			break;
+		case DIAG_OVERFLOW:
+			if (d->item) {
+				sb_append_contextf(sb, d->loc, "Command '%s' has an out of range number as item %zu of its %zu%s argument.\n",
+					d->name, d->item, d->arg, nth(d->arg));
+			} else {
+				sb_append_contextf(sb, d->loc, "Command '%s' has an out of range number in its %zu%s argument.\n", d->name, d->arg, nth(d->arg));
+			}
+			break;
+		case DIAG_TOO_FEW_ARGS:
+			sb_append_contextf(sb, d->loc, "Command '%s' needs %zu arguments, only %zu were passed.\n", d->name, d->expected_argc, d->argc);
+			break;
+		case DIAG_TOO_MANY_ARGS:
+			sb_append_contextf(sb, d->loc, "Command '%s' needs %zu arguments, but %zu were passed.\n", d->name, d->expected_argc, d->argc);
+			break;
+		case DIAG_ARG_RANGE:
+			sb_append_contextf(sb, d->loc,
+				"Command '%s' expects %s as %zu%s argument, but the %s passed is out of its range.\n",
+				d->name, ARGTYPE_STR[d->expected], d->arg, nth(d->arg), ARGTYPE_STR[d->actual]);
+			break;
+		case DIAG_ARG_TYPE:
+			sb_append_contextf(sb, d->loc,
+				"Command '%s' expects %s as %zu%s argument, but %s was passed.\n",
+				d->name, ARGTYPE_STR[d->expected], d->arg, nth(d->arg), ARGTYPE_STR[d->actual]);
+			break;
+		default:
+			assert(0 && "unreachable");
+	}
+}
+
+// Appends s as a JSON string
+void sb_append_json_str(StringBuilder *sb, const char *s) {
+	sb_append(sb, '"');
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			sb_append(sb, '\\');
+			sb_append(sb, c);
+		} else if (c < 0x20) {
+			sb_appendf(sb, "\\u%04x", c);
+		} else {
+			sb_append(sb, c);
+		}
+	}
+	sb_append(sb, '"');
+}
+
+void sb_append_diag_json(StringBuilder *sb, const Diag *d) {
+	sb_append_cstr(sb, "{\"file\":");
+	sb_append_json_str(sb, d->loc.filename);
+	sb_appendf(sb, ",\"row\":%zu,\"col\":%zu,\"kind\":\"%s\",\"command\":", d->loc.row, d->loc.col, DIAGKIND_STR[d->kind]);
+	sb_append_json_str(sb, d->name);
+	switch (d->kind) {
+		case DIAG_OVERFLOW:
+			sb_appendf(sb, ",\"arg\":%zu", d->arg);
+			if (d->item) sb_appendf(sb, ",\"item\":%zu", d->item);
+			break;
+		case DIAG_TOO_FEW_ARGS:
+		case DIAG_TOO_MANY_ARGS:
+			sb_appendf(sb, ",\"expected\":%zu,\"actual\":%zu", d->expected_argc, d->argc);
+			break;
+		case DIAG_ARG_RANGE:
+		case DIAG_ARG_TYPE:
+			sb_appendf(sb, ",\"arg\":%zu,\"expected\":\"%s\",\"actual\":\"%s\"",
+				d->arg, ARGTYPE_STR[d->expected], ARGTYPE_STR[d->actual]);
+			break;
+		default:
+			break;
+	}
+	sb_append_cstr(sb, "}\n");
+}
+
+void diag_print(void *ctx, const Diag *d) {
+	StringBuilder sb = {0};
+	sb_append_diag(&sb, d);
+	fwrite(sb.content, 1, sb.len, ctx ? ctx : stderr);
+	mem_free(sb.content);
+}
+
+// ----- diagnostic buffers -----
+
+void diag_buffer_flush(DiagBuffer *b) {
+	if (!b->out || !b->buf.len) return;
+	// what commands printed so far comes first, even when stdout is a pipe
+	if (b->out == stderr) fflush(stdout);
+	fwrite(b->buf.content, 1, b->buf.len, b->out);
+	fflush(b->out);
+	b->buf.len = 0;
+}
+
+// Appends a diagnostic formatted by sb_append_diag(_json), unless past the cap
+void diag_buffer_push_formatted(DiagBuffer *b, const char *s, size_t n) {
+	if (b->max && b->reported >= b->max) {
+		b->suppressed++;
+		return;
+	}
+	b->reported++;
+	sb_append_bytes(&b->buf, s, n);
+	if (b->buf.len >= LLN_DIAG_BUFFER) diag_buffer_flush(b);
+}
+
+void diag_buffer_push(void *ctx, const Diag *d) {
+	DiagBuffer *b = ctx;
+	if (b->max && b->reported >= b->max) {
+		b->suppressed++;
+		return;
+	}
+	b->reported++;
+	if (b->json) sb_append_diag_json(&b->buf, d);
+	else sb_append_diag(&b->buf, d);
+	if (b->buf.len >= LLN_DIAG_BUFFER) diag_buffer_flush(b);
+}
+
+void diag_buffer_end(DiagBuffer *b, const char *filename) {
+	if (b->suppressed && b->json) {
+		sb_append_cstr(&b->buf, "{\"file\":");
+		sb_append_json_str(&b->buf, filename);
+		sb_appendf(&b->buf, ",\"kind\":\"suppressed\",\"count\":%zu}\n", b->suppressed);
+	} else if (b->suppressed) {
+		sb_appendf(&b->buf, "%s: %zu more error%s suppressed (at most %zu are reported).\n",
+			filename, b->suppressed, b->suppressed > 1 ? "s" : "", b->max);
+	}
+	diag_buffer_flush(b);
+}
+
+// Reports every reason the command is invalid
+bool validate_command_diag(Comm *comm, const Callables *cs, DiagSink report, void *ctx) {
+	Diag d = { .name = comm->name, .loc = comm->loc };
 	Callable *c = name_to_callable(comm->name, cs);
 	if (!c) {
-		fprint_context(stderr, comm->loc, "Command '%s' doesn't exist.\n", comm->name);
+		d.kind = DIAG_UNKNOWN_COMMAND;
+		report(ctx, &d);
 		return false;
 	}
 	if (comm->malformed) {
 		// TODO: Elaborate ? Maybe a malformation struct or enum idk
-		fprint_context(stderr, comm->loc, "Command '%s' is malformed.\n", comm->name);
+		d.kind = DIAG_MALFORMED;
+		report(ctx, &d);
 		return false;
 	}
-	Args args = comm->args;
-	if (args.count < c->signature.count) {
-		fprint_context(stderr, comm->loc, "Command '%s' needs %zu arguments, only %zu were passed.\n", comm->name, c->signature.count, args.count);
+	if (comm->overflow) {
+		d.kind = DIAG_OVERFLOW;
+		d.arg = comm->overflow;
+		d.item = comm->overflow_item;
+		report(ctx, &d);
 		return false;
 	}
-	if (args.count > c->signature.count) {
-		fprint_context(stderr, comm->loc, "Command '%s' needs %zu arguments, but %zu were passed.\n", comm->name, c->signature.count, args.count);
+	Args args = comm->args;
+	d.argc = args.count;
+	d.expected_argc = c->signature.count;
+	if (args.count != c->signature.count) {
+		d.kind = args.count < c->signature.count ? DIAG_TOO_FEW_ARGS : DIAG_TOO_MANY_ARGS;
+		report(ctx, &d);
 		return false;
 	}
 	bool valid_args = true;
 	for (size_t i = 0; i < args.count; i++) {
 		Arg *a = &args.items[i];
-		ArgType t = c->signature.items[i];
-		Arg *cast = try_cast(a, t);
-		if (!cast) {
-			fprint_context(
-				stderr, 
-				comm->loc, 
-				"Command '%s' expects %s as %zu%s argument, but %s was passed.\n", 
-				comm->name,
-				ARGTYPE_STR[t],
-				i+1, nth(i+1),
-				ARGTYPE_STR[a->type]);
+		d.arg = i + 1;
+		d.expected = c->signature.items[i];
+		d.actual = a->type;
+		if (!arg_fits(a, d.expected)) {
+			d.kind = DIAG_ARG_RANGE;
+			report(ctx, &d);
+			valid_args = false;
+			continue;
+		}
+		if (!try_cast(a, d.expected)) {
+			d.kind = DIAG_ARG_TYPE;
+			d.actual = arg_literal_type(a);
+			report(ctx, &d);
 			valid_args = false;
 		}
 	}
 	if (!valid_args) return false;
 	comm->f = c->fnptr; 
+	comm->callable = c;
 	return true;
 }
 
+bool validate_command(Comm *comm, const Callables *cs) {
+	return validate_command_diag(comm, cs, diag_print, NULL);
+}
+
 // ----- running -----
 
-Comm *lexer_next_valid_comm(Lexer *l, const Callables *c) {
-	while (lexer_next_command(l) && !validate_command(l, c));
-	if (l->tok.kind == TOK_END) return NULL;
-	return &l->comm;
+Comm *parser_next_valid_comm(Parser *p, const Callables *c) {
+	Comm *comm;
+	DiagSink report = p->diags ? diag_buffer_push : diag_print;
+	while ((comm = parser_next_command(p))) {
+		LLN_PROBE(cmd_parsed, comm->name, comm->args.count, comm->loc.row);
+		if (validate_command_diag(comm, c, report, p->diags)) {
+			LLN_PROBE(cmd_valid, comm->name, comm->args.count, comm->loc.row);
+			// what went wrong before comes out before what the command prints
+			if (p->diags) diag_buffer_flush(p->diags);
+			return comm;
+		}
+		LLN_PROBE(cmd_invalid, comm->name, comm->args.count, comm->loc.row);
+	}
+	return NULL;
+}
+
+// See lln-internal.h
+size_t visit_valid_comms(const char *content, const char *filename, const Callables *c, CommVisitor visit, void *ctx) {
+	Parser p;
+	size_t invalid = 0;
+	parser_init(&p, content, filename);
+	for (Comm *comm; (comm = parser_next_command(&p));) {
+		if (!validate_command(comm, c)) invalid++;
+		else if (!visit(ctx, comm->callable, comm->args, comm->loc)) break;
+	}
+	parser_free(&p);
+	return invalid;
+}
+
+// See lln-internal.h
+size_t check_script(const char *content, const char *filename, const Callables *c, DiagSink report, void *ctx) {
+	Parser p;
+	size_t invalid = 0;
+	parser_init(&p, content, filename);
+	for (Comm *comm; (comm = parser_next_command(&p));) {
+		if (!validate_command_diag(comm, c, report, ctx)) invalid++;
+	}
+	parser_free(&p);
+	return invalid;
+}
+
+// ----- streams -----
+
+struct lln_Stream {
+	const Callables *c;
+	StringBuilder buf;
+	Parser p;
+	bool closed;
+	size_t resume; // where tokenizing resumes: the last token may still grow
+	size_t str_stop; // where the scan of the literal open at resume stopped, 0 if none
+};
+
+Stream *stream_new(const char *name, const Callables *c) {
+	Stream *s = mem_calloc(1, sizeof(Stream));
+	assert(s);
+	s->c = c;
+	parser_init(&s->p, NULL, name);
+	s->p.tokenized = true; // as it is fed
+	return s;
+}
+
+// Drops the input before keep, and the tokens already parsed
+static void stream_compact(Stream *s, size_t keep) {
+	Parser *p = &s->p;
+	memmove(s->buf.content, s->buf.content + keep, s->buf.len - keep);
+	s->buf.len -= keep;
+	size_t from = p->next;
+	while (from > 0 && p->toks.offset[from - 1] >= s->resume) from--;
+	size_t n = p->toks.count - from;
+	memmove(p->toks.offset, p->toks.offset + from, n * sizeof(uint32_t));
+	memmove(p->toks.len, p->toks.len + from, n * sizeof(uint32_t));
+	memmove(p->toks.kind, p->toks.kind + from, n * sizeof(uint8_t));
+	for (size_t i = 0; i < n; i++) p->toks.offset[i] -= keep;
+	p->toks.count = n;
+	p->next -= from;
+	s->resume -= keep;
+	if (s->str_stop) s->str_stop -= keep;
+	p->line_off -= keep;
+	p->line_start -= keep;
+	if (p->prev_line_start != SIZE_MAX) p->prev_line_start -= keep;
+}
+
+void stream_feed(Stream *s, const char *data, size_t n) {
+	Parser *p = &s->p;
+	// keep the lines diagnostics may still quote
+	size_t keep = p->prev_line_start != SIZE_MAX ? p->prev_line_start : p->line_start;
+	if (keep > LLN_STREAM_COMPACT && keep > s->buf.len / 2) stream_compact(s, keep);
+	if (s->buf.len) s->buf.len--; // over the NUL
+	sb_append_bytes(&s->buf, data, n);
+	sb_term(&s->buf);
+	p->content = s->buf.content;
+	bool escaped = false, closed;
+	const char *stop;
+	// a literal still open takes in the whole chunk, only what it adds is scanned
+	if (s->str_stop) {
+		scan_str(p->content + s->str_stop, &escaped, &closed, &stop);
+		if (!closed) {
+			s->str_stop = stop - p->content;
+			return;
+		}
+		s->str_stop = 0;
+	}
+	// the tokens from the last one on are redone and read again,
+	// e.g. "text" into "text!cmd" or "false" into "false5"
+	while (p->toks.count > 0 && p->toks.offset[p->toks.count - 1] >= s->resume) p->toks.count--;
+	if (p->next > p->toks.count) p->next = p->toks.count;
+	s->resume = tokenize(p->content, s->resume, &p->toks);
+	// an unterminated literal is no token
+	const char *r = p->content + s->resume;
+	bool no_tok = p->toks.count == 0 || p->toks.offset[p->toks.count - 1] != s->resume;
+	if (no_tok && (*r == '"' || strncmp(r, "b64\"", 4) == 0)) {
+		scan_str(r + (*r == '"' ? 1 : 4), &escaped, &closed, &stop);
+		if (!closed) s->str_stop = stop - p->content;
+	}
+}
+
+void stream_close(Stream *s) {
+	s->closed = true;
+}
+
+const Callable *stream_next(Stream *s, Args *args) {
+	Parser *p = &s->p;
+	if (!p->content) return NULL;
+	while (1) {
+		size_t next = p->next, line_off = p->line_off, row = p->row;
+		size_t line_start = p->line_start, prev_line_start = p->prev_line_start;
+		Comm *comm = parser_next_command(p);
+		if (!comm) return NULL;
+		// a command that ran out of input, or whose last token may still
+		// grow, may still complete: it is parsed again with more
+		if (!s->closed && comm->malformed && (p->at_end || p->next == p->toks.count)) {
+			p->next = next;
+			p->line_off = line_off;
+			p->row = row;
+			p->line_start = line_start;
+			p->prev_line_start = prev_line_start;
+			return NULL;
+		}
+		LLN_PROBE(cmd_parsed, comm->name, comm->args.count, comm->loc.row);
+		if (validate_command(comm, s->c)) {
+			LLN_PROBE(cmd_valid, comm->name, comm->args.count, comm->loc.row);
+			*args = comm->args;
+			return comm->callable;
+		}
+		LLN_PROBE(cmd_invalid, comm->name, comm->args.count, comm->loc.row);
+	}
+}
+
+void stream_free(Stream *s) {
+	if (!s) return;
+	parser_free(&s->p);
+	mem_free(s->buf.content);
+	mem_free(s);
+}
+
+// ----- deadlines -----
+
+static _Atomic bool g_cancelled;
+
+bool lln_cancelled(void) {
+	return atomic_load_explicit(&g_cancelled, memory_order_relaxed);
+}
+
+// Cancels the run when the commands or the running call are out of time.
+// Only started when the run has a budget, see watchdog_start.
+typedef struct {
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const Callables *c;
+	double budget;
+	struct timespec end; // zero when there is no deadline for the commands
+	double cmd_timeout;
+	const char *call; // name of the running call, NULL between calls
+	double call_budget;
+	struct timespec call_end; // zero when the running call has no timeout
+	bool done;
+} Watchdog;
+
+static Watchdog g_watchdog;
+
+static inline bool ts_is_set(struct timespec t) {
+	return t.tv_sec || t.tv_nsec;
+}
+
+static inline bool ts_before(struct timespec a, struct timespec b) {
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static inline struct timespec ts_after(double secs) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (secs > 1e9) secs = 1e9;
+	time_t whole = (time_t) secs;
+	t.tv_sec += whole;
+	t.tv_nsec += (long) ((secs - whole) * 1e9);
+	if (t.tv_nsec >= 1000000000L) t.tv_sec++, t.tv_nsec -= 1000000000L;
+	return t;
+}
+
+void *watchdog_run(void *arg) {
+	Watchdog *w = arg;
+	pthread_mutex_lock(&w->lock);
+	while (!w->done) {
+		bool is_call = ts_is_set(w->call_end) && (!ts_is_set(w->end) || ts_before(w->call_end, w->end));
+		struct timespec end = is_call ? w->call_end : w->end;
+		if (!ts_is_set(end)) {
+			pthread_cond_wait(&w->cond, &w->lock);
+			continue;
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ts_before(now, end)) {
+			pthread_cond_timedwait(&w->cond, &w->lock, &end);
+			continue;
+		}
+		if (is_call) fprintf(stderr, "ERROR: '%s' ran out of time (%gs), skipping the rest of the script.\n", w->call, w->call_budget);
+		else fprintf(stderr, "ERROR: script ran out of time (%gs), skipping the rest of it.\n", w->budget);
+		atomic_store_explicit(&g_cancelled, true, memory_order_relaxed);
+		break;
+	}
+	// a call that doesn't poll lln_cancelled() can't be stopped, so
+	// post() runs without it and the process exits
+	struct timespec grace = ts_after(LLN_CANCEL_GRACE);
+	while (!w->done) {
+		if (pthread_cond_timedwait(&w->cond, &w->lock, &grace) != ETIMEDOUT) continue;
+		if (w->done) break;
+		fprintf(stderr, "ERROR: '%s' didn't return after being cancelled, exiting.\n", w->call ? w->call : "script");
+		if (w->c->post) w->c->post();
+		fflush(stdout);
+		_exit(LLN_EXIT_TIMEOUT);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+// Starts the watchdog if the run has a deadline or a command has a timeout.
+// Running without one (e.g. if the thread couldn't start) never cancels.
+void watchdog_start(const Callables *c, const RunOptions *opts) {
+	atomic_store_explicit(&g_cancelled, false, memory_order_relaxed);
+	bool timeouts = opts->deadline > 0 || opts->cmd_timeout > 0;
+	for (size_t i = 0; i < c->count && !timeouts; i++) timeouts = c->items[i].timeout > 0;
+	if (!timeouts) return;
+
+	Watchdog *w = &g_watchdog;
+	*w = (Watchdog) { .c = c, .budget = opts->deadline, .cmd_timeout = opts->cmd_timeout };
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&w->lock, NULL);
+	if (opts->deadline > 0) w->end = ts_after(opts->deadline);
+	if (pthread_create(&w->thread, NULL, watchdog_run, w) != 0) {
+		fprintf(stderr, "WARNING: couldn't start the watchdog, running without time limits.\n");
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		return;
+	}
+	w->running = true;
+}
+
+void watchdog_stop(void) {
+	Watchdog *w = &g_watchdog;
+	if (!w->running) return;
+	pthread_mutex_lock(&w->lock);
+	w->done = true;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	w->running = false;
+}
+
+// Around every call, so the watchdog knows what is running and until when
+static inline void watchdog_begin(const Callable *c) {
+	Watchdog *w = &g_watchdog;
+	if (!w->running) return;
+	pthread_mutex_lock(&w->lock);
+	w->call = c->name;
+	w->call_budget = c->timeout > 0 ? c->timeout : w->cmd_timeout;
+	if (w->call_budget > 0) {
+		w->call_end = ts_after(w->call_budget);
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+static inline void watchdog_end(void) {
+	Watchdog *w = &g_watchdog;
+	if (!w->running) return;
+	pthread_mutex_lock(&w->lock);
+	w->call = NULL;
+	w->call_end = (struct timespec) {0};
+	pthread_mutex_unlock(&w->lock);
+}
+
+// ----- batching -----
+
+// Size of a column item, see lln_Batch
+static inline size_t argtype_col_size(ArgType t) {
+	switch (t) {
+		case ARG_INT: return sizeof(int);
+		case ARG_FLT: return sizeof(float);
+		case ARG_I64: return sizeof(int64_t);
+		case ARG_DBL: return sizeof(double);
+		case ARG_BOOL: return sizeof(bool);
+		case ARG_STR: return sizeof(char *);
+		default: return sizeof(ArgValue);
+	}
+}
+
+// Consecutive calls to the same batch command, one column per argument.
+// The columns are kept between flushes while the command doesn't change.
+typedef struct {
+	const Callable *c;
+	void **columns;
+	size_t count;
+} Batcher;
+
+void batcher_flush(Batcher *b) {
+	if (b->count == 0) return;
+	// batches still pending when the script is cancelled are dropped
+	if (!lln_cancelled()) {
+		watchdog_begin(b->c);
+		uint64_t start = LLN_PROBE_START(batch_return);
+		LLN_PROBE(batch_entry, b->c->name, b->count);
+		b->c->batch_fnptr((Batch) { .columns = b->columns, .count = b->count });
+		LLN_PROBE(batch_return, b->c->name, b->count, LLN_PROBE_NS(start));
+		watchdog_end();
+	}
+	ArgTypes sign = b->c->signature;
+	for (size_t i = 0; i < sign.count; i++) {
+		if (sign.items[i] == ARG_STR) {
+			char **col = b->columns[i];
+			for (size_t k = 0; k < b->count; k++) mem_free(col[k]);
+		} else if (argtype_is_arr(sign.items[i]) || sign.items[i] == ARG_BLOB) {
+			ArgValue *col = b->columns[i];
+			for (size_t k = 0; k < b->count; k++) mem_free(col[k].arr.items);
+		}
+	}
+	b->count = 0;
+}
+
+void batcher_free(Batcher *b) {
+	batcher_flush(b);
+	if (b->c) {
+		for (size_t i = 0; i < b->c->signature.count; i++) mem_free(b->columns[i]);
+	}
+	mem_free(b->columns);
+	*b = (Batcher) {0};
+}
+
+// Moves the arguments of a validated call into the batch,
+// the batch takes ownership of strings, arrays and blobs
+void batcher_add(Batcher *b, Comm *comm) {
+	const Callable *c = comm->callable;
+	if (b->c != c) {
+		batcher_free(b);
+		b->c = c;
+		b->columns = mem_alloc(MEM_OTHER, c->signature.count * sizeof(void *));
+		for (size_t i = 0; i < c->signature.count; i++)
+			b->columns[i] = mem_alloc(MEM_OTHER, LLN_BATCH_MAX * argtype_col_size(c->signature.items[i]));
+	}
+	size_t k = b->count++;
+	for (size_t i = 0; i < comm->args.count; i++) {
+		Arg *a = &comm->args.items[i];
+		void *col = b->columns[i];
+		switch (a->type) {
+			case ARG_INT: ((int *) col)[k] = a->value.i; break;
+			case ARG_FLT: ((float *) col)[k] = a->value.f; break;
+			case ARG_I64: ((int64_t *) col)[k] = a->value.l; break;
+			case ARG_DBL: ((double *) col)[k] = a->value.d; break;
+			case ARG_BOOL: ((bool *) col)[k] = a->value.b; break;
+			case ARG_STR:
+				((char **) col)[k] = a->value.s;
+				a->value.s = NULL;
+				break;
+			default:
+				((ArgValue *) col)[k] = a->value;
+				a->value.arr.items = NULL;
+		}
+	}
+	if (b->count == LLN_BATCH_MAX) batcher_flush(b);
+}
+
+// ----- memoization -----
+
+// A cached call to a pure command, keyed by the command and its
+// serialized arguments. Entries form a most recently used first list.
+typedef struct MemoEntry {
+	const Callable *callable;
+	uint64_t hash;
+	char *key;
+	size_t key_len;
+
+	char *output; // what the call printed, all a hit replays
+	size_t output_len;
+
+	struct MemoEntry *chain;
+	struct MemoEntry *prev;
+	struct MemoEntry *next;
+} MemoEntry;
+
+typedef struct {
+	const Callables *cs;
+	MemoEntry **buckets;
+	size_t mask;
+	size_t count;
+	size_t max;
+	MemoEntry *first; // most recently used
+	MemoEntry *last;  // evicted first
+
+	StringBuilder key; // scratch for the key of the current call
+	FILE *capture;     // scratch file stdout goes to during a call
+} Memo;
+
+// Type tags and raw values, with lengths up front for strings,
+// arrays and blobs, so different arguments never share a key
+void memo_key(StringBuilder *sb, Args args) {
+	for (size_t i = 0; i < args.count; i++) {
+		Arg a = args.items[i];
+		sb_append(sb, (char) a.type);
+		switch (a.type) {
+			case ARG_INT: sb_append_bytes(sb, &a.value.i, sizeof(a.value.i)); break;
+			case ARG_FLT: sb_append_bytes(sb, &a.value.f, sizeof(a.value.f)); break;
+			case ARG_I64: sb_append_bytes(sb, &a.value.l, sizeof(a.value.l)); break;
+			case ARG_DBL: sb_append_bytes(sb, &a.value.d, sizeof(a.value.d)); break;
+			case ARG_BOOL: sb_append(sb, a.value.b); break;
+			case ARG_STR: {
+				size_t len = strlen(a.value.s);
+				sb_append_bytes(sb, &len, sizeof(len));
+				sb_append_bytes(sb, a.value.s, len);
+				break;
+			}
+			default:
+				sb_append_bytes(sb, &a.value.arr.count, sizeof(a.value.arr.count));
+				sb_append_bytes(sb, a.value.arr.items, a.value.arr.count * arr_item_size(a.type));
+		}
+	}
+}
+
+static inline uint64_t memo_hash(const Memo *m, const Callable *c, const char *key, size_t len) {
+	uint64_t id = (uint64_t) (c - m->cs->items);
+	return hash_bytes(key, len) ^ hash_mix(id + 1);
+}
+
+// Leaves the memo off (max 0) unless a command is pure: there is
+// nothing to cache, nor a cache file to load or save
+void memo_init(Memo *m, const Callables *cs, size_t max) {
+	*m = (Memo) { .cs = cs };
+	bool any_pure = false;
+	for (size_t i = 0; i < cs->count && !any_pure; i++) any_pure = cs->items[i].pure;
+	if (!any_pure) return;
+	m->max = max;
+	size_t n = 16;
+	while (n < max) n *= 2;
+	m->buckets = mem_calloc(n, sizeof(MemoEntry *));
+	m->mask = n - 1;
+	m->capture = tmpfile();
+}
+
+MemoEntry *memo_find(Memo *m, const Callable *c, uint64_t hash, const char *key, size_t len) {
+	for (MemoEntry *e = m->buckets[hash & m->mask]; e; e = e->chain) {
+		if (e->hash == hash && e->callable == c && e->key_len == len && memcmp(e->key, key, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static inline void memo_unlink(Memo *m, MemoEntry *e) {
+	if (e->prev) e->prev->next = e->next;
+	else m->first = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else m->last = e->prev;
+}
+
+static inline void memo_push_first(Memo *m, MemoEntry *e) {
+	e->prev = NULL;
+	e->next = m->first;
+	if (m->first) m->first->prev = e;
+	else m->last = e;
+	m->first = e;
+}
+
+void memo_entry_free(MemoEntry *e) {
+	mem_free(e->key);
+	mem_free(e->output);
+	mem_free(e);
+}
+
+// Takes ownership of key and output, evicts the least recently used entry when full
+void memo_insert(Memo *m, const Callable *c, uint64_t hash, char *key, size_t key_len, char *output, size_t output_len) {
+	MemoEntry *e = mem_alloc(MEM_OTHER, sizeof(MemoEntry));
+	*e = (MemoEntry) {
+		.callable = c, .hash = hash, .key = key, .key_len = key_len,
+		.output = output, .output_len = output_len,
+	};
+	e->chain = m->buckets[hash & m->mask];
+	m->buckets[hash & m->mask] = e;
+	memo_push_first(m, e);
+	if (++m->count <= m->max) return;
+
+	MemoEntry *old = m->last;
+	memo_unlink(m, old);
+	MemoEntry **slot = &m->buckets[old->hash & m->mask];
+	while (*slot != old) slot = &(*slot)->chain;
+	*slot = old->chain;
+	memo_entry_free(old);
+	m->count--;
+}
+
+// Runs a command with stdout going to the scratch file, then
+// copies what it printed to the real stdout and to *output
+void memo_capture(Memo *m, Comm *comm, char **output, size_t *output_len) {
+	*output = NULL;
+	*output_len = 0;
+	if (!m->capture) {
+		comm_call(comm);
+		return;
+	}
+	int fd = fileno(m->capture);
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	if (saved < 0 || ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0 || dup2(fd, STDOUT_FILENO) < 0) {
+		if (saved >= 0) close(saved);
+		comm_call(comm);
+		return;
+	}
+	comm_call(comm);
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	off_t len = lseek(fd, 0, SEEK_END);
+	if (len > 0 && (*output = mem_alloc(MEM_OTHER, len))) {
+		*output_len = pread(fd, *output, len, 0) == len ? (size_t) len : 0;
+		fwrite(*output, 1, *output_len, stdout);
+	}
+}
+
+// Replays the output of a cached identical call, or runs and caches it
+void memo_call(Memo *m, Comm *comm) {
+	m->key.len = 0;
+	memo_key(&m->key, comm->args);
+	uint64_t hash = memo_hash(m, comm->callable, m->key.content, m->key.len);
+	MemoEntry *e = memo_find(m, comm->callable, hash, m->key.content, m->key.len);
+	if (e) {
+		memo_unlink(m, e);
+		memo_push_first(m, e);
+		fwrite(e->output, 1, e->output_len, stdout);
+		return;
+	}
+	char *output;
+	size_t output_len;
+	memo_capture(m, comm, &output, &output_len);
+	if (lln_cancelled()) {
+		// the call may have returned early, with partial output
+		mem_free(output);
+		return;
+	}
+	char *key = mem_alloc(MEM_OTHER, m->key.len ? m->key.len : 1);
+	memcpy(key, m->key.content, m->key.len);
+	memo_insert(m, comm->callable, hash, key, m->key.len, output, output_len);
+}
+
+// Cache file: "LLNMEMO1", then for every entry, least recently used first,
+// the command name, key and output, each as a u64 length and its bytes.
+// Entries of commands that are gone or no longer pure are dropped.
+static const char MEMO_MAGIC[8] = "LLNMEMO1";
+
+static inline bool memo_read_field(FILE *f, char **data, size_t *len) {
+	uint64_t n;
+	if (fread(&n, sizeof(n), 1, f) != 1 || n > ((uint64_t) 1 << 32)) return false;
+	*data = mem_alloc(MEM_OTHER, n + 1);
+	if (!*data) return false;
+	if (fread(*data, 1, n, f) != n) {
+		mem_free(*data);
+		return false;
+	}
+	(*data)[n] = '\0';
+	*len = n;
+	return true;
+}
+
+void memo_load(Memo *m, const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return; // no cache yet
+	char magic[sizeof(MEMO_MAGIC)];
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, MEMO_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "Ignoring invalid memo file '%s'\n", path);
+		fclose(f);
+		return;
+	}
+	char *name, *key, *output;
+	size_t name_len, key_len, output_len;
+	while (memo_read_field(f, &name, &name_len)) {
+		if (!memo_read_field(f, &key, &key_len)) {
+			mem_free(name);
+			break;
+		}
+		if (!memo_read_field(f, &output, &output_len)) {
+			mem_free(name);
+			mem_free(key);
+			break;
+		}
+		Callable *c = name_to_callable(name, m->cs);
+		mem_free(name);
+		uint64_t hash = c ? memo_hash(m, c, key, key_len) : 0;
+		if (c && c->pure && !memo_find(m, c, hash, key, key_len)) {
+			memo_insert(m, c, hash, key, key_len, output, output_len);
+		} else {
+			mem_free(key);
+			mem_free(output);
+		}
+	}
+	fclose(f);
+}
+
+static inline void memo_write_field(FILE *f, const void *data, size_t len) {
+	uint64_t n = len;
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(data, 1, len, f);
+}
+
+// Written next to path first, then renamed over it
+void memo_save(Memo *m, const char *path) {
+	StringBuilder tmp = {0};
+	sb_appendf(&tmp, "%s.tmp", path);
+	FILE *f = fopen(tmp.content, "wb");
+	if (!f) {
+		fprintf(stderr, "Could not write memo file '%s'\n", tmp.content);
+		mem_free(tmp.content);
+		return;
+	}
+	fwrite(MEMO_MAGIC, 1, sizeof(MEMO_MAGIC), f);
+	for (MemoEntry *e = m->last; e; e = e->prev) {
+		memo_write_field(f, e->callable->name, strlen(e->callable->name));
+		memo_write_field(f, e->key, e->key_len);
+		memo_write_field(f, e->output, e->output_len);
+	}
+	if (fclose(f) != 0 || rename(tmp.content, path) != 0) {
+		fprintf(stderr, "Could not write memo file '%s'\n", path);
+		remove(tmp.content);
+	}
+	mem_free(tmp.content);
+}
+
+void memo_free(Memo *m) {
+	for (MemoEntry *e = m->first, *next; e; e = next) {
+		next = e->next;
+		memo_entry_free(e);
+	}
+	mem_free(m->buckets);
+	mem_free(m->key.content);
+	if (m->capture) fclose(m->capture);
+	*m = (Memo) {0};
+}
+
+// ----- tracing -----
+
+// A trace (--record) is the commands a run dispatched, with their arguments
+// as cast to the signature, replayed by lln_replay_trace without lexing.
+// After the magic "LLNT" and a version come records, each a kind byte:
+//   TRACE_COMMAND: id, name length, name, argument count, a type byte each
+//                  (before the first call to the command, ids count up from 0)
+//   TRACE_CALL:    id, ns since the previous call started (the run for the
+//                  first), arguments, ns the call took (0 if batched)
+// Ids, lengths, counts and times are LEB128 varints. Arguments: INT and I64
+// zigzag varints, FLT, DBL and BOOL their bytes, STR a length and its bytes,
+// arrays and blobs an item count and their items' bytes, in host byte order.
+
+#define TRACE_MAGIC "LLNT"
+#define TRACE_VERSION 1
+
+enum {
+	TRACE_COMMAND = 1,
+	TRACE_CALL,
+};
+
+// Bytes of trace held in memory before they are written out
+#ifndef LLN_TRACE_BUFFER
+#define LLN_TRACE_BUFFER (64*1024)
+#endif // LLN_TRACE_BUFFER
+
+typedef struct {
+	FILE *f;
+	const char *path;
+	StringBuilder buf;
+	const Callables *c;
+	size_t *ids; // id + 1 by index in c->items, 0 until declared
+	size_t id_count;
+	uint64_t last; // ns when the previous call started
+	bool failed;
+} Recorder;
+
+static void sb_append_varint(StringBuilder *sb, uint64_t v) {
+	uint8_t bytes[10];
+	size_t n = 0;
+	do {
+		bytes[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+	sb_append_bytes(sb, bytes, n);
+}
+
+static inline uint64_t zigzag(int64_t v) {
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+bool recorder_open(Recorder *r, const char *path, const Callables *c) {
+	*r = (Recorder) { .path = path, .c = c, .last = lln_probe_now_ns() };
+	r->f = fopen(path, "wb");
+	r->ids = mem_calloc(c->count ? c->count : 1, sizeof(size_t));
+	if (!r->f || !r->ids) {
+		fprintf(stderr, "ERROR: couldn't write the trace '%s'.\n", path);
+		if (r->f) fclose(r->f);
+		mem_free(r->ids);
+		return false;
+	}
+	sb_append_bytes(&r->buf, TRACE_MAGIC, 4);
+	sb_append_varint(&r->buf, TRACE_VERSION);
+	return true;
 }
 
-void execute(Lexer *l, const Callables *c) {
-	if (c->pre) c->pre();
+static void recorder_flush(Recorder *r) {
+	if (r->buf.len && fwrite(r->buf.content, 1, r->buf.len, r->f) != r->buf.len) r->failed = true;
+	r->buf.len = 0;
+}
+
+// Records a call about to start, before the command can change its arguments
+static void recorder_call(Recorder *r, const Comm *comm, uint64_t start) {
+	const Callable *c = comm->callable;
+	size_t *slot = &r->ids[c - r->c->items];
+	StringBuilder *sb = &r->buf;
+	if (!*slot) {
+		// in the order commands are first called, whatever their index
+		*slot = ++r->id_count;
+		size_t len = strlen(c->name);
+		sb_append(sb, TRACE_COMMAND);
+		sb_append_varint(sb, *slot - 1);
+		sb_append_varint(sb, len);
+		sb_append_bytes(sb, c->name, len);
+		sb_append_varint(sb, c->signature.count);
+		for (size_t i = 0; i < c->signature.count; i++) sb_append(sb, (char) c->signature.items[i]);
+	}
+	sb_append(sb, TRACE_CALL);
+	sb_append_varint(sb, *slot - 1);
+	sb_append_varint(sb, start - r->last);
+	r->last = start;
+	for (size_t i = 0; i < comm->args.count; i++) {
+		const Arg *a = &comm->args.items[i];
+		switch (a->type) {
+			case ARG_INT: sb_append_varint(sb, zigzag(a->value.i)); break;
+			case ARG_I64: sb_append_varint(sb, zigzag(a->value.l)); break;
+			case ARG_FLT: sb_append_bytes(sb, &a->value.f, sizeof(float)); break;
+			case ARG_DBL: sb_append_bytes(sb, &a->value.d, sizeof(double)); break;
+			case ARG_BOOL: sb_append(sb, a->value.b); break;
+			case ARG_STR: {
+				size_t len = a->value.s ? strlen(a->value.s) : 0;
+				sb_append_varint(sb, len);
+				if (len) sb_append_bytes(sb, a->value.s, len);
+				break;
+			}
+			default:
+				sb_append_varint(sb, a->value.arr.count);
+				sb_append_bytes(sb, a->value.arr.items, a->value.arr.count * arr_item_size(a->type));
+		}
+	}
+}
+
+// Ends the record of the call, once it returned
+static void recorder_return(Recorder *r, uint64_t ns) {
+	sb_append_varint(&r->buf, ns);
+	if (r->buf.len >= LLN_TRACE_BUFFER) recorder_flush(r);
+}
+
+// false if the trace couldn't be written whole
+bool recorder_close(Recorder *r) {
+	recorder_flush(r);
+	if (fclose(r->f) != 0) r->failed = true;
+	if (r->failed) fprintf(stderr, "ERROR: couldn't write the trace '%s'.\n", r->path);
+	mem_free(r->buf.content);
+	mem_free(r->ids);
+	return !r->failed;
+}
+
+// ----- dispatch -----
+
+// Per-run execution state, owned by the thread running the commands
+typedef struct {
+	Batcher batch;
+	Memo memo; // max is 0 when memoization is off
+	Recorder *rec; // NULL unless the run is recorded
+} Executor;
+
+// Runs a validated command. Calls to batch commands are held back until
+// a different command comes, the batch is full or the script ends. Calls
+// to pure commands go through the memo.
+void dispatch(Executor *e, Comm *comm) {
+	if (mem_counting()) atomic_fetch_add_explicit(&g_mem.commands, 1, memory_order_relaxed);
+	if (comm->callable->batch_fnptr) {
+		if (e->rec) {
+			recorder_call(e->rec, comm, lln_probe_now_ns());
+			recorder_return(e->rec, 0);
+		}
+		batcher_add(&e->batch, comm);
+		return;
+	}
+	batcher_flush(&e->batch);
+	uint64_t rec_start = 0;
+	if (e->rec) recorder_call(e->rec, comm, rec_start = lln_probe_now_ns());
+	watchdog_begin(comm->callable);
+	uint64_t start = LLN_PROBE_START(cmd_return);
+	LLN_PROBE(cmd_entry, comm->callable->name, comm->args.count);
+	if (comm->callable->pure && e->memo.max > 0) memo_call(&e->memo, comm);
+	else comm_call(comm);
+	LLN_PROBE(cmd_return, comm->callable->name, comm->args.count, LLN_PROBE_NS(start));
+	watchdog_end();
+	if (e->rec) recorder_return(e->rec, lln_probe_now_ns() - rec_start);
+}
+
+// ----- pipelining -----
+
+// A validated command, owning its arguments
+typedef struct {
+	const Callable *callable; // NULL marks the end of the script
+	Args args;
+	char *diags; // formatted diagnostics to print before it, owned
+	size_t diags_len;
+} Record;
+
+// Lock-free single-producer/single-consumer ring of records. Its capacity
+// bounds how far the front-end can get ahead of the executor.
+typedef struct {
+	Record *items;
+	size_t mask;
+	_Alignas(64) _Atomic size_t head; // next record to pop, only moved by the consumer
+	_Alignas(64) _Atomic size_t tail; // next slot to fill, only moved by the producer
+} Ring;
+
+static inline void ring_backoff(unsigned *spins) {
+	(*spins)++;
+	if (*spins < 64) {
+#if defined(__SSE2__)
+		_mm_pause();
+#endif // __SSE2__
+	} else if (*spins < 1024) {
+		sched_yield();
+	} else {
+		// the other side is busy for a while (e.g. a slow command)
+		nanosleep(&(struct timespec) { .tv_nsec = 50000 }, NULL);
+	}
+}
+
+void ring_push(Ring *r, Record rec) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned spins = 0;
+	while (tail - atomic_load_explicit(&r->head, memory_order_acquire) > r->mask) ring_backoff(&spins);
+	r->items[tail & r->mask] = rec;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+Record ring_pop(Ring *r) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned spins = 0;
+	while (atomic_load_explicit(&r->tail, memory_order_acquire) == head) ring_backoff(&spins);
+	Record rec = r->items[head & r->mask];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return rec;
+}
+
+typedef struct {
+	Parser *p;
+	const Callables *c;
+	Ring *ring;
+} Frontend;
+
+// Moves the diagnostics pending in the front-end's buffer into rec
+static void record_take_diags(Record *rec, DiagBuffer *b) {
+	if (!b->buf.len) return;
+	rec->diags = b->buf.content;
+	rec->diags_len = b->buf.len;
+	b->buf = (StringBuilder) {0};
+}
+
+// Tokenizes, parses and validates the whole script, moving each
+// valid command's arguments, and the diagnostics of the invalid
+// ones before it, out of the parser into a record
+void *frontend_run(void *arg) {
+	Frontend *fe = arg;
+	while (!lln_cancelled() && parser_next_valid_comm(fe->p, fe->c)) {
+		Record rec = { .callable = fe->p->comm.callable, .args = fe->p->comm.args };
+		fe->p->comm.args = (Args) {0};
+		record_take_diags(&rec, fe->p->diags);
+		ring_push(fe->ring, rec);
+	}
+	Record end = {0};
+	record_take_diags(&end, fe->p->diags);
+	ring_push(fe->ring, end);
+	return NULL;
+}
+
+// Runs the commands validated by a front-end thread. Returns
+// false if the thread couldn't start, before running anything.
+bool execute_pipelined(Parser *p, const Callables *c, Executor *e, size_t lookahead) {
+	size_t cap = 2;
+	while (cap < lookahead) cap *= 2;
+	Ring ring = { .items = mem_alloc(MEM_OTHER, cap * sizeof(Record)), .mask = cap - 1 };
+	if (!ring.items) return false;
+	// the front-end formats diagnostics into its own buffer, never
+	// written out: they reach diags with the record they precede
+	DiagBuffer *diags = p->diags;
+	DiagBuffer pending = { .json = diags->json, .max = diags->max, .reported = diags->reported, .suppressed = diags->suppressed };
+	p->diags = &pending;
+	Frontend fe = { .p = p, .c = c, .ring = &ring };
+	pthread_t frontend;
+	if (pthread_create(&frontend, NULL, frontend_run, &fe) != 0) {
+		p->diags = diags;
+		mem_free(ring.items);
+		return false;
+	}
+	for (;;) {
+		Record rec = ring_pop(&ring);
+		// once cancelled, the records still queued are only freed
+		if (rec.diags_len && !lln_cancelled()) sb_append_bytes(&diags->buf, rec.diags, rec.diags_len);
+		mem_free(rec.diags);
+		if (!rec.callable) break;
+		Comm comm = { .args = rec.args, .f = rec.callable->fnptr, .callable = rec.callable };
+		if (!lln_cancelled()) {
+			diag_buffer_flush(diags);
+			dispatch(e, &comm);
+		}
+		args_free(&comm.args);
+	}
+	pthread_join(frontend, NULL);
+	diags->reported = pending.reported;
+	diags->suppressed = pending.suppressed;
+	p->diags = diags;
+	mem_free(pending.buf.content);
+	mem_free(ring.items);
+	return true;
+}
+
+// ----- parallel lexing -----
+
+// A command parsed by a chunk
+typedef struct {
+	size_t tok; // index of its name token
+	size_t end; // token the parser went on from after it
+	Record rec; // callable NULL if it is invalid
+	size_t diag_end; // diagnostics to print before it end at diag_ends[diag_end - 1]
+} ChunkComm;
+
+// A slice of the script, starting at a line, lexed and then parsed and
+// validated on its own thread. Both passes first assume that no token or
+// command runs into the slice from the one before, which is checked and
+// redone serially if wrong, so that the results match the serial lexer.
+typedef struct {
+	const char *content;
+	const char *filename;
+	const Callables *c;
+	size_t start, end; // bytes
+	size_t newlines; // in [start, end)
+
+	Tokens toks; // moved to the script's tokens once all are lexed
+	size_t tok_end; // end of the last token, past end if it runs over
+	size_t tok_from, tok_to; // in the script's tokens
+	const Tokens *all;
+
+	struct {
+		ChunkComm *items;
+		size_t count;
+		size_t capacity;
+	} comms;
+	size_t first; // first of comms in sync with the chunk before
+	size_t next; // token the last command's parser went on from
+	size_t row, line_start, prev_line_start; // at start
+	bool json;
+	StringBuilder diags; // formatted like the run's
+	struct {
+		size_t *items; // end of each diagnostic in diags
+		size_t count;
+		size_t capacity;
+	} diag_ends;
+} Chunk;
+
+static void *chunk_lex(void *arg) {
+	Chunk *ch = arg;
+	ch->tok_end = tokenize_until(ch->content, ch->start, ch->end, &ch->toks);
+	const char *nl = ch->content + ch->start;
+	const char *end = ch->content + ch->end;
+	while ((nl = memchr(nl, '\n', end - nl))) ch->newlines++, nl++;
+	return NULL;
+}
+
+static void chunk_diag(void *ctx, const Diag *d) {
+	Chunk *ch = ctx;
+	if (ch->json) sb_append_diag_json(&ch->diags, d);
+	else sb_append_diag(&ch->diags, d);
+	da_append(&ch->diag_ends, ch->diags.len);
+}
+
+static void chunk_comms_free(Chunk *ch, size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) args_free(&ch->comms.items[i].rec.args);
+}
+
+// Parses and validates the commands whose name is a token in
+// [from, tok_to), the last one maybe running past it
+static void chunk_parse_from(Chunk *ch, size_t from) {
+	Parser p;
+	parser_init(&p, ch->content, ch->filename);
+	p.toks = *ch->all;
+	p.tokenized = true;
+	p.next = from;
+	p.row = ch->row;
+	p.line_off = p.line_start = ch->line_start;
+	p.prev_line_start = ch->prev_line_start;
+	while (p.next < ch->tok_to) {
+		if ((p.toks.kind[p.next++] & ~TOK_ESCAPED) != TOK_COMMAND) continue;
+		ChunkComm cc = { .tok = p.next - 1 };
+		Comm *comm = parse_command(&p);
+		LLN_PROBE(cmd_parsed, comm->name, comm->args.count, comm->loc.row);
+		if (validate_command_diag(comm, ch->c, chunk_diag, ch)) {
+			LLN_PROBE(cmd_valid, comm->name, comm->args.count, comm->loc.row);
+			cc.rec = (Record) { .callable = comm->callable, .args = comm->args };
+			comm->args = (Args) {0};
+		} else {
+			LLN_PROBE(cmd_invalid, comm->name, comm->args.count, comm->loc.row);
+		}
+		cc.end = p.next;
+		cc.diag_end = ch->diag_ends.count;
+		da_append(&ch->comms, cc);
+	}
+	ch->next = p.next > ch->tok_to ? p.next : ch->tok_to;
+	comm_free(&p.comm);
+	mem_free(p.name.content);
+}
+
+static void *chunk_parse(void *arg) {
+	Chunk *ch = arg;
+	chunk_parse_from(ch, ch->tok_from);
+	return NULL;
+}
+
+// Runs f on every chunk, on a thread each but the first
+static bool chunks_run(Chunk *chunks, size_t n, void *(*f)(void *)) {
+	pthread_t *threads = mem_alloc(MEM_OTHER, n * sizeof(pthread_t));
+	if (!threads) return false;
+	size_t started = 1;
+	for (; started < n; started++) {
+		if (pthread_create(&threads[started], NULL, f, &chunks[started]) != 0) break;
+	}
+	// chunks whose thread didn't start are run here instead
+	for (size_t i = started; i < n; i++) f(&chunks[i]);
+	f(&chunks[0]);
+	for (size_t i = 1; i < started; i++) pthread_join(threads[i], NULL);
+	mem_free(threads);
+	return true;
+}
+
+// Splits the script at line starts, in at most threads chunks of at
+// least chunk_min bytes. Returns how many there are.
+static size_t chunks_split(Parser *p, const Callables *c, size_t threads, size_t chunk_min, Chunk **out) {
+	size_t len = strlen(p->content);
+	size_t n = len / chunk_min;
+	if (n > threads) n = threads;
+	if (n < 2) return 0;
+	Chunk *chunks = mem_calloc(n, sizeof(Chunk));
+	if (!chunks) return 0;
+	size_t count = 0;
+	size_t start = 0;
+	for (size_t i = 0; i < n && start < len; i++) {
+		size_t end = len;
+		if (i + 1 < n) {
+			const char *nl = memchr(p->content + len / n * (i + 1), '\n', len - len / n * (i + 1));
+			end = nl ? (size_t) (nl + 1 - p->content) : len;
+		}
+		if (end <= start) continue;
+		chunks[count++] = (Chunk) {
+			.content = p->content,
+			.filename = p->filename,
+			.c = c,
+			.start = start,
+			.end = end,
+			.json = p->diags && p->diags->json,
+		};
+		start = end;
+	}
+	*out = chunks;
+	return count;
+}
+
+// Lexes every chunk in parallel, then redoes serially the chunks that a
+// token runs into, and gathers all tokens in the parser
+static bool chunks_lex(Parser *p, Chunk *chunks, size_t n) {
+	if (!chunks_run(chunks, n, chunk_lex)) return false;
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		Chunk *ch = &chunks[i];
+		if (i > 0 && chunks[i - 1].tok_end > ch->start) {
+			tokens_free(&ch->toks);
+			size_t from = chunks[i - 1].tok_end;
+			ch->tok_end = tokenize_until(p->content, from, ch->end, &ch->toks);
+		}
+		count += ch->toks.count;
+	}
+	Tokens *all = &p->toks;
+	*all = (Tokens) {
+		.offset = mem_alloc(MEM_TOKENS, count * sizeof(uint32_t)),
+		.len = mem_alloc(MEM_TOKENS, count * sizeof(uint32_t)),
+		.kind = mem_alloc(MEM_TOKENS, count * sizeof(uint8_t)),
+		.capacity = count,
+	};
+	p->tokenized = true;
+	if (count > 0 && (!all->offset || !all->len || !all->kind)) return false;
+	for (size_t i = 0; i < n; i++) {
+		Chunk *ch = &chunks[i];
+		ch->tok_from = all->count;
+		if (ch->toks.count > 0) {
+			memcpy(all->offset + all->count, ch->toks.offset, ch->toks.count * sizeof(uint32_t));
+			memcpy(all->len + all->count, ch->toks.len, ch->toks.count * sizeof(uint32_t));
+			memcpy(all->kind + all->count, ch->toks.kind, ch->toks.count * sizeof(uint8_t));
+		}
+		all->count += ch->toks.count;
+		ch->tok_to = all->count;
+		ch->all = all;
+		tokens_free(&ch->toks);
+	}
+	return true;
+}
+
+// Parses and validates every chunk in parallel, then drops or redoes
+// serially the commands that the last command of the chunk before
+// took tokens from
+static bool chunks_parse(Chunk *chunks, size_t n) {
+	size_t row = 1;
+	for (size_t i = 0; i < n; i++) {
+		Chunk *ch = &chunks[i];
+		ch->row = row;
+		ch->line_start = ch->start;
+		ch->prev_line_start = SIZE_MAX;
+		if (i > 0) {
+			// the chunk starts right after a newline
+			const char *prev = ch->content + ch->start - 1;
+			while (prev > ch->content && prev[-1] != '\n') prev--;
+			ch->prev_line_start = prev - ch->content;
+		}
+		row += ch->newlines;
+	}
+	if (!chunks_run(chunks, n, chunk_parse)) return false;
+	for (size_t i = 1; i < n; i++) {
+		Chunk *ch = &chunks[i];
+		size_t from = chunks[i - 1].next;
+		if (from == ch->tok_from) continue;
+		// in sync from the first command the serial parser would reach
+		size_t k = 0;
+		while (k < ch->comms.count && ch->comms.items[k].tok < from) k++;
+		bool in_sync = k < ch->comms.count && (k == 0 || ch->comms.items[k - 1].end <= from);
+		if (in_sync) {
+			chunk_comms_free(ch, 0, k);
+			ch->first = k;
+			continue;
+		}
+		chunk_comms_free(ch, 0, ch->comms.count);
+		ch->comms.count = 0;
+		ch->first = 0;
+		ch->diags.len = 0;
+		ch->diag_ends.count = 0;
+		chunk_parse_from(ch, from);
+	}
+	return true;
+}
+
+static void chunks_free(Chunk *chunks, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		Chunk *ch = &chunks[i];
+		tokens_free(&ch->toks);
+		chunk_comms_free(ch, ch->first, ch->comms.count);
+		mem_free(ch->comms.items);
+		mem_free(ch->diags.content);
+		mem_free(ch->diag_ends.items);
+	}
+	mem_free(chunks);
+}
+
+// Lexes and validates the whole script on up to threads threads, then
+// runs its commands. Returns false if the script is too small to split
+// or a thread couldn't start, before running anything.
+bool execute_parallel(Parser *p, const Callables *c, Executor *e, size_t threads, size_t chunk_min) {
+	Chunk *chunks;
+	size_t n = chunks_split(p, c, threads, chunk_min, &chunks);
+	if (n == 0) return false;
+	if (n < 2 || !chunks_lex(p, chunks, n) || !chunks_parse(chunks, n)) {
+		// nothing was printed or run yet, the serial parser starts over
+		tokens_free(&p->toks);
+		p->tokenized = false;
+		chunks_free(chunks, n);
+		return false;
+	}
+	for (size_t i = 0; i < n; i++) {
+		Chunk *ch = &chunks[i];
+		size_t diag_from = ch->first > 0 ? ch->comms.items[ch->first - 1].diag_end : 0;
+		for (size_t k = ch->first; k < ch->comms.count; k++) {
+			ChunkComm *cc = &ch->comms.items[k];
+			if (lln_cancelled()) continue;
+			for (; diag_from < cc->diag_end; diag_from++) {
+				size_t start = diag_from > 0 ? ch->diag_ends.items[diag_from - 1] : 0;
+				diag_buffer_push_formatted(p->diags, ch->diags.content + start, ch->diag_ends.items[diag_from] - start);
+			}
+			if (!cc->rec.callable) continue;
+			diag_buffer_flush(p->diags);
+			Comm comm = { .args = cc->rec.args, .f = cc->rec.callable->fnptr, .callable = cc->rec.callable };
+			dispatch(e, &comm);
+		}
+	}
+	p->next = p->toks.count;
+	chunks_free(chunks, n);
+	return true;
+}
+
+// ----- execution -----
+
+// Sets the memo up, runs pre() and starts the watchdog
+static void executor_start(Executor *e, const Callables *c, const RunOptions *opts, Recorder *rec) {
+	*e = (Executor) { .rec = rec };
+	if (!opts->no_memo) {
+		memo_init(&e->memo, c, opts->memo_size ? opts->memo_size : LLN_MEMO_SIZE);
+		if (e->memo.max > 0 && opts->memo_path) memo_load(&e->memo, opts->memo_path);
+	}
+	if (c->pre) {
+		uint64_t start = LLN_PROBE_START(pre_return);
+		LLN_PROBE(pre_entry);
+		c->pre();
+		LLN_PROBE(pre_return, LLN_PROBE_NS(start));
+	}
+	watchdog_start(c, opts);
+}
+
+// Runs the batch left, stops the watchdog, runs post() and saves the memo.
+// Returns true if the run ran out of time.
+static bool executor_finish(Executor *e, const Callables *c, const RunOptions *opts) {
+	batcher_free(&e->batch);
+	watchdog_stop();
+	if (c->post) {
+		uint64_t start = LLN_PROBE_START(post_return);
+		LLN_PROBE(post_entry);
+		c->post();
+		LLN_PROBE(post_return, LLN_PROBE_NS(start));
+	}
+	if (e->memo.max > 0 && opts->memo_path) memo_save(&e->memo, opts->memo_path);
+	memo_free(&e->memo);
+	return lln_cancelled();
+}
+
+// Returns true if the script ran out of time
+bool execute(Parser *p, const Callables *c, const RunOptions *opts, Recorder *rec) {
+	Executor e;
+	executor_start(&e, c, opts, rec);
+	DiagBuffer diags = { .out = stderr, .json = opts->json_diags, .max = opts->max_errors };
+	p->diags = &diags;
 	if (c->count > 0) {
-		while(lexer_next_valid_comm(l, c)) l->comm.f(l->comm.args);
+		size_t lookahead = opts->lookahead ? opts->lookahead : LLN_PIPELINE_LOOKAHEAD;
+		size_t chunk_min = opts->lex_chunk ? opts->lex_chunk : LLN_LEX_CHUNK_MIN;
+		bool done = opts->lex_threads > 1 && execute_parallel(p, c, &e, opts->lex_threads, chunk_min);
+		if (!done && (!opts->pipelined || !execute_pipelined(p, c, &e, lookahead))) {
+			while(!lln_cancelled() && parser_next_valid_comm(p, c)) dispatch(&e, &p->comm);
+		}
 	}
-	if (c->post) c->post();
+	diag_buffer_end(&diags, p->filename);
+	mem_free(diags.buf.content);
+	p->diags = NULL;
+	return executor_finish(&e, c, opts);
+}
+
+int run_lln_file_opts(const char *filename, const Callables *c, const RunOptions *opts) {
+	RunOptions defaults = {0};
+	if (!opts) opts = &defaults;
+	if (opts->mem_stats) mem_count(true);
+	StringBuilder file = {0};
+	Parser p;
+	Recorder rec;
+	int ret = -1;
+	if (!read_whole_file(&file, filename)) goto done;
+	if (file.len > UINT32_MAX) {
+		fprintf(stderr, "ERROR: '%s' is larger than the 4 GiB a script may be.\n", filename);
+		goto done;
+	}
+	if (opts->record_path && !recorder_open(&rec, opts->record_path, c)) goto done;
+	LLN_PROBE(script_load, filename, file.len);
+	parser_init(&p, file.content, filename);
+	ret = execute(&p, c, opts, opts->record_path ? &rec : NULL) ? LLN_EXIT_TIMEOUT : 0;
+	parser_free(&p);
+	if (opts->record_path && !recorder_close(&rec)) ret = -1;
+done:
+	mem_free(file.content);
+	if (opts->mem_stats) {
+		MemStats s = mem_stats();
+		mem_count(false);
+		fprint_mem_stats(stderr, filename, &s);
+	}
+	return ret;
 }
 
 void run_lln_file(const char *filename, const Callables *c) {
+	run_lln_file_opts(filename, c, NULL);
+}
+
+// ----- replay -----
+
+typedef struct {
+	const uint8_t *cur, *end;
+	bool bad; // truncated, or a value out of range
+} TraceReader;
+
+static uint64_t trace_varint(TraceReader *r) {
+	uint64_t v = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (r->cur == r->end) break;
+		uint8_t b = *r->cur++;
+		v |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80)) return v;
+	}
+	r->bad = true;
+	return 0;
+}
+
+// NULL if fewer than n bytes are left
+static const void *trace_bytes(TraceReader *r, uint64_t n) {
+	if ((uint64_t) (r->end - r->cur) < n) {
+		r->bad = true;
+		return NULL;
+	}
+	const void *bytes = r->cur;
+	r->cur += n;
+	return bytes;
+}
+
+static Arg trace_arg(TraceReader *r, ArgType t) {
+	Arg a = { .type = t };
+	const void *bytes;
+	switch (t) {
+		case ARG_INT: {
+			int64_t v = unzigzag(trace_varint(r));
+			if (v < INT_MIN || v > INT_MAX) r->bad = true;
+			a.value.i = (int) v;
+			break;
+		}
+		case ARG_I64: a.value.l = unzigzag(trace_varint(r)); break;
+		case ARG_FLT: if ((bytes = trace_bytes(r, sizeof(float)))) memcpy(&a.value.f, bytes, sizeof(float)); break;
+		case ARG_DBL: if ((bytes = trace_bytes(r, sizeof(double)))) memcpy(&a.value.d, bytes, sizeof(double)); break;
+		case ARG_BOOL: if ((bytes = trace_bytes(r, 1))) a.value.b = *(const uint8_t *) bytes != 0; break;
+		case ARG_STR: {
+			uint64_t len = trace_varint(r);
+			if (!(bytes = trace_bytes(r, len)) || !(a.value.s = mem_alloc(MEM_ARGS, len + 1))) break;
+			memcpy(a.value.s, bytes, len);
+			a.value.s[len] = '\0';
+			break;
+		}
+		default: {
+			uint64_t count = trace_varint(r);
+			size_t item = arr_item_size(t);
+			if (count > SIZE_MAX / item || !(bytes = trace_bytes(r, count * item))) break;
+			if (!(a.value.arr.items = arr_alloc(count, item))) break;
+			memcpy(a.value.arr.items, bytes, count * item);
+			a.value.arr.count = count;
+		}
+	}
+	return a;
+}
+
+// Maps the id of a TRACE_COMMAND, the next one, to the command of that
+// name in c, which must take the same arguments. false if there is none.
+static bool trace_command(TraceReader *r, const Callables *c, const char *filename, const Callable ***ids, size_t *count, size_t *capacity) {
+	uint64_t id = trace_varint(r);
+	uint64_t len = trace_varint(r);
+	const char *name = trace_bytes(r, len);
+	uint64_t argc = trace_varint(r);
+	const uint8_t *types = trace_bytes(r, argc);
+	if (r->bad || id != *count) {
+		r->bad = true;
+		return false;
+	}
+	StringBuilder sb = {0};
+	sb_append_strn(&sb, name, len);
+	sb_term(&sb);
+	const Callable *callable = name_to_callable(sb.content, c);
+	bool same = callable && callable->signature.count == argc;
+	for (size_t i = 0; same && i < argc; i++) same = callable->signature.items[i] == (ArgType) types[i];
+	if (!same) {
+		fprintf(stderr, "ERROR: '%s': command '%s' %s.\n", filename, sb.content,
+			callable ? "takes other arguments than it was recorded with" : "doesn't exist");
+		mem_free(sb.content);
+		return false;
+	}
+	mem_free(sb.content);
+	if (*count == *capacity) {
+		size_t n = *capacity ? *capacity * 2 : LLN_DEF_CAP;
+		const Callable **temp = mem_realloc(MEM_OTHER, *ids, n * sizeof(Callable *));
+		if (!temp) {
+			r->bad = true;
+			return false;
+		}
+		*ids = temp;
+		*capacity = n;
+	}
+	(*ids)[(*count)++] = callable;
+	return true;
+}
+
+// Waits until the call that started at ns into the recording is due
+static void trace_wait(uint64_t start, uint64_t ns, double scale) {
+	uint64_t due = start + (uint64_t) (ns * scale);
+	if (lln_probe_now_ns() >= due) return;
+	struct timespec t = { .tv_sec = due / 1000000000u, .tv_nsec = due % 1000000000u };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {}
+}
+
+int replay_trace(const char *filename, const Callables *c, const RunOptions *opts) {
+	RunOptions defaults = {0};
+	if (!opts) opts = &defaults;
+	if (opts->mem_stats) mem_count(true);
 	StringBuilder file = {0};
-	Lexer l = {0};
-	read_whole_file(&file, filename);
-	lexer_init(&l, file.content, filename);
-	execute(&l, c);
-	free(file.content);
-	lexer_free(&l);
+	Recorder rec;
+	int ret = -1;
+	if (!read_whole_file(&file, filename)) goto done;
+	TraceReader r = { .cur = (const uint8_t *) file.content, .end = (const uint8_t *) file.content + file.len };
+	const void *magic = trace_bytes(&r, 4);
+	if (!magic || memcmp(magic, TRACE_MAGIC, 4) != 0 || trace_varint(&r) != TRACE_VERSION) {
+		fprintf(stderr, "ERROR: '%s' is not a trace of this version of lln.\n", filename);
+		goto done;
+	}
+	if (opts->record_path && !recorder_open(&rec, opts->record_path, c)) goto done;
+
+	Executor e;
+	executor_start(&e, c, opts, opts->record_path ? &rec : NULL);
+	const Callable **ids = NULL;
+	size_t id_count = 0, id_capacity = 0;
+	Args args = {0};
+	bool ok = true;
+	uint64_t start = lln_probe_now_ns(), at = 0;
+	while (ok && r.cur < r.end && !lln_cancelled()) {
+		uint8_t kind = *r.cur++;
+		if (kind == TRACE_COMMAND) {
+			ok = trace_command(&r, c, filename, &ids, &id_count, &id_capacity);
+			continue;
+		}
+		uint64_t id = kind == TRACE_CALL ? trace_varint(&r) : UINT64_MAX;
+		const Callable *callable = id < id_count ? ids[id] : NULL;
+		if (!callable) {
+			r.bad = true;
+			break;
+		}
+		at += trace_varint(&r);
+		for (size_t i = 0; i < callable->signature.count && !r.bad; i++) {
+			Arg a = trace_arg(&r, callable->signature.items[i]);
+			da_append(&args, a);
+		}
+		trace_varint(&r); // how long it took
+		if (r.bad) break;
+		if (opts->replay_scale > 0) trace_wait(start, at, opts->replay_scale);
+		Comm comm = { .args = args, .f = callable->fnptr, .callable = callable };
+		dispatch(&e, &comm);
+		args_clear(&args);
+	}
+	if (r.bad) fprintf(stderr, "ERROR: '%s' is truncated or corrupt at byte %zu.\n", filename, (size_t) ((const char *) r.cur - file.content));
+	args_free(&args);
+	mem_free(ids);
+	bool timed_out = executor_finish(&e, c, opts);
+	ret = ok && !r.bad ? (timed_out ? LLN_EXIT_TIMEOUT : 0) : -1;
+	if (opts->record_path && !recorder_close(&rec)) ret = -1;
+done:
+	mem_free(file.content);
+	if (opts->mem_stats) {
+		MemStats s = mem_stats();
+		mem_count(false);
+		fprint_mem_stats(stderr, filename, &s);
+	}
+	return ret;
+}
+
+// ----- shared-memory transport -----
+
+// The mapping is a header page, then the ring of scripts, then the ring of
+// records. Each ring has a single writer and a single reader, and holds
+// frames that never wrap around its end: a frame that doesn't fit before
+// the end comes after a padding frame up to it.
+
+#define SHM_MAGIC 0x524e4c4c // "LLNR"
+#define SHM_VERSION 2
+#define SHM_HEADER 4096
+#define SHM_RING_MIN 4096
+#define SHM_RING_MAX (1u << 30)
+
+enum {
+	SHM_FRAME_PAD,
+	SHM_FRAME_SCRIPT,
+	SHM_FRAME_RECORD,
+};
+
+typedef struct {
+	// bytes read, only moved by the reader; the writer sleeps on it when full
+	_Alignas(64) _Atomic uint32_t head;
+	_Atomic uint32_t head_waiting;
+	// bytes written, only moved by the writer; the reader sleeps on it when empty
+	_Alignas(64) _Atomic uint32_t tail;
+	_Atomic uint32_t tail_waiting;
+} ShmRing;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sub_size; // ring of scripts
+	uint32_t comp_size; // ring of records
+	_Atomic uint32_t closed; // no more scripts
+	_Atomic uint32_t done; // the executor exited
+	_Atomic uint32_t detached; // the client stopped reading records
+	ShmRing sub;
+	ShmRing comp;
+} ShmHeader;
+
+// A script in the ring, NUL-terminated
+typedef struct {
+	uint32_t size;
+	uint32_t kind;
+	uint32_t id;
+	uint32_t len;
+} ShmScript;
+
+struct lln_Shm {
+	int fd;
+	size_t map_size;
+	ShmHeader *h;
+	uint8_t *sub;
+	uint8_t *comp;
+	uint32_t next_id; // of the next script, on the client side
+	uint32_t reserved; // bytes the last reserve pads before its frame
+	uint32_t record_size; // of the last record returned, freed by the next call
+};
+
+static_assert(sizeof(ShmHeader) <= SHM_HEADER, "ShmHeader doesn't fit its page");
+static_assert(sizeof(ShmScript) % 8 == 0 && sizeof(lln_ShmRecord) % 8 == 0, "frames are 8-byte aligned");
+
+static inline uint32_t shm_align(size_t n) {
+	return (uint32_t) ((n + 7) & ~(size_t) 7);
+}
+
+static inline void futex_wait(_Atomic uint32_t *word, uint32_t seen) {
+	syscall(SYS_futex, word, FUTEX_WAIT, seen, NULL, NULL, 0);
+}
+
+static inline void futex_wake(_Atomic uint32_t *word) {
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Waits until *word isn't seen anymore, or stop is set. Spins a little
+// first, then sleeps with waiting set, so that the other side only makes
+// a syscall to wake it when someone sleeps.
+static void shm_wait(_Atomic uint32_t *word, uint32_t seen, _Atomic uint32_t *waiting, _Atomic uint32_t *stop) {
+	for (unsigned spins = 0; spins < 256; spins++) {
+		if (atomic_load(word) != seen || atomic_load(stop)) return;
+#if defined(__SSE2__)
+		_mm_pause();
+#endif // __SSE2__
+	}
+	atomic_store(waiting, 1);
+	while (atomic_load(word) == seen && !atomic_load(stop)) futex_wait(word, seen);
+	atomic_store(waiting, 0);
+}
+
+static inline void shm_publish(_Atomic uint32_t *word, uint32_t value, _Atomic uint32_t *waiting) {
+	atomic_store(word, value);
+	if (atomic_load(waiting)) futex_wake(word);
+}
+
+// Space for a frame of n bytes at the tail of the ring, after a padding
+// frame if it doesn't fit before the end. Waits for the reader to free
+// enough, unless stop is set. NULL if it can never fit: frames take at
+// most half the ring, so that one always fits with its padding once the
+// ring is empty.
+static void *shm_ring_reserve(ShmRing *r, uint8_t *data, uint32_t size, uint32_t n, uint32_t *pad, _Atomic uint32_t *stop) {
+	if (n > size / 2) return NULL;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t off = tail & (size - 1);
+	*pad = size - off < n ? size - off : 0;
+	if (*pad + n > size) return NULL;
+	while (1) {
+		uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+		if (size - (tail - head) >= *pad + n) break;
+		if (atomic_load(stop)) return NULL;
+		shm_wait(&r->head, head, &r->head_waiting, stop);
+	}
+	if (*pad) {
+		*(uint32_t *) (data + off) = *pad;
+		((uint32_t *) (data + off))[1] = SHM_FRAME_PAD;
+		off = 0;
+	}
+	return data + off;
+}
+
+// Frame at the head of the ring, padding skipped, waiting for one unless
+// stop is set (or for nothing if !wait). NULL if there is none.
+static void *shm_ring_peek(ShmRing *r, uint8_t *data, uint32_t size, bool wait, _Atomic uint32_t *stop) {
+	while (1) {
+		uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+		uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head == tail) {
+			if (!wait || atomic_load(stop)) {
+				// the writer may have published right before stopping
+				if (atomic_load_explicit(&r->tail, memory_order_acquire) != head) continue;
+				return NULL;
+			}
+			shm_wait(&r->tail, tail, &r->tail_waiting, stop);
+			continue;
+		}
+		uint32_t *frame = (uint32_t *) (data + (head & (size - 1)));
+		if (frame[1] != SHM_FRAME_PAD) return frame;
+		shm_publish(&r->head, head + frame[0], &r->head_waiting);
+	}
+}
+
+static inline void shm_ring_pop(ShmRing *r, uint32_t n) {
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	shm_publish(&r->head, head + n, &r->head_waiting);
+}
+
+static inline uint32_t shm_ring_size(size_t n) {
+	uint32_t size = SHM_RING_MIN;
+	while (size < n && size < SHM_RING_MAX) size *= 2;
+	return size;
+}
+
+static lln_Shm *shm_map(int fd, size_t map_size) {
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) return NULL;
+	lln_Shm *shm = mem_calloc(1, sizeof(lln_Shm));
+	if (!shm) {
+		munmap(map, map_size);
+		return NULL;
+	}
+	shm->fd = fd;
+	shm->map_size = map_size;
+	shm->h = map;
+	shm->sub = (uint8_t *) map + SHM_HEADER;
+	shm->comp = shm->sub + shm->h->sub_size;
+	return shm;
+}
+
+lln_Shm *shm_create(size_t sub_size, size_t comp_size) {
+	uint32_t sub = shm_ring_size(sub_size), comp = shm_ring_size(comp_size);
+	size_t map_size = (size_t) SHM_HEADER + sub + comp;
+	int fd = memfd_create("lln-shm", 0);
+	if (fd < 0) return NULL;
+	if (ftruncate(fd, map_size) != 0) {
+		close(fd);
+		return NULL;
+	}
+	ShmHeader h = { .magic = SHM_MAGIC, .version = SHM_VERSION, .sub_size = sub, .comp_size = comp };
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+		close(fd);
+		return NULL;
+	}
+	lln_Shm *shm = shm_map(fd, map_size);
+	if (!shm) close(fd);
+	return shm;
+}
+
+lln_Shm *shm_attach(int fd) {
+	struct stat st;
+	ShmHeader h;
+	if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h)) return NULL;
+	bool pow2 = h.sub_size && h.comp_size && !(h.sub_size & (h.sub_size - 1)) && !(h.comp_size & (h.comp_size - 1));
+	if (h.magic != SHM_MAGIC || h.version != SHM_VERSION || !pow2
+		|| (size_t) st.st_size != (size_t) SHM_HEADER + h.sub_size + h.comp_size) return NULL;
+	return shm_map(fd, st.st_size);
+}
+
+int shm_fd(const lln_Shm *shm) {
+	return shm->fd;
+}
+
+char *shm_reserve(lln_Shm *shm, size_t n) {
+	if (n >= SHM_RING_MAX) return NULL;
+	uint32_t size = shm_align(sizeof(ShmScript) + n + 1);
+	ShmScript *f = shm_ring_reserve(&shm->h->sub, shm->sub, shm->h->sub_size, size, &shm->reserved, &shm->h->done);
+	if (!f) return NULL;
+	*f = (ShmScript) { .size = size, .kind = SHM_FRAME_SCRIPT };
+	return (char *) (f + 1);
+}
+
+uint32_t shm_commit(lln_Shm *shm, size_t n) {
+	ShmRing *r = &shm->h->sub;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	ShmScript *f = (ShmScript *) (shm->sub + ((tail + shm->reserved) & (shm->h->sub_size - 1)));
+	assert(shm_align(sizeof(ShmScript) + n + 1) <= f->size);
+	f->id = shm->next_id++;
+	f->len = (uint32_t) n;
+	((char *) (f + 1))[n] = '\0';
+	shm_publish(&r->tail, tail + shm->reserved + f->size, &r->tail_waiting);
+	return f->id;
+}
+
+uint32_t shm_submit(lln_Shm *shm, const char *script, size_t n) {
+	char *dst = shm_reserve(shm, n);
+	if (!dst) return UINT32_MAX;
+	memcpy(dst, script, n);
+	return shm_commit(shm, n);
+}
+
+const lln_ShmRecord *shm_next(lln_Shm *shm, bool wait) {
+	if (shm->record_size) {
+		shm_ring_pop(&shm->h->comp, shm->record_size);
+		shm->record_size = 0;
+	}
+	lln_ShmRecord *rec = shm_ring_peek(&shm->h->comp, shm->comp, shm->h->comp_size, wait, &shm->h->done);
+	if (rec) shm->record_size = rec->size;
+	return rec;
+}
+
+void shm_close(lln_Shm *shm) {
+	atomic_store(&shm->h->closed, 1);
+	futex_wake(&shm->h->sub.tail);
+}
+
+void shm_free(lln_Shm *shm) {
+	if (!shm) return;
+	// an executor waiting for room for its records gives up on them
+	atomic_store(&shm->h->detached, 1);
+	futex_wake(&shm->h->comp.head);
+	munmap(shm->h, shm->map_size);
+	close(shm->fd);
+	mem_free(shm);
+}
+
+// Payload of the command being served, NULL outside of lln_shm_serve
+static StringBuilder *g_result;
+
+void set_result(const void *data, size_t n) {
+	if (!g_result) return;
+	g_result->len = 0;
+	sb_append_bytes(g_result, data, n);
+}
+
+// Writes a record to the ring, its payload cut to what a frame can hold.
+// Dropped if the client stopped reading them.
+static void shm_record(lln_Shm *shm, lln_ShmRecord rec, const void *payload) {
+	uint32_t max = shm->h->comp_size / 2 - sizeof(lln_ShmRecord);
+	if (rec.payload_len > max) rec.payload_len = max;
+	rec.size = shm_align(sizeof(lln_ShmRecord) + rec.payload_len);
+	rec.kind = SHM_FRAME_RECORD;
+	ShmRing *r = &shm->h->comp;
+	uint32_t pad;
+	lln_ShmRecord *dst = shm_ring_reserve(r, shm->comp, shm->h->comp_size, rec.size, &pad, &shm->h->detached);
+	if (!dst) return;
+	*dst = rec;
+	if (rec.payload_len) memcpy(dst + 1, payload, rec.payload_len);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	shm_publish(&r->tail, tail + pad + rec.size, &r->tail_waiting);
+}
+
+// Runs a script where it is in the ring, recording every command
+static void shm_serve_script(lln_Shm *shm, const Callables *c, const RunOptions *opts, Executor *e, ShmScript *f) {
+	char *content = (char *) (f + 1);
+	content[f->len] = '\0'; // the client's NUL, in case it was overwritten
+	char name[32];
+	snprintf(name, sizeof(name), "<script %" PRIu32 ">", f->id);
+	StringBuilder result = {0};
+	DiagBuffer diags = { .json = opts->json_diags };
+	uint64_t script_start = lln_probe_now_ns();
+	LLN_PROBE(script_load, name, (size_t) f->len);
+
+	Parser p;
+	parser_init(&p, content, name);
+	if (c->pre) {
+		uint64_t start = LLN_PROBE_START(pre_return);
+		LLN_PROBE(pre_entry);
+		c->pre();
+		LLN_PROBE(pre_return, LLN_PROBE_NS(start));
+	}
+	watchdog_start(c, opts);
+	uint32_t index = 0;
+	for (Comm *comm; !lln_cancelled() && (comm = parser_next_command(&p)); index++) {
+		lln_ShmRecord rec = { .script = f->id, .index = index };
+		LLN_PROBE(cmd_parsed, comm->name, comm->args.count, comm->loc.row);
+		diags.buf.len = 0;
+		if (!validate_command_diag(comm, c, diag_buffer_push, &diags)) {
+			LLN_PROBE(cmd_invalid, comm->name, comm->args.count, comm->loc.row);
+			rec.status = LLN_SHM_INVALID;
+			rec.payload_len = (uint32_t) diags.buf.len;
+			shm_record(shm, rec, diags.buf.content);
+			continue;
+		}
+		LLN_PROBE(cmd_valid, comm->name, comm->args.count, comm->loc.row);
+		result.len = 0;
+		g_result = &result;
+		uint64_t start = lln_probe_now_ns();
+		dispatch(e, comm);
+		// calls to batch commands can't wait for the next ones, their
+		// record is due now
+		batcher_flush(&e->batch);
+		rec.duration_ns = lln_probe_now_ns() - start;
+		g_result = NULL;
+		rec.status = LLN_SHM_OK;
+		rec.payload_len = (uint32_t) result.len;
+		shm_record(shm, rec, result.content);
+	}
+	watchdog_stop();
+	if (c->post) {
+		uint64_t start = LLN_PROBE_START(post_return);
+		LLN_PROBE(post_entry);
+		c->post();
+		LLN_PROBE(post_return, LLN_PROBE_NS(start));
+	}
+	fflush(stdout);
+	lln_ShmRecord end = {
+		.script = f->id,
+		.index = LLN_SHM_END,
+		.status = lln_cancelled() ? LLN_EXIT_TIMEOUT : 0,
+		.duration_ns = lln_probe_now_ns() - script_start,
+	};
+	shm_record(shm, end, NULL);
+	parser_free(&p);
+	mem_free(diags.buf.content);
+	mem_free(result.content);
+}
+
+int shm_serve(lln_Shm *shm, const Callables *c, const RunOptions *opts) {
+	RunOptions defaults = {0};
+	if (!opts) opts = &defaults;
+	if (!shm || shm->h->magic != SHM_MAGIC) return -1;
+	Executor e = {0};
+	if (!opts->no_memo) {
+		memo_init(&e.memo, c, opts->memo_size ? opts->memo_size : LLN_MEMO_SIZE);
+		if (e.memo.max > 0 && opts->memo_path) memo_load(&e.memo, opts->memo_path);
+	}
+	ShmScript *f;
+	while ((f = shm_ring_peek(&shm->h->sub, shm->sub, shm->h->sub_size, true, &shm->h->closed))) {
+		if (f->kind == SHM_FRAME_SCRIPT) shm_serve_script(shm, c, opts, &e, f);
+		shm_ring_pop(&shm->h->sub, f->size);
+	}
+	batcher_free(&e.batch);
+	if (e.memo.max > 0 && opts->memo_path) memo_save(&e.memo, opts->memo_path);
+	memo_free(&e.memo);
+	atomic_store(&shm->h->done, 1);
+	futex_wake(&shm->h->comp.tail);
+	futex_wake(&shm->h->sub.head);
+	return 0;
 }
 
 // ----- FFI -----
 
+// Called through ctypes by lln-py/lln.py
+
 // globals
 StringBuilder g_file;
-Lexer g_l;
+Parser g_p;
 Comm *g_comm;
 
-void load_file(const char *filename) {
+LLN_API void load_file(const char *filename) {
 	g_file.len = 0;
 	read_whole_file(&g_file, filename);
-	g_l = (Lexer) {0};
-	lexer_init(&g_l, g_file.content, filename);
+	parser_free(&g_p);
+	parser_init(&g_p, g_file.content, filename);
 }
 
-Comm *next_comm(Callables *c) {
-	g_comm = lexer_next_valid_comm(&g_l, c);
+LLN_API Comm *next_comm(Callables *c) {
+	g_comm = parser_next_valid_comm(&g_p, c);
 	return g_comm;
 }
 
@@ -658,7 +3699,7 @@ Callables *load_plugin(char *so_path) {
 	sb_append_cstr(&sb_so_path, so_path);
 	sb_term(&sb_so_path);
 	void *handle = dlopen(sb_so_path.content, RTLD_LAZY | RTLD_LOCAL);
-	free(sb_so_path.content);
+	mem_free(sb_so_path.content);
 	if (!handle) {
 		fprintf(stderr, "%s\n", dlerror());
 		exit(1);
@@ -676,5 +3717,6 @@ Callables *load_plugin(char *so_path) {
 		exit(1);
 	}
 	(*reg_comms)();
+	callables_index(calls);
 	return calls;
 }
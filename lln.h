@@ -7,6 +7,7 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -14,6 +15,12 @@
 #include <stdarg.h>
 #include <ctype.h>
 
+// Symbols of the API. They are the only ones liblln.so exports when it is
+// built with -fvisibility=hidden (release profiles of the Makefile).
+#ifndef LLN_API
+#define LLN_API __attribute__((visibility("default")))
+#endif // LLN_API
+
 // TODO: remove unused
 #ifdef LLN_STRIP_PREFIX
 #define StringBuilder lln_StringBuilder
@@ -26,6 +33,45 @@
 #define sb_new_cstr lln_sb_new_cstr
 #define sb_new_cstrn lln_sb_new_cstrn
 #define run_lln_file lln_run_lln_file
+#define run_lln_file_opts lln_run_lln_file_opts
+#define replay_trace lln_replay_trace
+#define Stream lln_Stream
+#define stream_new lln_stream_new
+#define stream_feed lln_stream_feed
+#define stream_close lln_stream_close
+#define stream_next lln_stream_next
+#define stream_free lln_stream_free
+#define Shm lln_Shm
+#define ShmRecord lln_ShmRecord
+#define ShmStatus lln_ShmStatus
+#define shm_create lln_shm_create
+#define shm_attach lln_shm_attach
+#define shm_fd lln_shm_fd
+#define shm_reserve lln_shm_reserve
+#define shm_commit lln_shm_commit
+#define shm_submit lln_shm_submit
+#define shm_next lln_shm_next
+#define shm_close lln_shm_close
+#define shm_free lln_shm_free
+#define shm_serve lln_shm_serve
+#define set_result lln_set_result
+#define Allocator lln_Allocator
+#define MemSite lln_MemSite
+#define MemStats lln_MemStats
+#define MEM_SB LLN_MEM_SB
+#define MEM_DA LLN_MEM_DA
+#define MEM_ARGS LLN_MEM_ARGS
+#define MEM_TOKENS LLN_MEM_TOKENS
+#define MEM_FILE LLN_MEM_FILE
+#define MEM_OTHER LLN_MEM_OTHER
+#define MEM_SITE_COUNT LLN_MEM_SITE_COUNT
+#define set_allocator lln_set_allocator
+#define mem_alloc lln_mem_alloc
+#define mem_realloc lln_mem_realloc
+#define mem_free lln_mem_free
+#define mem_count lln_mem_count
+#define mem_stats lln_mem_stats
+#define RunOptions lln_RunOptions
 #define Callable lln_Callable
 #define Callables lln_Callables
 #define ArgTypes lln_ArgTypes
@@ -34,17 +80,88 @@
 #define Arg lln_Arg
 #define ArgValue lln_ArgValue
 #define CommandFnPtr lln_CommandFnPtr
+#define GenericFnPtr lln_GenericFnPtr
+#define Batch lln_Batch
+#define BatchFnPtr lln_BatchFnPtr
 #define ARGTYPE_STR LLN_ARGTYPE_STR
 #define Args lln_Args
 #define declare_command LLN_declare_command
+#define declare_batch_command LLN_declare_batch_command
+#define declare_batch_command_custom_name LLN_declare_batch_command_custom_name
 #define register_command LLN_register_command
+#define name_hash lln_name_hash
+#define callables_extend lln_callables_extend
+#define callables_new lln_callables_new
+#define callables_add lln_callables_add
+#define callables_free lln_callables_free
+#define mark_pure LLN_mark_pure
+#define set_timeout LLN_set_timeout
 #define arg_str LLN_arg_str
 #define arg_int LLN_arg_int
 #define arg_flt LLN_arg_flt
 #define arg_bool LLN_arg_bool
+#define arg_i64 LLN_arg_i64
+#define arg_dbl LLN_arg_dbl
+#define arg_int_arr LLN_arg_int_arr
+#define arg_flt_arr LLN_arg_flt_arr
+#define arg_dbl_arr LLN_arg_dbl_arr
+#define arg_blob LLN_arg_blob
+#define arg_len LLN_arg_len
+#define batch_col LLN_batch_col
+#define batch_len LLN_batch_len
 #define declare_command_custom_name LLN_declare_command_custom_name
 #endif // LLN_STRIP_PREFIX
 
+// ----- Allocator -----
+
+// Every allocation of liblln goes through these hooks, malloc and friends
+// by default. An embedder can plug its own allocator in before anything
+// else runs, and must then free what liblln hands out with lln_mem_free.
+typedef struct {
+	// align is 0 for malloc's alignment, or a power of two size is a multiple of
+	void *(*malloc)(void *user, size_t size, size_t align);
+	void *(*realloc)(void *user, void *ptr, size_t size);
+	void (*free)(void *user, void *ptr);
+	// usable size of a block, NULL if unknown: counting leaves bytes out then
+	size_t (*size)(void *user, void *ptr);
+	void *user;
+} lln_Allocator;
+
+// What an allocation is for, in lln_MemStats
+typedef enum {
+	LLN_MEM_SB,     // StringBuilder growth
+	LLN_MEM_DA,     // dynamic arrays (lln_da_append)
+	LLN_MEM_ARGS,   // strings, arrays and blobs parsed from arguments
+	LLN_MEM_TOKENS, // lexed tokens
+	LLN_MEM_FILE,   // scripts read with lln_read_whole_file
+	LLN_MEM_OTHER,
+	LLN_MEM_SITE_COUNT
+} lln_MemSite;
+
+// Counted since lln_mem_count(true)
+typedef struct {
+	size_t allocs; // malloc and realloc calls, by site in sites
+	size_t sites[LLN_MEM_SITE_COUNT];
+	size_t peak_bytes; // most bytes in use at once
+	size_t largest; // bytes of the largest single allocation
+	size_t commands; // commands run
+} lln_MemStats;
+
+// NULL to go back to malloc
+LLN_API void lln_set_allocator(const lln_Allocator *a);
+LLN_API void *lln_mem_alloc(lln_MemSite site, size_t size);
+LLN_API void *lln_mem_realloc(lln_MemSite site, void *ptr, size_t size);
+LLN_API void lln_mem_free(void *ptr);
+// Starts counting allocations from zero, or stops. Counting costs a few
+// atomic additions an allocation, and nothing when it is off.
+LLN_API void lln_mem_count(bool on);
+LLN_API lln_MemStats lln_mem_stats(void);
+
+// realloc of dynamic arrays, liblln's own go through lln_mem_realloc
+#ifndef LLN_DA_REALLOC
+#define LLN_DA_REALLOC(ptr, size) realloc((ptr), (size))
+#endif // LLN_DA_REALLOC
+
 // Generic dynamic arrays for structs with such fields
 // typedef struct {
 //     ...
@@ -58,7 +175,7 @@ static inline int __lln_da_append_helper(void **its, size_t *cnt, size_t *cap, v
 	if (*cnt >= *cap) {
 		if (*cap == 0) *cap = LLN_DEF_CAP;
 		else *cap *= 2;
-		void *temp = realloc(*its, *cap * it_size);
+		void *temp = LLN_DA_REALLOC(*its, *cap * it_size);
 		if (!temp) return -1;
 		*its = temp;
 	}
@@ -74,7 +191,7 @@ typedef struct {
 } lln_StringBuilder;
 
 // returns 0 if success, -1 if failure
-int lln_sb_append(lln_StringBuilder *sb, char c);
+LLN_API int lln_sb_append(lln_StringBuilder *sb, char c);
 
 // NULL-terminate string
 static inline int lln_sb_term(lln_StringBuilder *sb) {
@@ -82,25 +199,31 @@ static inline int lln_sb_term(lln_StringBuilder *sb) {
 }
 
 // append n characters from s
-int lln_sb_append_strn(lln_StringBuilder *sb, const char *s, size_t n);
+LLN_API int lln_sb_append_strn(lln_StringBuilder *sb, const char *s, size_t n);
 
-int lln_sb_append_cstr(lln_StringBuilder *sb, const char *s);
+LLN_API int lln_sb_append_cstr(lln_StringBuilder *sb, const char *s);
 
 // malloc cstr with contents of sb
-char *lln_sb_new_cstr(lln_StringBuilder *sb);
+LLN_API char *lln_sb_new_cstr(lln_StringBuilder *sb);
 
 // malloc cstr with contents of sb up to n chars
-char *lln_sb_new_cstrn(lln_StringBuilder *sb, size_t n);
+LLN_API char *lln_sb_new_cstrn(lln_StringBuilder *sb, size_t n);
 
 // This appends the file to the current sb if
 // it isn't empty. To reset it do sb.len = 0 before
-const char *lln_read_whole_file(lln_StringBuilder *sb, const char *filename);
+LLN_API const char *lln_read_whole_file(lln_StringBuilder *sb, const char *filename);
 
 typedef enum {
 	ARG_INT,
 	ARG_FLT,
 	ARG_STR,
 	ARG_BOOL,
+	ARG_INT_ARR,
+	ARG_FLT_ARR,
+	ARG_DBL_ARR,
+	ARG_BLOB,
+	ARG_I64,
+	ARG_DBL,
 	ARG_COUNT
 } lln_ArgType;
 #define ARG_INVALID ((lln_ArgType)-1)
@@ -108,7 +231,7 @@ _Static_assert(ARG_COUNT < 127, "Too many ArgTypes! -1 may conflict with a real
 
 // [!!!] should be modified in implementation
 // if the enum above is
-extern const char* LLN_ARGTYPE_STR[];
+extern LLN_API const char* LLN_ARGTYPE_STR[];
 
 typedef struct {
 	lln_ArgType *items;
@@ -116,11 +239,22 @@ typedef struct {
 	size_t capacity;
 } lln_ArgTypes;
 
+// Array items and blob bytes are stored contiguously, aligned to LLN_ARR_ALIGN
+#ifndef LLN_ARR_ALIGN
+#define LLN_ARR_ALIGN 64
+#endif // LLN_ARR_ALIGN
+
 typedef union {
 	int i;
 	float f;
+	int64_t l;
+	double d;
 	bool b;
 	char *s;
+	struct {
+		void *items;
+		size_t count;
+	} arr;
 } lln_ArgValue;
 
 typedef struct {
@@ -136,11 +270,35 @@ typedef struct {
 
 typedef void *(*lln_CommandFnPtr)(lln_Args);
 
+// Consecutive calls to a batch command, column by column: columns[i] holds
+// the count values of the i-th argument as an array of its C type (int *,
+// char **, ...), lln_ArgValue * for arrays and blobs
+typedef struct {
+	void **columns;
+	size_t count;
+} lln_Batch;
+
+typedef void *(*lln_BatchFnPtr)(lln_Batch);
+
+// Command added at run time with lln_callables_add, e.g. by a language
+// binding: user is the pointer it was added with
+typedef void *(*lln_GenericFnPtr)(void *user, lln_Args args);
+
+// Most calls a batch is collected up to before it runs
+#ifndef LLN_BATCH_MAX
+#define LLN_BATCH_MAX 1024
+#endif // LLN_BATCH_MAX
+
 typedef struct {
 	const char *name;
 	lln_ArgTypes signature;
 
 	lln_CommandFnPtr fnptr;
+	lln_BatchFnPtr batch_fnptr; // set instead of fnptr for batch commands
+	bool pure; // same arguments, same output: identical calls can be cached
+	double timeout; // seconds a call may run before the script is cancelled, 0 for no limit
+	lln_GenericFnPtr generic_fnptr; // set instead of fnptr for commands added at run time
+	void *user;
 } lln_Callable;
 
 typedef struct {
@@ -149,19 +307,227 @@ typedef struct {
 	size_t capacity;
 	void (* pre)(void);
 	void (* post)(void);
+	// Open addressing over index_mask + 1 slots (a power of two): from slot
+	// lln_name_hash(name) & index_mask on, the slots hold 1 + the index in
+	// items of the commands whose names hash there, until a 0. NULL to look
+	// commands up one by one.
+	const uint32_t *index;
+	size_t index_mask;
+	bool runtime; // made by lln_callables_new, whose items and index are on the heap
 } lln_Callables;
 
+// Hash of command names in lln_Callables.index (32-bit FNV-1a)
+static inline uint32_t lln_name_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char) name[i]) * 16777619u;
+	return h;
+}
+
+// Appends n commands at once, e.g. the constant table of a unit. An index
+// built before wouldn't cover them, so it is dropped: commands are looked
+// up one by one until it is rebuilt, as loading a plugin does once it
+// registered its commands.
+static inline int lln_callables_extend(lln_Callables *cs, const lln_Callable *items, size_t n) {
+	if (cs->count + n > cs->capacity) {
+		void *temp = LLN_DA_REALLOC(cs->items, (cs->count + n) * sizeof(lln_Callable));
+		if (!temp) return -1;
+		cs->items = (lln_Callable *) temp;
+		cs->capacity = cs->count + n;
+	}
+	if (n) memcpy(cs->items + cs->count, items, n * sizeof(lln_Callable));
+	cs->count += n;
+	cs->index = NULL;
+	cs->index_mask = 0;
+	return 0;
+}
+
+// Commands built at run time, without a plugin or a C compiler
+LLN_API lln_Callables *lln_callables_new(void);
+// Adds a command called name ('!' added if missing) whose arguments have the
+// types in signature, one letter each:
+//   i int, l int64_t, f float, d double, b bool, s char *,
+//   I int *, F float *, D double *, x blob (uint8_t *)
+// Calls run fn(user, args); fn may be NULL if only the caller makes them,
+// e.g. from lln_stream_next. Only for commands from lln_callables_new, not
+// the tables of plugins. Returns -1 if cs is such a table, the name is
+// taken, isn't a valid command name, or the signature has another letter.
+LLN_API int lln_callables_add(lln_Callables *cs, const char *name, const char *signature, lln_GenericFnPtr fn, void *user);
+// Frees a table from lln_callables_new, but not its user pointers; other
+// tables are left alone
+LLN_API void lln_callables_free(lln_Callables *cs);
+
+
+LLN_API void lln_run_lln_file(const char *filename, const lln_Callables *c);
+
+// Commands validated ahead of execution in pipelined mode, by default
+#ifndef LLN_PIPELINE_LOOKAHEAD
+#define LLN_PIPELINE_LOOKAHEAD 256
+#endif // LLN_PIPELINE_LOOKAHEAD
+
+// Pure command calls cached by default
+#ifndef LLN_MEMO_SIZE
+#define LLN_MEMO_SIZE 1024
+#endif // LLN_MEMO_SIZE
+
+// Bytes of lexed input a stream keeps at least before dropping them
+#ifndef LLN_STREAM_COMPACT
+#define LLN_STREAM_COMPACT (64*1024)
+#endif // LLN_STREAM_COMPACT
+
+// Bytes of script each thread gets at least when lexing in parallel
+#ifndef LLN_LEX_CHUNK_MIN
+#define LLN_LEX_CHUNK_MIN (1024*1024)
+#endif // LLN_LEX_CHUNK_MIN
+
+// Bytes of diagnostics held in memory before they are written out
+#ifndef LLN_DIAG_BUFFER
+#define LLN_DIAG_BUFFER (64*1024)
+#endif // LLN_DIAG_BUFFER
+
+// Zero-initialized options run like lln_run_lln_file
+typedef struct {
+	// lex and validate on a separate thread, ahead of execution
+	bool pipelined;
+	// most commands validated ahead, 0 for LLN_PIPELINE_LOOKAHEAD
+	size_t lookahead;
+	// don't cache the calls to pure commands
+	bool no_memo;
+	// most pure calls cached, least recently used dropped first, 0 for LLN_MEMO_SIZE
+	size_t memo_size;
+	// file the cache is loaded from and saved to, to share it between runs
+	const char *memo_path;
+	// seconds the commands may run in total, 0 for no limit
+	double deadline;
+	// seconds a call may run unless its command sets a timeout, 0 for no limit
+	double cmd_timeout;
+	// threads lexing and validating the whole script in chunks before
+	// anything runs, 0 or 1 for none; fewer on scripts under
+	// lex_chunk bytes a thread
+	size_t lex_threads;
+	// bytes of script each lexing thread gets at least, 0 for LLN_LEX_CHUNK_MIN
+	size_t lex_chunk;
+	// most invalid command diagnostics reported, then only counted, 0 for no limit
+	size_t max_errors;
+	// diagnostics as JSON lines, as lln --check prints them
+	bool json_diags;
+	// count the allocations of the run and report them on stderr
+	bool mem_stats;
+	// file the commands run are recorded to, for lln_replay_trace
+	const char *record_path;
+	// lln_replay_trace: the recorded time between calls times this, 0 to
+	// run them back to back
+	double replay_scale;
+} lln_RunOptions;
+
+// Returned (and exited with by the CLI) when a script ran out of time, as timeout(1)
+#define LLN_EXIT_TIMEOUT 124
+
+// Seconds a cancelled call gets to return, after which post() runs
+// without it and the process exits with LLN_EXIT_TIMEOUT
+#ifndef LLN_CANCEL_GRACE
+#define LLN_CANCEL_GRACE 1.0
+#endif // LLN_CANCEL_GRACE
+
+// returns 0 if success, -1 if the file couldn't be read,
+// LLN_EXIT_TIMEOUT if the script ran out of time
+LLN_API int lln_run_lln_file_opts(const char *filename, const lln_Callables *c, const lln_RunOptions *opts);
+
+// Runs the commands of a trace recorded with record_path, without lexing
+// or validating anything: each must exist in c, with the same arguments.
+// Returns as lln_run_lln_file_opts, -1 also if the trace is invalid.
+LLN_API int lln_replay_trace(const char *filename, const lln_Callables *c, const lln_RunOptions *opts);
+
+// True once the script or the running call is out of time. The remaining
+// commands are skipped and post() still runs; long commands should poll
+// this and return early.
+LLN_API bool lln_cancelled(void);
+
+// Incremental lexing of a script that arrives in chunks, e.g. streamed
+// model output. Commands come out as soon as they are complete, exactly
+// as if the whole script had been lexed at once.
+typedef struct lln_Stream lln_Stream;
+
+// name is the filename in diagnostics
+LLN_API lln_Stream *lln_stream_new(const char *name, const lln_Callables *c);
+// appends n bytes to the script
+LLN_API void lln_stream_feed(lln_Stream *s, const char *data, size_t n);
+// no more input: what is left is the end of the script
+LLN_API void lln_stream_close(lln_Stream *s);
+// Next valid command complete so far, its arguments cast to the signature
+// in args until the next call. NULL when it needs more input, or when a
+// closed stream is done. Invalid commands are reported on stderr.
+LLN_API const lln_Callable *lln_stream_next(lln_Stream *s, lln_Args *args);
+LLN_API void lln_stream_free(lln_Stream *s);
+
+// Shared-memory transport: a long-lived executor (`lln -serve fd plugin.so`)
+// runs the scripts a host process writes into a ring in shared memory (a
+// memfd), and writes a completion record for every command into another.
+// Scripts are lexed where they are in the ring, and records are read where
+// they are, so nothing goes through files or pipes. Each side sleeps on a
+// futex when its ring is empty or full.
+typedef struct lln_Shm lln_Shm;
+
+// Record of a command, or of the end of a script (index LLN_SHM_END)
+typedef struct {
+	uint32_t size; // of the record and its payload, padded, in the ring
+	uint32_t kind; // internal
+	uint32_t script; // id returned by lln_shm_commit
+	uint32_t index; // of the command in the script, invalid ones included
+	int32_t status; // lln_ShmStatus, or for LLN_SHM_END 0 or LLN_EXIT_TIMEOUT
+	uint32_t payload_len; // bytes following the record
+	uint64_t duration_ns; // of the call, or for LLN_SHM_END of the script
+} lln_ShmRecord;
 
-void lln_run_lln_file(const char *filename, const lln_Callables *c);
+#define LLN_SHM_END UINT32_MAX
+
+typedef enum {
+	LLN_SHM_OK = 0, // payload: what the command passed to lln_set_result
+	LLN_SHM_INVALID, // payload: the diagnostic, as printed by lln -ro (or a JSON line with json_diags)
+} lln_ShmStatus;
+
+// Creates a transport whose rings hold sub_size bytes of scripts and
+// comp_size bytes of records (rounded up to powers of two), in a memfd
+// that child processes inherit. A script or a record takes at most half
+// its ring. NULL on error.
+LLN_API lln_Shm *lln_shm_create(size_t sub_size, size_t comp_size);
+// Maps the transport of another process, NULL if fd isn't one
+LLN_API lln_Shm *lln_shm_attach(int fd);
+LLN_API int lln_shm_fd(const lln_Shm *shm);
+// Space for a script of n bytes in the ring, to write it in place.
+// Waits for the executor to free enough; NULL if it takes more than half
+// the ring.
+LLN_API char *lln_shm_reserve(lln_Shm *shm, size_t n);
+// Submits the first n bytes written in the last reserved space, returns
+// the id of the script in its records
+LLN_API uint32_t lln_shm_commit(lln_Shm *shm, size_t n);
+// lln_shm_reserve, memcpy and lln_shm_commit; UINT32_MAX if too big
+LLN_API uint32_t lln_shm_submit(lln_Shm *shm, const char *script, size_t n);
+// Next record, valid until the next call, which frees its space. Waits
+// for one if wait; NULL if there is none, or once the executor exited.
+LLN_API const lln_ShmRecord *lln_shm_next(lln_Shm *shm, bool wait);
+// No more scripts: the executor exits once it ran the submitted ones
+LLN_API void lln_shm_close(lln_Shm *shm);
+// Unmaps the transport. An executor still serving it drops the records it
+// has no room for, rather than waiting for them to be read.
+LLN_API void lln_shm_free(lln_Shm *shm);
+// Runs the submitted scripts until the transport is closed. Diagnostics go
+// to the records rather than stderr. Returns 0, or -1 on a bad transport.
+LLN_API int lln_shm_serve(lln_Shm *shm, const lln_Callables *c, const lln_RunOptions *opts);
+
+// Called by a command served through lln_shm_serve, attaches n bytes to
+// its completion record. Ignored otherwise. Calls to pure commands replayed
+// from the cache have no payload.
+LLN_API void lln_set_result(const void *data, size_t n);
 
 #define LLN_declare_command(name, ...)                                     \
 	LLN_declare_command_custom_name("!" #name, name, __VA_ARGS__)
 #define LLN_declare_command_custom_name(cmdname, fnname, ...)              \
 	static const lln_ArgType __LLN_##fnname##_sign[] = {__VA_ARGS__};      \
 	void *fnname(lln_Args __LLN_args);                                     \
-	static lln_Callable __LLN_##fnname##_call = (lln_Callable) {           \
-        .name = cmdname,                                                   \
-		.signature = (lln_ArgTypes) {                                      \
+	__attribute__((unused))                                                \
+	static lln_Callable __LLN_##fnname##_call = {                          \
+		.name = cmdname,                                                   \
+		.signature = {                                                     \
 			.items = (lln_ArgType *) &__LLN_##fnname##_sign[0],            \
 			.count = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType),    \
 			.capacity = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType), \
@@ -170,6 +536,42 @@ void lln_run_lln_file(const char *filename, const lln_Callables *c);
 	};                                                                     \
 	void *fnname(lln_Args __LLN_args)
 
+#define LLN_declare_batch_command(name, ...)                               \
+	LLN_declare_batch_command_custom_name("!" #name, name, __VA_ARGS__)
+#define LLN_declare_batch_command_custom_name(cmdname, fnname, ...)        \
+	static const lln_ArgType __LLN_##fnname##_sign[] = {__VA_ARGS__};      \
+	void *fnname(lln_Batch __LLN_batch);                                   \
+	__attribute__((unused))                                                \
+	static lln_Callable __LLN_##fnname##_call = {                          \
+		.name = cmdname,                                                   \
+		.signature = {                                                     \
+			.items = (lln_ArgType *) &__LLN_##fnname##_sign[0],            \
+			.count = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType),    \
+			.capacity = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType), \
+		},                                                                 \
+		.batch_fnptr = fnname,                                             \
+	};                                                                     \
+	void *fnname(lln_Batch __LLN_batch)
+
+// Fields of a declared command, in a constant table of commands (what
+// the preprocessor emits rather than registering commands one by one)
+#define LLN_command_fields(cmdname, fnname)                                \
+	.name = cmdname,                                                       \
+	.signature = {                                                         \
+		.items = (lln_ArgType *) &__LLN_##fnname##_sign[0],                \
+		.count = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType),        \
+		.capacity = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType),     \
+	},                                                                     \
+	.fnptr = fnname
+#define LLN_batch_command_fields(cmdname, fnname)                          \
+	.name = cmdname,                                                       \
+	.signature = {                                                         \
+		.items = (lln_ArgType *) &__LLN_##fnname##_sign[0],                \
+		.count = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType),        \
+		.capacity = sizeof(__LLN_##fnname##_sign)/sizeof(lln_ArgType),     \
+	},                                                                     \
+	.batch_fnptr = fnname
+
 #define LLN_declare_pre  \
 	void __LLN_pre(void)
 	
@@ -180,8 +582,24 @@ void lln_run_lln_file(const char *filename, const lln_Callables *c);
 	callables->pre = __LLN_pre;
 #define LLN_register_post(callables) \
 	callables->post = __LLN_post;
+#ifndef __LLN_PREPROCESSED_FILE
+#define LLN_mark_pure(fnname) \
+	(__LLN_##fnname##_call.pure = true)
+#define LLN_set_timeout(fnname, secs) \
+	(__LLN_##fnname##_call.timeout = (secs))
+#else
+// The commands of a preprocessed file are in a constant table, which
+// these can't change: '// @cmd pure' and '// @cmd timeout=secs' do
+#define LLN_mark_pure(fnname) \
+	_Static_assert(0, "LLN_mark_pure doesn't apply to preprocessed files, use '// @cmd pure'")
+#define LLN_set_timeout(fnname, secs) \
+	_Static_assert(0, "LLN_set_timeout doesn't apply to preprocessed files, use '// @cmd timeout=secs'")
+#endif // __LLN_PREPROCESSED_FILE
+// Drops the index of callables like lln_callables_extend
 #define LLN_register_command(callables, fnname) \
 	assert(__LLN_##fnname##_call.name[0] == '!' && "ERROR: command names must start with '!'"); \
+	(callables)->index = NULL; \
+	(callables)->index_mask = 0; \
 	lln_da_append(callables, __LLN_##fnname##_call)
 #define LLN_arg_str(i)           \
 	(assert(__LLN_args.items[i].type == ARG_STR), __LLN_args.items[i].value.s)
@@ -191,9 +609,27 @@ void lln_run_lln_file(const char *filename, const lln_Callables *c);
 	(assert(__LLN_args.items[i].type == ARG_FLT), __LLN_args.items[i].value.f)
 #define LLN_arg_bool(i)          \
 	(assert(__LLN_args.items[i].type == ARG_BOOL), __LLN_args.items[i].value.b)
-
-
-void __lln_preproc_register_commands(void);
+#define LLN_arg_i64(i)           \
+	(assert(__LLN_args.items[i].type == ARG_I64), __LLN_args.items[i].value.l)
+#define LLN_arg_dbl(i)           \
+	(assert(__LLN_args.items[i].type == ARG_DBL), __LLN_args.items[i].value.d)
+#define LLN_arg_int_arr(i)       \
+	(assert(__LLN_args.items[i].type == ARG_INT_ARR), (int *) __LLN_args.items[i].value.arr.items)
+#define LLN_arg_flt_arr(i)       \
+	(assert(__LLN_args.items[i].type == ARG_FLT_ARR), (float *) __LLN_args.items[i].value.arr.items)
+#define LLN_arg_dbl_arr(i)       \
+	(assert(__LLN_args.items[i].type == ARG_DBL_ARR), (double *) __LLN_args.items[i].value.arr.items)
+#define LLN_arg_blob(i)          \
+	(assert(__LLN_args.items[i].type == ARG_BLOB), (uint8_t *) __LLN_args.items[i].value.arr.items)
+#define LLN_arg_len(i)           \
+	(__LLN_args.items[i].value.arr.count)
+#define LLN_batch_col(type, i)   \
+	((type *) __LLN_batch.columns[i])
+#define LLN_batch_len()          \
+	(__LLN_batch.count)
+
+
+LLN_API void __lln_preproc_register_commands(void);
 #ifndef __LLN_PREPROCESSED_FILE
 
 static inline void __lln_noop_run(const char* filename) {
@@ -204,8 +640,18 @@ static inline void __lln_noop_run(const char* filename) {
 #define self_register_commands() ((void) 0)
 
 #else // __LLN_PREPROCESSED_FILE 
-	  
-lln_Callables __lln_preproc_callables;
+
+// A single-file build defines the callables read-only at the end of the
+// file, commands and index included. In a multi-file build, the first unit
+// owns them and gathers the table of every other unit N when registering,
+// and __lln_preproc_register_unit_N() only sets pre/post.
+#if defined(__LLN_PREPROCESSED_EXTRA_UNIT)
+extern lln_Callables __lln_preproc_callables;
+#elif defined(__LLN_PREPROCESSED_UNITS)
+LLN_API lln_Callables __lln_preproc_callables;
+#else
+extern LLN_API const lln_Callables __lln_preproc_callables;
+#endif // __LLN_PREPROCESSED_EXTRA_UNIT
 #define lln_run(filename) self_register_commands();\
 	lln_run_lln_file(filename, &__lln_preproc_callables)
 #define self_register_commands() __lln_preproc_register_commands()
@@ -0,0 +1,54 @@
+// Runs a script with !printf(s, i) through a custom allocator, and checks
+// that every allocation of the run went through it and was counted
+#include "../lln.h"
+#include <stdio.h>
+
+static size_t live, calls;
+
+static void *test_malloc(void *user, size_t size, size_t align) {
+	(void) user;
+	live++;
+	calls++;
+	return align ? aligned_alloc(align, size) : malloc(size);
+}
+
+static void *test_realloc(void *user, void *ptr, size_t size) {
+	(void) user;
+	if (!ptr) live++;
+	calls++;
+	return realloc(ptr, size);
+}
+
+static void test_free(void *user, void *ptr) {
+	(void) user;
+	live--;
+	free(ptr);
+}
+
+static void *print(void *user, lln_Args args) {
+	(void) user;
+	printf("%s, %d\n", args.items[0].value.s, args.items[1].value.i);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [script.lln]\n", argv[0]);
+		return 1;
+	}
+	lln_Allocator a = { .malloc = test_malloc, .realloc = test_realloc, .free = test_free };
+	lln_set_allocator(&a);
+	lln_Callables *cs = lln_callables_new();
+	lln_callables_add(cs, "printf", "si", print, NULL);
+	size_t before = calls;
+	lln_mem_count(true);
+	lln_run_lln_file(argv[1], cs);
+	lln_MemStats s = lln_mem_stats();
+	lln_mem_count(false);
+	lln_callables_free(cs);
+	if (live != 0 || s.allocs != calls - before || s.commands == 0 || s.sites[LLN_MEM_FILE] == 0) {
+		fprintf(stderr, "ERROR: %zu blocks left, %zu allocations counted out of %zu.\n", live, s.allocs, calls - before);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+#include <lln/lln.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// @cmd
+void *sum(const int *xs, size_t n) {
+	long total = 0;
+	for (size_t i = 0; i < n; i++) total += xs[i];
+	printf("sum of %zu ints: %ld (aligned: %d)\n", n, total, (uintptr_t) xs % LLN_ARR_ALIGN == 0);
+	return NULL;
+}
+
+// @cmd
+void *mean(char *label, float *xs, size_t n) {
+	float total = 0;
+	for (size_t i = 0; i < n; i++) total += xs[i];
+	printf("%s: %.3f\n", label, n ? total / n : 0.0f);
+	return NULL;
+}
+
+// @cmd
+void *dot(double *a, size_t an, double *b, size_t bn) {
+	double total = 0;
+	for (size_t i = 0; i < an && i < bn; i++) total += a[i] * b[i];
+	printf("dot: %.4f\n", total);
+	return NULL;
+}
@@ -0,0 +1,24 @@
+#include <lln/lln.h>
+#include <stdio.h>
+
+// @cmd batch
+void *insert(int *ids, char **names, size_t n) {
+	printf("insert %zu rows:", n);
+	for (size_t i = 0; i < n; i++) printf(" %d=%s", ids[i], names[i]);
+	printf("\n");
+	return NULL;
+}
+
+// @cmd !tick batch
+void *ticks(const int64_t *values, size_t n) {
+	int64_t total = 0;
+	for (size_t i = 0; i < n; i++) total += values[i];
+	printf("%zu ticks, total %ld\n", n, (long) total);
+	return NULL;
+}
+
+// @cmd
+void *commit(void) {
+	printf("commit\n");
+	return NULL;
+}
@@ -0,0 +1,18 @@
+#include <lln/lln.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// @cmd
+void *digest(char *label, const uint8_t *data, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) h = (h ^ data[i]) * 16777619u;
+	printf("%s: %zu bytes, fnv1a %08x\n", label, len, h);
+	return NULL;
+}
+
+// @cmd
+void *show(uint8_t *data, size_t len) {
+	for (size_t i = 0; i < len; i++) putchar(data[i] ? data[i] : '0');
+	putchar('\n');
+	return NULL;
+}
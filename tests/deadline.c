@@ -0,0 +1,24 @@
+#include <lln/lln.h>
+#include <stdio.h>
+#include <time.h>
+
+// @post
+void report(void) {
+	printf("post ran\n");
+}
+
+// @cmd
+void *say(char *s) {
+	printf("%s\n", s);
+	return NULL;
+}
+
+// Waits to be cancelled, polling every millisecond for up to 5 seconds
+// @cmd timeout=0.05
+void *wait_cancel(void) {
+	for (int i = 0; i < 5000 && !lln_cancelled(); i++) {
+		nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+	}
+	printf("cancelled: %s\n", lln_cancelled() ? "yes" : "no");
+	return NULL;
+}
@@ -0,0 +1,8 @@
+#include <lln/lln.h>
+#include <stdio.h>
+
+// @cmd
+void *greet(char *name, int times) {
+	for (int i = 0; i < times; i++) printf("hello %s\n", name);
+	return NULL;
+}
@@ -0,0 +1,31 @@
+#include <lln/lln.h>
+#include <stdio.h>
+
+static int calls = 0;
+
+// @post
+void report(void) {
+	printf("lookup ran %d times\n", calls);
+}
+
+// @cmd pure
+void *lookup(char *key, int version) {
+	calls++;
+	printf("%s@%d -> %zu\n", key, version, strlen(key) * 10 + version);
+	return NULL;
+}
+
+// @cmd !sum pure
+void *sum(double *xs, size_t n) {
+	calls++;
+	double total = 0;
+	for (size_t i = 0; i < n; i++) total += xs[i];
+	printf("sum %g\n", total);
+	return NULL;
+}
+
+// @cmd
+void *tick(void) {
+	printf("tick\n");
+	return NULL;
+}
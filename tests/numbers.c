@@ -0,0 +1,36 @@
+#include <lln/lln.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// @cmd
+void *i32(int x) {
+	printf("int: %d\n", x);
+	return NULL;
+}
+
+// @cmd
+void *i64(int64_t x) {
+	printf("int64_t: %" PRId64 "\n", x);
+	return NULL;
+}
+
+// @cmd
+void *f32(float x) {
+	printf("float: %.9g\n", x);
+	return NULL;
+}
+
+// @cmd
+void *f64(double x) {
+	printf("double: %.17g\n", x);
+	return NULL;
+}
+
+// @cmd
+void *ints(const int *xs, size_t n) {
+	printf("ints:");
+	for (size_t i = 0; i < n; i++) printf(" %d", xs[i]);
+	printf("\n");
+	return NULL;
+}
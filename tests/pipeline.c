@@ -0,0 +1,32 @@
+#include <lln/lln.h>
+#include <stdio.h>
+
+// @pre
+void start(void) {
+	printf("start\n");
+}
+
+// @post
+void end(void) {
+	printf("end\n");
+}
+
+// @cmd
+void *say(char *s, int n) {
+	printf("%s %d\n", s, n);
+	return NULL;
+}
+
+// @cmd
+void *total(int *xs, size_t n) {
+	int sum = 0;
+	for (size_t i = 0; i < n; i++) sum += xs[i];
+	printf("total %d\n", sum);
+	return NULL;
+}
+
+// @cmd !log batch
+void *log_lines(char **lines, size_t n) {
+	for (size_t i = 0; i < n; i++) printf("log %zu/%zu: %s\n", i + 1, n, lines[i]);
+	return NULL;
+}
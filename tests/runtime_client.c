@@ -0,0 +1,37 @@
+// Runs a script with !printf(s, i) added at run time, without a plugin,
+// the way language bindings register their commands
+#include "../lln.h"
+#include <stdio.h>
+
+static void *print(void *user, lln_Args args) {
+	int *calls = user;
+	(*calls)++;
+	printf("%s, %d\n", args.items[0].value.s, args.items[1].value.i);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [script.lln]\n", argv[0]);
+		return 1;
+	}
+	int calls = 0;
+	lln_Callables *cs = lln_callables_new();
+	if (!cs || lln_callables_add(cs, "printf", "si", print, &calls) != 0) {
+		fprintf(stderr, "ERROR: couldn't add '!printf'.\n");
+		return 1;
+	}
+	// taken name, unknown signature letter, invalid name, and a table that
+	// isn't from lln_callables_new, like the constant ones of plugins
+	lln_Callables constant = {0};
+	if (lln_callables_add(cs, "!printf", "", print, &calls) == 0
+		|| lln_callables_add(cs, "!other", "iq", print, &calls) == 0
+		|| lln_callables_add(cs, "!a b", "", print, &calls) == 0
+		|| lln_callables_add(&constant, "!other", "", print, &calls) == 0) {
+		fprintf(stderr, "ERROR: an invalid command was added.\n");
+		return 1;
+	}
+	lln_run_lln_file(argv[1], cs);
+	lln_callables_free(cs);
+	return calls > 0 ? 0 : 1;
+}
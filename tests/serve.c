@@ -0,0 +1,38 @@
+#include <lln/lln.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int total = 0;
+
+// @cmd
+void *add(int n) {
+	total += n;
+	char out[32];
+	int len = snprintf(out, sizeof(out), "%d", total);
+	printf("total %d\n", total);
+	lln_set_result(out, len);
+	return NULL;
+}
+
+// @cmd
+void *echo(char *s) {
+	printf("%s\n", s);
+	lln_set_result(s, strlen(s));
+	return NULL;
+}
+
+// @cmd
+void *tick(void) {
+	printf("tick\n");
+	return NULL;
+}
+
+// @cmd
+void *fill(int n) {
+	char *out = malloc(n);
+	memset(out, 'x', n);
+	lln_set_result(out, n);
+	free(out);
+	return NULL;
+}
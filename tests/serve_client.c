@@ -0,0 +1,85 @@
+// Submits serve.lln twice to `lln -serve` over shared memory, then scripts
+// and payloads near the size of the default rings, and prints the records
+// it gets back (without their durations)
+#include "../lln.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static char *read_file(const char *path, size_t *n) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	*n = ftell(f);
+	rewind(f);
+	char *s = malloc(*n);
+	if (fread(s, 1, *n, f) != *n) *n = 0;
+	fclose(f);
+	return s;
+}
+
+// Prints the records up to the end of a script, or all of them if
+// scripts < 0, until the executor exited
+static void print_records(lln_Shm *shm, int scripts) {
+	const lln_ShmRecord *rec;
+	while (scripts != 0 && (rec = lln_shm_next(shm, true))) {
+		if (rec->index == LLN_SHM_END) {
+			printf("script %u: end, status %d\n", rec->script, rec->status);
+			scripts--;
+			continue;
+		}
+		const char *status = rec->status == LLN_SHM_OK ? "ok" : "invalid";
+		if (rec->payload_len > 256) {
+			printf("script %u, command %u: %s, %u bytes\n", rec->script, rec->index, status, rec->payload_len);
+			continue;
+		}
+		printf("script %u, command %u: %s '%.*s'\n", rec->script, rec->index,
+			status, (int) rec->payload_len, (const char *) (rec + 1));
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s [lln] [script.lln] [commands.so]\n", argv[0]);
+		return 1;
+	}
+	size_t n;
+	char *script = read_file(argv[2], &n);
+	lln_Shm *shm = lln_shm_create(0, 0);
+	if (!script || !shm) {
+		fprintf(stderr, "ERROR: couldn't set the test up.\n");
+		return 1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		char fd[16];
+		snprintf(fd, sizeof(fd), "%d", lln_shm_fd(shm));
+		if (!freopen("/dev/null", "w", stdout)) _exit(1);
+		execlp(argv[1], argv[1], "-serve", fd, argv[3], (char *) NULL);
+		_exit(127);
+	}
+	for (int i = 0; i < 2; i++) lln_shm_submit(shm, script, n);
+	print_records(shm, 2);
+	// scripts and payloads of almost half the rings, one at a time since
+	// two don't fit; the second wraps around the end of the rings
+	char big[2048 - 32];
+	int len = snprintf(big, sizeof(big), "!fill(4000)\n!echo(\"");
+	memset(big + len, 'y', sizeof(big) - len);
+	memcpy(big + sizeof(big) - 3, "\")\n", 3);
+	for (int i = 0; i < 2; i++) {
+		if (lln_shm_submit(shm, big, sizeof(big)) == UINT32_MAX) printf("big script refused\n");
+		else print_records(shm, 1);
+	}
+	char *huge = calloc(4050, 1);
+	if (lln_shm_submit(shm, huge, 4050) == UINT32_MAX) printf("huge script refused\n");
+	free(huge);
+	lln_shm_close(shm);
+	print_records(shm, -1);
+	int status;
+	waitpid(pid, &status, 0);
+	lln_shm_free(shm);
+	free(script);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
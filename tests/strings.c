@@ -0,0 +1,9 @@
+#include <lln/lln.h>
+#include <stdio.h>
+#include <string.h>
+
+// @cmd
+void *echo(char *s) {
+	printf("[%s] (%zu bytes)\n", s, strlen(s));
+	return NULL;
+}
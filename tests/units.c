@@ -0,0 +1,8 @@
+#include <lln/lln.h>
+#include <stdio.h>
+
+// @cmd
+void *area(int w, int h) {
+	printf("area %d\n", w * h);
+	return NULL;
+}
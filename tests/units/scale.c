@@ -0,0 +1,9 @@
+#include <lln/lln.h>
+#include <stdio.h>
+#include "scale.h"
+
+// @cmd
+void *scale(double k) {
+	printf("scale %.1f %s\n", k, SCALE_UNIT);
+	return NULL;
+}
@@ -0,0 +1,2 @@
+// only found next to scale.c, through the -iquote of its unit
+#define SCALE_UNIT "cm"